@@ -0,0 +1,450 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Measures how fast dmcc::inotify delivers the events of a synthetic
+// workload. Every file goes through create, modify, rename and delete
+// in a tree of fanout^depth directories. The create-to-slot latency is
+// measured by the sequence number encoded in the file names.
+//
+// A run can be recorded with --record, and the log replayed with
+// --replay to measure the slots against the same traffic without a
+// filesystem.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "inotify/inotify.hpp"
+#include "inotify/event_log.hpp"
+#include "inotify/sharded_backend.hpp"
+
+namespace fs = boost::filesystem;
+namespace pt = boost::posix_time;
+
+
+namespace {
+    struct options
+    {
+        fs::path dir;
+        unsigned fanout;
+        unsigned depth;
+        unsigned long files;
+        unsigned long rate;
+        unsigned threads;
+        unsigned scan_threads;
+        unsigned shards;
+        bool coalescing;
+        bool pairing;
+        bool statistics;
+        std::string record;
+        std::string replay;
+    };
+
+    uint64_t now_ns()
+    {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+    }
+
+    // Resident set size in bytes.
+    size_t resident()
+    {
+        unsigned long size = 0, pages = 0;
+        FILE* f = std::fopen("/proc/self/statm", "r");
+
+        if(f) {
+            if(std::fscanf(f, "%lu %lu", &size, &pages) != 2)
+                pages = 0;
+            std::fclose(f);
+        }
+
+        return pages * ::sysconf(_SC_PAGESIZE);
+    }
+
+    void build_tree(const fs::path& dir, unsigned fanout, unsigned depth,
+                    std::vector<fs::path>& leaves)
+    {
+        fs::create_directories(dir);
+
+        if(depth == 0) {
+            leaves.push_back(dir);
+            return;
+        }
+
+        for(unsigned i = 0; i < fanout; ++i) {
+            char name[16];
+            std::sprintf(name, "d%u", i);
+            build_tree(dir / name, fanout, depth - 1, leaves);
+        }
+    }
+
+    // When the files were created, written by the generator and read
+    // by the dispatch threads.
+    typedef boost::atomic<uint64_t> stamp_t;
+
+    class collector
+    {
+    public:
+        collector(const stamp_t* created, size_t files)
+            : m_created(created), m_files(files), m_events(0), m_overflows(0), m_last(0)
+        {
+        }
+
+        bool operator()(dmcc::inotify::inotify&,
+                        const dmcc::inotify::event_batch& batch)
+        {
+            uint64_t now = now_ns();
+            size_t overflows = 0;
+
+            // Called by several dispatch threads at once.
+            std::vector<uint64_t> local;
+
+            dmcc::inotify::event_batch::const_iterator it = batch.begin();
+            for(; it != batch.end(); ++it) {
+                if(it->mask() & IN_Q_OVERFLOW)
+                    ++overflows;
+
+                boost::string_ref name = it->name_ref();
+
+                if(!(it->mask() & IN_CREATE) || name.empty() || name[0] != 'f')
+                    continue;
+
+                unsigned long seq = std::strtoul(name.data() + 1, 0, 10);
+
+                if(seq >= m_files)
+                    continue;
+
+                uint64_t created = m_created[seq].load(boost::memory_order_acquire);
+
+                if(created)
+                    local.push_back(now - created);
+            }
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_events += batch.size();
+            m_overflows += overflows;
+            m_last = now;
+            m_latencies.insert(m_latencies.end(), local.begin(), local.end());
+
+            return false;
+        }
+
+        size_t events() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_events;
+        }
+
+        void report(uint64_t start) const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            double seconds = (m_last - start) / 1e9;
+
+            std::printf("events:        %lu\n", static_cast<unsigned long>(m_events));
+            std::printf("events/sec:    %.0f\n", seconds > 0 ? m_events / seconds : 0.0);
+            std::printf("overflows:     %lu\n", static_cast<unsigned long>(m_overflows));
+
+            std::vector<uint64_t> sorted(m_latencies);
+            std::sort(sorted.begin(), sorted.end());
+
+            const double pct[] = { 50, 90, 99, 99.9, 100 };
+            for(size_t i = 0; i < sizeof(pct) / sizeof(pct[0]) && !sorted.empty(); ++i) {
+                size_t idx = static_cast<size_t>(pct[i] / 100 * (sorted.size() - 1));
+                std::printf("latency p%-5g  %.1f us\n", pct[i], sorted[idx] / 1e3);
+            }
+
+            std::printf("latency count: %lu\n", static_cast<unsigned long>(sorted.size()));
+        }
+
+    private:
+        const stamp_t* m_created;
+        size_t m_files;
+
+        mutable boost::mutex m_mutex;
+        size_t m_events;
+        size_t m_overflows;
+        uint64_t m_last;
+        std::vector<uint64_t> m_latencies;
+    };
+
+    // The signals copy their slots, so they all forward to a single
+    // collector.
+    struct collector_ref
+    {
+        typedef bool result_type;
+
+        collector* c;
+
+        bool operator()(dmcc::inotify::inotify& in,
+                        const dmcc::inotify::event_batch& batch) const
+        {
+            return (*c)(in, batch);
+        }
+    };
+
+    void generate(const options& opt, const std::vector<fs::path>& leaves,
+                  stamp_t* created)
+    {
+        char buf[64];
+        uint64_t start = now_ns();
+
+        for(unsigned long seq = 0; seq < opt.files; ++seq) {
+            if(opt.rate) {
+                uint64_t due = start + seq * 1000000000u / opt.rate;
+                uint64_t now = now_ns();
+
+                if(due > now)
+                    boost::this_thread::sleep(pt::microseconds((due - now) / 1000));
+            }
+
+            const fs::path& dir = leaves[seq % leaves.size()];
+
+            std::sprintf(buf, "f%lu", seq);
+            std::string name = (dir / buf).string();
+            std::sprintf(buf, "r%lu", seq);
+            std::string renamed = (dir / buf).string();
+
+            created[seq].store(now_ns(), boost::memory_order_release);
+            int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+            if(fd < 0)
+                continue;
+
+            if(::write(fd, buf, std::strlen(buf)) < 0)
+                std::perror("write");
+
+            ::close(fd);
+            ::rename(name.c_str(), renamed.c_str());
+            ::unlink(renamed.c_str());
+        }
+    }
+
+    void print(const char* name, const dmcc::inotify::histogram& h, double scale)
+    {
+        std::printf("%-18s n=%-9lu mean=%-9.1f p50=%-9.1f p99=%-9.1f max=%.1f\n", name,
+                    static_cast<unsigned long>(h.count()), h.mean() / scale,
+                    h.percentile(50) / scale, h.percentile(99) / scale, h.max() / scale);
+    }
+
+    void print(const dmcc::inotify::statistics& s)
+    {
+        std::printf("reads:         %lu (%lu bytes)\n", static_cast<unsigned long>(s.reads),
+                    static_cast<unsigned long>(s.bytes_read));
+        std::printf("queue limit:   %lu events\n", static_cast<unsigned long>(s.queue_limit));
+        print("read size (B)", s.read_size, 1);
+        print("events/read", s.events_per_read, 1);
+        print("events/wakeup", s.events_per_wakeup, 1);
+        print("slot time (us)", s.slot_time, 1e3);
+        print("batch age (us)", s.batch_age, 1e3);
+    }
+
+    void usage(const char* self)
+    {
+        std::fprintf(stderr,
+                     "usage: %s [options]\n"
+                     "  --dir PATH        tree to work in (default /dev/shm/dmcc-bench)\n"
+                     "  --fanout N        subdirectories per directory (default 8)\n"
+                     "  --depth N         levels of subdirectories (default 2)\n"
+                     "  --files N         files to churn through (default 100000)\n"
+                     "  --rate N          files per second, 0 is unlimited (default 0)\n"
+                     "  --threads N       dispatch threads (default 0)\n"
+                     "  --scan-threads N  threads to add the watches with (default 0)\n"
+                     "  --shards N        spread the watches over N inotify instances\n"
+                     "  --coalesce        merge modifications of the same file\n"
+                     "  --pair-renames    join IN_MOVED_FROM and IN_MOVED_TO\n"
+                     "  --stats           print the library's own statistics\n"
+                     "  --record FILE     log the events of the run\n"
+                     "  --replay FILE     deliver a logged run instead\n",
+                     self);
+        std::exit(1);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    options opt;
+    opt.dir = "/dev/shm/dmcc-bench";
+    opt.fanout = 8;
+    opt.depth = 2;
+    opt.files = 100000;
+    opt.rate = 0;
+    opt.threads = 0;
+    opt.scan_threads = 0;
+    opt.shards = 0;
+    opt.coalescing = false;
+    opt.pairing = false;
+    opt.statistics = false;
+
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if(arg == "--coalesce") {
+            opt.coalescing = true;
+            continue;
+        }
+
+        if(arg == "--pair-renames") {
+            opt.pairing = true;
+            continue;
+        }
+
+        if(arg == "--stats") {
+            opt.statistics = true;
+            continue;
+        }
+
+        if(i + 1 == argc)
+            usage(argv[0]);
+
+        const char* value = argv[++i];
+
+        if(arg == "--dir")
+            opt.dir = value;
+        else if(arg == "--fanout")
+            opt.fanout = std::atoi(value);
+        else if(arg == "--depth")
+            opt.depth = std::atoi(value);
+        else if(arg == "--files")
+            opt.files = std::strtoul(value, 0, 10);
+        else if(arg == "--rate")
+            opt.rate = std::strtoul(value, 0, 10);
+        else if(arg == "--threads")
+            opt.threads = std::atoi(value);
+        else if(arg == "--scan-threads")
+            opt.scan_threads = std::atoi(value);
+        else if(arg == "--shards")
+            opt.shards = std::atoi(value);
+        else if(arg == "--record")
+            opt.record = value;
+        else if(arg == "--replay")
+            opt.replay = value;
+        else
+            usage(argv[0]);
+    }
+
+    size_t files = opt.replay.empty() ? opt.files : 0;
+    boost::scoped_array<stamp_t> created(new stamp_t[files]);
+
+    for(size_t i = 0; i < files; ++i)
+        created[i].store(0, boost::memory_order_relaxed);
+
+    collector c(created.get(), files);
+    collector_ref ref = { &c };
+
+    boost::shared_ptr<dmcc::inotify::backend> backend;
+
+    if(opt.shards)
+        backend.reset(new dmcc::inotify::sharded_backend(opt.shards));
+    else
+        backend.reset(new dmcc::inotify::inotify_backend);
+
+    dmcc::inotify::inotify in(backend);
+
+    if(opt.coalescing)
+        in.set_coalescing(pt::milliseconds(10));
+    if(opt.pairing)
+        in.set_rename_pairing(pt::milliseconds(10));
+
+    in.set_dispatch_threads(opt.threads);
+    in.set_statistics(opt.statistics);
+    in.connect_batch_slot(ref);
+
+    if(!opt.replay.empty()) {
+        dmcc::inotify::event_replayer replayer(opt.replay);
+
+        uint64_t start = now_ns();
+        replayer.run(in);
+        std::printf("replayed:      %lu reads in %.1f ms\n",
+                    static_cast<unsigned long>(replayer.reads()), (now_ns() - start) / 1e6);
+
+        // Let the workers finish.
+        in.set_dispatch_threads(0);
+
+        c.report(start);
+
+        if(opt.statistics)
+            print(in.get_statistics());
+        return 0;
+    }
+
+    if(!opt.record.empty())
+        in.set_recorder(boost::shared_ptr<dmcc::inotify::event_recorder>(
+                            new dmcc::inotify::event_recorder(opt.record)));
+
+    fs::remove_all(opt.dir);
+
+    std::vector<fs::path> leaves;
+    build_tree(opt.dir, opt.fanout, opt.depth, leaves);
+
+    size_t before = resident();
+    uint64_t scan_start = now_ns();
+    in.add_recursive_watch(opt.dir, IN_ALL_EVENTS, opt.scan_threads);
+    uint64_t scan_end = now_ns();
+    size_t dirs = 1;
+
+    for(unsigned level = 0, n = 1; level < opt.depth; ++level)
+        dirs += (n *= opt.fanout);
+
+    std::printf("watches:       %lu\n", static_cast<unsigned long>(dirs));
+    std::printf("watch setup:   %.1f ms\n", (scan_end - scan_start) / 1e6);
+    std::printf("bytes/watch:   %.0f (user space)\n",
+                static_cast<double>(resident() - before) / dirs);
+
+    boost::thread listener(boost::bind(&dmcc::inotify::inotify::listen, &in));
+
+    uint64_t start = now_ns();
+    generate(opt, leaves, created.get());
+    std::printf("generated in:  %.1f ms\n", (now_ns() - start) / 1e6);
+
+    // Wait until the events stopped coming in.
+    for(size_t seen = c.events();;) {
+        boost::this_thread::sleep(pt::milliseconds(200));
+
+        size_t now = c.events();
+        if(now == seen)
+            break;
+        seen = now;
+    }
+
+    in.stop();
+    listener.join();
+
+    c.report(start);
+
+    if(opt.statistics)
+        print(in.get_statistics());
+    fs::remove_all(opt.dir);
+    return 0;
+}
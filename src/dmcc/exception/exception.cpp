@@ -48,7 +48,9 @@ namespace dmcc {
             if(!m_what.empty())
                 s << " " + m_what;
 
-            return s.str().c_str();
+            m_debug_str = s.str();
+
+            return m_debug_str.c_str();
 #endif
         }
 
@@ -71,6 +71,9 @@ namespace dmcc {
 
         private:
             std::string m_what;
+
+            // Keeps the string returned by debug_str() alive.
+            mutable std::string m_debug_str;
         };
 
         // Global operator to make debug_info printable.
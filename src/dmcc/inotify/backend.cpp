@@ -0,0 +1,83 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "backend.hpp"
+
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "exception/raise.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+        backend::~backend()
+        {
+        }
+
+        bool backend::whole_tree() const
+        {
+            return false;
+        }
+
+        bool backend::resolve(int, std::string&, int&)
+        {
+            return false;
+        }
+
+        int backend::remove_watch(int)
+        {
+            errno = ENOTSUP;
+            return -1;
+        }
+
+
+        inotify_backend::inotify_backend()
+            : m_descr(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+        {
+            if(m_descr == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to initialize inotify");
+        }
+
+        inotify_backend::~inotify_backend()
+        {
+            close(m_descr);
+        }
+
+        int inotify_backend::fd() const
+        {
+            return m_descr;
+        }
+
+        int inotify_backend::add_watch(const std::string& path, uint32_t mask, bool)
+        {
+            return inotify_add_watch(m_descr, path.c_str(), mask);
+        }
+
+        ssize_t inotify_backend::read(unsigned char* buf, size_t len)
+        {
+            return ::read(m_descr, buf, len);
+        }
+
+        int inotify_backend::remove_watch(int wd)
+        {
+            return inotify_rm_watch(m_descr, wd);
+        }
+    }
+}
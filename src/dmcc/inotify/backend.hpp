@@ -0,0 +1,110 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_BACKEND_HPP
+#define DMCC_INOTIFY_BACKEND_HPP
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief The kernel interface events are read from.
+
+           Backends hand out events in the layout of struct
+           inotify_event, so everything above them works the same for
+           all of them.
+        */
+        class backend
+        {
+        public:
+            virtual ~backend();
+
+            /**
+               \brief Returns a non-blocking descriptor that becomes
+               readable when events are queued.
+            */
+            virtual int fd() const = 0;
+
+            /**
+               \brief Starts watching path.
+               \param mask The inotify events to watch for.
+               \param recursive true to watch the whole tree below
+               path. Only possible if whole_tree() is true.
+               \return The watch-descriptor, or -1 with errno set.
+            */
+            virtual int add_watch(const std::string& path, uint32_t mask, bool recursive) = 0;
+
+            /**
+               \brief Reads events as struct inotify_event records.
+               \return The number of bytes stored, or -1 with errno
+               set. Fails with EAGAIN if nothing is queued.
+            */
+            virtual ssize_t read(unsigned char* buf, size_t len) = 0;
+
+            /**
+               \brief Tells if a single recursive watch covers a whole
+               tree, instead of one watch per directory.
+            */
+            virtual bool whole_tree() const;
+
+            /**
+               \brief Describes a watch-descriptor the backend created
+               by itself for a directory below a recursive watch.
+               \param path Set to the path of the directory.
+               \param root Set to the descriptor add_watch() returned
+               for the tree.
+               \return false if wd is unknown.
+            */
+            virtual bool resolve(int wd, std::string& path, int& root);
+
+            /**
+               \brief Stops watching a directory. The backend queues
+               IN_IGNORED for wd afterwards.
+               \return 0, or -1 with errno set. Fails with ENOTSUP
+               unless watches are per directory.
+            */
+            virtual int remove_watch(int wd);
+        };
+
+
+        /**
+           \brief Watches every directory with an inotify watch.
+        */
+        class inotify_backend : public backend
+        {
+        public:
+            inotify_backend();
+            ~inotify_backend();
+
+            int fd() const;
+            int add_watch(const std::string& path, uint32_t mask, bool recursive);
+            ssize_t read(unsigned char* buf, size_t len);
+            int remove_watch(int wd);
+
+        private:
+            int m_descr;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_BACKEND_HPP
@@ -0,0 +1,167 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "coalescer.hpp"
+
+#include <cstring>
+
+#include <boost/functional/hash.hpp>
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            const char* raw_name(const inotify_event* ev)
+            {
+                return ev->len > 0 ? ev->name : "";
+            }
+        }
+
+        coalescer::coalescer(uint32_t mask, uint64_t window_ms)
+            : m_mask(mask),
+              m_window(window_ms)
+        {
+        }
+
+        void coalescer::run(const std::vector<event>& in, std::vector<event>& out,
+                            uint64_t now, bool expire_all)
+        {
+            // Everything released last time was dispatched by now.
+            m_released.clear();
+
+            for(std::vector<event>::const_iterator ev = in.begin(); ev != in.end(); ++ev) {
+                if(!ev->m_watch || (ev->mask() & IN_IGNORED)) {
+                    // The watch goes away, nothing may refer to it
+                    // after this event.
+                    release_watch(ev->m_watch, out);
+                    out.push_back(*ev);
+                    continue;
+                }
+
+                const char* name = raw_name(ev->m_event);
+
+                size_t hash = 0;
+                boost::hash_combine(hash, ev->m_watch);
+                boost::hash_range(hash, name, name + strlen(name));
+
+                entry_list_t::iterator it = find(*ev, hash);
+
+                if(!ev->m_from_event && (ev->mask() & ~IN_ISDIR & ~m_mask) == 0) {
+                    if(it != m_held.end()) {
+                        // Merge into the held event.
+                        reinterpret_cast<inotify_event*>(&it->raw[0])->mask |= ev->mask();
+                        continue;
+                    }
+
+                    entry e;
+                    e.parent = ev->m_watch;
+                    e.since = now;
+                    e.hash = hash;
+
+                    const unsigned char* raw =
+                        reinterpret_cast<const unsigned char*>(ev->m_event);
+                    e.raw.assign(raw, raw + sizeof(inotify_event) + ev->m_event->len);
+
+                    // Merged events have no relation to a move.
+                    reinterpret_cast<inotify_event*>(&e.raw[0])->cookie = 0;
+
+                    it = m_held.insert(m_held.end(), e);
+                    m_index.insert(index_t::value_type(hash, it));
+                }
+                else {
+                    // Keep the order: what is held for this file
+                    // happened before.
+                    if(it != m_held.end())
+                        release(it, out);
+
+                    out.push_back(*ev);
+                }
+            }
+
+            // Release expired events, oldest first.
+            while(!m_held.empty() &&
+                  (expire_all || m_held.front().since + m_window <= now))
+                release(m_held.begin(), out);
+        }
+
+        uint64_t coalescer::deadline() const
+        {
+            if(m_held.empty())
+                return 0;
+
+            return m_held.front().since + m_window;
+        }
+
+        uint64_t coalescer::window() const
+        {
+            return m_window;
+        }
+
+        coalescer::entry_list_t::iterator coalescer::find(const event& ev, size_t hash)
+        {
+            const char* name = raw_name(ev.m_event);
+
+            std::pair<index_t::iterator, index_t::iterator> range = m_index.equal_range(hash);
+
+            for(; range.first != range.second; ++range.first) {
+                entry_list_t::iterator it = range.first->second;
+
+                if(it->parent == ev.m_watch &&
+                   strcmp(raw_name(reinterpret_cast<const inotify_event*>(&it->raw[0])),
+                          name) == 0)
+                    return it;
+            }
+
+            return m_held.end();
+        }
+
+        void coalescer::release(entry_list_t::iterator it, std::vector<event>& out)
+        {
+            std::pair<index_t::iterator, index_t::iterator> range = m_index.equal_range(it->hash);
+
+            for(; range.first != range.second; ++range.first) {
+                if(range.first->second == it) {
+                    m_index.erase(range.first);
+                    break;
+                }
+            }
+
+            m_released.splice(m_released.end(), m_held, it);
+
+            event ev;
+            ev.m_event = reinterpret_cast<inotify_event*>(&it->raw[0]);
+            ev.m_watch = it->parent;
+            out.push_back(ev);
+        }
+
+        void coalescer::release_watch(watch* w, std::vector<event>& out)
+        {
+            entry_list_t::iterator it = m_held.begin();
+
+            while(it != m_held.end()) {
+                entry_list_t::iterator next = it;
+                ++next;
+
+                // Events without a watch (overflows) release everything.
+                if(!w || it->parent == w)
+                    release(it, out);
+
+                it = next;
+            }
+        }
+    }
+}
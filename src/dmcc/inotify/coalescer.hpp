@@ -0,0 +1,108 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_COALESCER_HPP
+#define DMCC_INOTIFY_COALESCER_HPP
+
+#include <list>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "inotify.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Merges bursts of events on the same file.
+
+           Events whose mask is covered by the mergeable mask are held
+           back per (watch, name). Further events for the same key
+           are or-ed into the held one. The merged event is released
+           once its window expired or any other event for the same
+           key arrives, so the order per file is kept.
+        */
+        class coalescer
+        {
+        public:
+            /**
+               \param mask The events that may be merged.
+               \param window_ms How long an event is held back in
+               milliseconds. 0 merges within a single read only.
+            */
+            coalescer(uint32_t mask, uint64_t window_ms);
+
+            /**
+               \brief Runs a batch of events through the stage.
+
+               Released events are appended to out. They stay valid
+               until the next call.
+               \param now The current time in milliseconds.
+               \param expire_all Releases all held events when set,
+               regardless of their age.
+            */
+            void run(const std::vector<event>& in, std::vector<event>& out,
+                     uint64_t now, bool expire_all);
+
+            /**
+               \brief Returns the time at which the oldest held event
+               has to be released, or 0 if nothing is held.
+            */
+            uint64_t deadline() const;
+
+            uint64_t window() const;
+
+        private:
+            struct entry
+            {
+                watch* parent;
+                uint64_t since;
+                size_t hash;
+
+                // Copy of the inotify_event including its name.
+                std::vector<unsigned char> raw;
+            };
+
+            typedef std::list<entry> entry_list_t;
+            typedef boost::unordered_multimap<size_t, entry_list_t::iterator> index_t;
+
+            // Returns the held entry for ev or end().
+            entry_list_t::iterator find(const event& ev, size_t hash);
+
+            // Moves an entry to the released events.
+            void release(entry_list_t::iterator it, std::vector<event>& out);
+
+            // Releases all held events of a watch.
+            void release_watch(watch* w, std::vector<event>& out);
+
+            uint32_t m_mask;
+            uint64_t m_window;
+
+            // Held events in the order they arrived.
+            entry_list_t m_held;
+            index_t m_index;
+
+            // Released entries whose events are still being dispatched.
+            entry_list_t m_released;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_COALESCER_HPP
@@ -0,0 +1,353 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "content_filter.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+    const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+    const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+    // Files with fewer blocks are hashed on the calling thread.
+    const size_t PARALLEL_BLOCKS = 8;
+
+    inline uint64_t rotl(uint64_t x, unsigned r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t read64(const unsigned char* p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint32_t read32(const unsigned char* p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t xx_round(uint64_t acc, uint64_t input)
+    {
+        acc += input * PRIME2;
+        return rotl(acc, 31) * PRIME1;
+    }
+
+    inline uint64_t merge_round(uint64_t acc, uint64_t v)
+    {
+        acc ^= xx_round(0, v);
+        return acc * PRIME1 + PRIME4;
+    }
+
+    int64_t mtime_of(const struct stat& st)
+    {
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+}
+
+
+namespace dmcc {
+    namespace inotify {
+        const size_t content_filter::BLOCK_SIZE;
+
+        content_filter::content_filter(uint32_t mask, size_t cache_size, unsigned threads)
+            : m_mask(mask),
+              m_cache_size(std::max<size_t>(cache_size, 1)),
+              m_threads(threads ? threads : boost::thread::hardware_concurrency())
+        {
+        }
+
+        void content_filter::run(const std::vector<event>& in, std::vector<event>& out)
+        {
+            for(std::vector<event>::const_iterator ev = in.begin(); ev != in.end(); ++ev) {
+                uint32_t mask = ev->mask();
+
+                if(mask & IN_ISDIR) {
+                    out.push_back(*ev);
+                    continue;
+                }
+
+                if(ev->is_rename())
+                    forget(ev->old_path(m_old_path).string());
+
+                if(mask & (IN_DELETE | IN_MOVE))
+                    forget(ev->path(m_path).string());
+                else if((mask & m_mask) && (mask & ~m_mask) == 0) {
+                    const std::string& path = ev->path(m_path).string();
+
+                    // Overflows have no path.
+                    if(!path.empty() && !changed(path))
+                        continue;
+                }
+
+                out.push_back(*ev);
+            }
+        }
+
+        bool content_filter::changed(const std::string& path)
+        {
+            // Taken before the file is looked at, see entry::racy.
+            struct timespec sampled;
+            clock_gettime(CLOCK_REALTIME, &sampled);
+
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+            struct stat st;
+
+            if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+                if(fd != -1)
+                    close(fd);
+
+                forget(path);
+                return true;
+            }
+
+            entry& e = touch(path);
+            bool seen = e.ino != 0;
+            bool same_file = seen && e.ino == st.st_ino && e.size == static_cast<uint64_t>(st.st_size);
+
+            if(same_file && e.mtime == mtime_of(st) && !e.racy) {
+                close(fd);
+                return false;
+            }
+
+            e.ino = st.st_ino;
+            e.size = st.st_size;
+            e.mtime = mtime_of(st);
+            e.racy = st.st_mtim.tv_sec >= sampled.tv_sec;
+
+            if(seen && !same_file) {
+                // Growing files would be read on every write.
+                e.hashed = false;
+                close(fd);
+                return true;
+            }
+
+            uint64_t h = 0;
+            bool hashed = hash_file(fd, e.size, h);
+
+            // Written to while hashing, the hash belongs to neither
+            // version.
+            struct stat after;
+
+            if(hashed && (fstat(fd, &after) == -1 || mtime_of(after) != e.mtime ||
+                          after.st_size != st.st_size))
+                hashed = false;
+
+            close(fd);
+
+            bool unchanged = hashed && e.hashed && e.hash == h;
+
+            e.hashed = hashed;
+            e.hash = h;
+
+            return !unchanged;
+        }
+
+        content_filter::entry& content_filter::touch(const std::string& path)
+        {
+            index_t::iterator it = m_index.find(path);
+
+            if(it != m_index.end()) {
+                m_entries.splice(m_entries.begin(), m_entries, it->second);
+                return m_entries.front();
+            }
+
+            if(m_index.size() >= m_cache_size) {
+                // Reuse the least recently used entry.
+                m_index.erase(m_entries.back().path);
+                m_entries.splice(m_entries.begin(), m_entries, --m_entries.end());
+            }
+            else
+                m_entries.push_front(entry());
+
+            entry& e = m_entries.front();
+            e.path = path;
+            e.ino = 0;
+            e.size = 0;
+            e.mtime = 0;
+            e.racy = false;
+            e.hashed = false;
+            e.hash = 0;
+
+            m_index[path] = m_entries.begin();
+
+            return e;
+        }
+
+        void content_filter::forget(const std::string& path)
+        {
+            index_t::iterator it = m_index.find(path);
+
+            if(it == m_index.end())
+                return;
+
+            m_entries.erase(it->second);
+            m_index.erase(it);
+        }
+
+        bool content_filter::hash_file(int fd, uint64_t size, uint64_t& out)
+        {
+            size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            std::vector<uint64_t> hashes(std::max<size_t>(blocks, 1));
+
+            unsigned threads = std::min<size_t>(m_threads, blocks / (PARALLEL_BLOCKS / 2));
+            bool ok = true;
+
+            if(threads <= 1 || blocks < PARALLEL_BLOCKS) {
+                m_buffer.resize(BLOCK_SIZE);
+                hash_blocks(fd, size, 0, blocks, &hashes[0], &ok, &m_buffer);
+            }
+            else {
+                // Contiguous ranges, so the readahead works for every
+                // thread.
+                std::vector<char> results(threads, true);
+                boost::thread_group group;
+
+                for(unsigned t = 0; t < threads; ++t)
+                    group.create_thread(boost::bind(&hash_range, fd, size,
+                                                    blocks * t / threads,
+                                                    blocks * (t + 1) / threads,
+                                                    &hashes[0], &results[t]));
+
+                group.join_all();
+
+                ok = std::find(results.begin(), results.end(), false) == results.end();
+            }
+
+            if(!ok)
+                return false;
+
+            out = hash(&hashes[0], blocks * sizeof(uint64_t), size);
+            return true;
+        }
+
+        void content_filter::hash_range(int fd, uint64_t size, size_t begin, size_t end,
+                                        uint64_t* out, char* ok)
+        {
+            std::vector<unsigned char> buffer(BLOCK_SIZE);
+            bool result = true;
+
+            hash_blocks(fd, size, begin, end, out, &result, &buffer);
+            *ok = result;
+        }
+
+        void content_filter::hash_blocks(int fd, uint64_t size, size_t begin, size_t end,
+                                         uint64_t* out, bool* ok,
+                                         std::vector<unsigned char>* buffer)
+        {
+            for(size_t i = begin; i < end; ++i) {
+                uint64_t offset = static_cast<uint64_t>(i) * BLOCK_SIZE;
+                size_t len = std::min<uint64_t>(BLOCK_SIZE, size - offset);
+                size_t done = 0;
+
+                while(done < len) {
+                    ssize_t n = pread(fd, &(*buffer)[done], len - done, offset + done);
+
+                    if(n == -1 && errno == EINTR)
+                        continue;
+
+                    if(n <= 0) {
+                        // Truncated meanwhile.
+                        *ok = false;
+                        return;
+                    }
+
+                    done += n;
+                }
+
+                out[i] = hash(&(*buffer)[0], len, i);
+            }
+        }
+
+        uint64_t content_filter::hash(const void* data, size_t len, uint64_t seed)
+        {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            const unsigned char* end = p + len;
+            uint64_t h;
+
+            if(len >= 32) {
+                uint64_t v1 = seed + PRIME1 + PRIME2;
+                uint64_t v2 = seed + PRIME2;
+                uint64_t v3 = seed;
+                uint64_t v4 = seed - PRIME1;
+
+                // Four independent lanes.
+                for(const unsigned char* limit = end - 32; p <= limit; p += 32) {
+                    v1 = xx_round(v1, read64(p));
+                    v2 = xx_round(v2, read64(p + 8));
+                    v3 = xx_round(v3, read64(p + 16));
+                    v4 = xx_round(v4, read64(p + 24));
+                }
+
+                h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+                h = merge_round(h, v1);
+                h = merge_round(h, v2);
+                h = merge_round(h, v3);
+                h = merge_round(h, v4);
+            }
+            else
+                h = seed + PRIME5;
+
+            h += len;
+
+            for(; p + 8 <= end; p += 8) {
+                h ^= xx_round(0, read64(p));
+                h = rotl(h, 27) * PRIME1 + PRIME4;
+            }
+
+            if(p + 4 <= end) {
+                h ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+                h = rotl(h, 23) * PRIME2 + PRIME3;
+                p += 4;
+            }
+
+            for(; p < end; ++p) {
+                h ^= *p * PRIME5;
+                h = rotl(h, 11) * PRIME1;
+            }
+
+            h ^= h >> 33;
+            h *= PRIME2;
+            h ^= h >> 29;
+            h *= PRIME3;
+            h ^= h >> 32;
+
+            return h;
+        }
+    }
+}
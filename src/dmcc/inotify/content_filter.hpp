@@ -0,0 +1,143 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_CONTENT_FILTER_HPP
+#define DMCC_INOTIFY_CONTENT_FILTER_HPP
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/filesystem/path.hpp>
+
+#include "inotify.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Drops modifications that left the content of a file
+           as it was.
+
+           The inode, size, mtime and content hash of the files that
+           events were delivered for are cached. An event covered by
+           the mask is dropped if the file has the same inode and
+           size and its content hashes to the cached value, or if
+           even its mtime is the same and was older than the time the
+           file was looked at. A size change is delivered without
+           hashing, so files that grow aren't read on every write; the
+           next event of the same size hashes them again.
+
+           Files are hashed in blocks of BLOCK_SIZE bytes, and the
+           blocks of large files are hashed by several threads. The
+           hash is a 64 bit xxHash, whose four independent lanes
+           compilers turn into vector code.
+
+           Reading the files causes IN_OPEN, IN_ACCESS and
+           IN_CLOSE_NOWRITE events of their own.
+        */
+        class content_filter
+        {
+        public:
+            static const size_t BLOCK_SIZE = 1 << 20;
+
+            /**
+               \param mask The events that may be dropped.
+               \param cache_size The number of files remembered.
+               \param threads The threads hashing a large file, 0 for
+               one per core.
+            */
+            content_filter(uint32_t mask, size_t cache_size, unsigned threads);
+
+            /**
+               \brief Runs a batch of events through the stage.
+
+               The events that are kept are appended to out.
+            */
+            void run(const std::vector<event>& in, std::vector<event>& out);
+
+            /**
+               \brief Hashes len bytes with seed.
+            */
+            static uint64_t hash(const void* data, size_t len, uint64_t seed);
+
+            /**
+               \brief Hashes the first size bytes of a file.
+               \return false if the file couldn't be read.
+            */
+            bool hash_file(int fd, uint64_t size, uint64_t& out);
+
+        private:
+            struct entry
+            {
+                std::string path;
+                uint64_t ino;
+                uint64_t size;
+                int64_t mtime;
+
+                // The mtime was within the second the file was looked
+                // at, so a write right after may have kept it. The
+                // file is hashed again even if the mtime is the same.
+                bool racy;
+
+                // The content hash, if known.
+                bool hashed;
+                uint64_t hash;
+            };
+
+            typedef std::list<entry> entry_list_t;
+            typedef boost::unordered_map<std::string, entry_list_t::iterator> index_t;
+
+            // Tells if the file at path changed, updating the cache.
+            bool changed(const std::string& path);
+
+            // Moves an entry to the front, evicting the oldest if the
+            // cache is full. Returns the entry for path.
+            entry& touch(const std::string& path);
+
+            void forget(const std::string& path);
+
+            // Hashes the blocks [begin, end) of a file into out.
+            static void hash_blocks(int fd, uint64_t size, size_t begin, size_t end,
+                                    uint64_t* out, bool* ok,
+                                    std::vector<unsigned char>* buffer);
+
+            // hash_blocks() on a thread of its own.
+            static void hash_range(int fd, uint64_t size, size_t begin, size_t end,
+                                   uint64_t* out, char* ok);
+
+            uint32_t m_mask;
+            size_t m_cache_size;
+            unsigned m_threads;
+
+            // Most recently used first.
+            entry_list_t m_entries;
+            index_t m_index;
+
+            boost::filesystem::path m_path;
+            boost::filesystem::path m_old_path;
+
+            // Buffer for files hashed on the calling thread.
+            std::vector<unsigned char> m_buffer;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_CONTENT_FILTER_HPP
@@ -0,0 +1,681 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_COROUTINE_HPP
+#define DMCC_INOTIFY_COROUTINE_HPP
+
+// The library itself is C++03, this header is for C++20 consumers.
+#if __cplusplus >= 202002L
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "exception/raise.hpp"
+#include "inotify.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace coro {
+
+            /**
+               \brief Something waiting for a descriptor to become
+               readable.
+            */
+            class waiter
+            {
+            public:
+                virtual ~waiter() {}
+
+                /**
+                   \brief Called by one of the threads running the
+                   reactor, once per arm().
+                */
+                virtual void ready() = 0;
+            };
+
+
+            /**
+               \brief Multiplexes the descriptors of many waiters on
+               the threads that call run().
+
+               Every arm() fires once, so a waiter is never called on
+               two threads at the same time.
+            */
+            class reactor : private boost::noncopyable
+            {
+            public:
+                reactor()
+                    : m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+                      m_stop(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+                {
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = 0;
+
+                    if(m_epoll == -1 || m_stop == -1 ||
+                       epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_stop, &ev) == -1) {
+                        int err = errno;
+                        close_descriptors();
+                        errno = err;
+
+                        DMCC_RAISE_LINUX_SYS_ERR("unable to initialize the reactor");
+                    }
+                }
+
+                ~reactor()
+                {
+                    close_descriptors();
+                }
+
+                /**
+                   \brief Calls w.ready() once fd is readable.
+                   \param added false the first time fd is armed.
+                */
+                void arm(int fd, waiter* w, bool added)
+                {
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN | EPOLLONESHOT;
+                    ev.data.ptr = w;
+
+                    if(epoll_ctl(m_epoll, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1)
+                        DMCC_RAISE_LINUX_SYS_ERR("unable to wait for a descriptor");
+                }
+
+                /**
+                   \brief Removes a descriptor that isn't armed.
+                */
+                void remove(int fd)
+                {
+                    struct epoll_event ev;
+                    epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, &ev);
+                }
+
+                /**
+                   \brief Calls the waiters that are ready until stop()
+                   is called.
+
+                   Can be called by several threads at once.
+                */
+                void run()
+                {
+                    struct epoll_event ready[64];
+
+                    for(;;) {
+                        int n = epoll_wait(m_epoll, ready, 64, -1);
+
+                        if(n == -1) {
+                            if(errno == EINTR)
+                                continue;
+
+                            DMCC_RAISE_LINUX_SYS_ERR("waiting for descriptors failed");
+                        }
+
+                        bool stopped = false;
+
+                        // The others fired already, so they are called
+                        // even when stopping.
+                        for(int i = 0; i < n; ++i) {
+                            if(ready[i].data.ptr)
+                                static_cast<waiter*>(ready[i].data.ptr)->ready();
+                            else
+                                stopped = true;
+                        }
+
+                        if(stopped)
+                            return;
+                    }
+                }
+
+                /**
+                   \brief Makes all threads return from run(), now and
+                   in the future until restart() is called.
+                */
+                void stop()
+                {
+                    uint64_t one = 1;
+
+                    if(write(m_stop, &one, sizeof(one)) == -1 && errno != EAGAIN)
+                        DMCC_RAISE_LINUX_SYS_ERR("unable to stop the reactor");
+                }
+
+                void restart()
+                {
+                    uint64_t count;
+
+                    if(read(m_stop, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                        DMCC_RAISE_LINUX_SYS_ERR("unable to restart the reactor");
+                }
+
+            private:
+                void close_descriptors()
+                {
+                    if(m_stop != -1)
+                        close(m_stop);
+
+                    if(m_epoll != -1)
+                        close(m_epoll);
+                }
+
+                int m_epoll;
+
+                // Eventfd that stays readable once stop() was called.
+                int m_stop;
+            };
+
+
+            /**
+               \brief An event copied out of the read buffer.
+            */
+            struct event_record
+            {
+                int wd;
+                uint32_t mask;
+                uint32_t cookie;
+
+                std::string name;
+                std::string path;
+
+                // Set for renames joined by the rename pairing.
+                std::string old_path;
+            };
+
+
+            class watcher;
+
+
+            /**
+               \brief An inotify object shared by the watchers of a
+               reactor.
+
+               Thousands of watchers take a single inotify instance,
+               so they count once against
+               fs.inotify.max_user_instances. The events are handed to
+               the watcher whose directory contains their path, the
+               innermost one if directories are nested, and overflows
+               to all watchers.
+
+               Events are only read while a watcher waits in
+               next_batch(). The events of watchers that don't wait at
+               that time are kept until they do, up to the limit of the
+               watcher. A watcher that reaches it loses its pending
+               events and gets a single IN_Q_OVERFLOW instead, so a
+               slow consumer neither holds up the others nor makes the
+               memory grow; like after a kernel overflow, it has to
+               look at its directories again.
+
+               Watches may be added through the watchers from any
+               thread, also while the reactor runs; they wait for the
+               events being read. Configure the inotify object through
+               get() before the reactor runs. Dispatch threads must
+               not be used.
+            */
+            class shared_source : private waiter, private boost::noncopyable
+            {
+                friend class watcher;
+
+            public:
+                explicit shared_source(reactor& r)
+                    : m_reactor(r)
+                {
+                    init();
+                }
+
+                shared_source(reactor& r, boost::shared_ptr<backend> b)
+                    : m_inotify(b),
+                      m_reactor(r)
+                {
+                    init();
+                }
+
+                ~shared_source()
+                {
+                    if(m_added)
+                        m_reactor.remove(m_inotify.fd());
+                }
+
+                /**
+                   \brief The inotify object to configure. stop() ends
+                   the batches of all watchers.
+                */
+                inotify& get()
+                {
+                    return m_inotify;
+                }
+
+            private:
+                void init()
+                {
+                    m_added = false;
+                    m_armed = false;
+                    m_stopped = false;
+
+                    m_inotify.connect_batch_slot([this](inotify&, const event_batch& batch) {
+                        return collect(batch);
+                    });
+                }
+
+                // Called with m_mutex held by a watcher that is about to
+                // wait.
+                void arm()
+                {
+                    if(m_armed)
+                        return;
+
+                    bool added = m_added;
+                    m_added = true;
+                    m_armed = true;
+
+                    m_reactor.arm(m_inotify.fd(), this, added);
+                }
+
+                void ready();
+
+                bool collect(const event_batch& batch);
+
+                // Returns the watcher of the directory path lies in, or 0.
+                watcher* owner(const std::string& path);
+
+                inotify m_inotify;
+                reactor& m_reactor;
+
+                // Held while the events are read and while watches are
+                // added, the inotify object doesn't allow both at once.
+                boost::mutex m_poll_mutex;
+
+                // Guards all members below and the batches of the
+                // watchers. Taken after m_poll_mutex.
+                boost::mutex m_mutex;
+
+                // Whether the descriptor was added to the reactor, and
+                // whether it is armed.
+                bool m_added;
+                bool m_armed;
+
+                // Set once stop() was seen, every batch is empty from
+                // then on.
+                bool m_stopped;
+
+                // The watched directories and their watchers.
+                boost::unordered_map<std::string, watcher*> m_roots;
+
+                // All watchers, each gets overflows once.
+                std::vector<watcher*> m_watchers;
+
+                // The watchers waiting in next_batch().
+                std::vector<watcher*> m_waiting;
+
+                boost::filesystem::path m_path;
+            };
+
+
+            /**
+               \brief Delivers the events of the directories it watches
+               to a coroutine.
+
+               The coroutine is resumed on a thread running the
+               reactor. The watches are added to the shared_source,
+               and stay in place when the watcher is destroyed; their
+               events are dropped then. At most limit events are kept
+               while the coroutine doesn't wait, see shared_source.
+
+               \code
+               for(;;) {
+                   auto batch = co_await w.next_batch();
+
+                   if(batch.empty())
+                       break;
+
+                   for(const event_record& e : batch)
+                       handle(e.path, e.mask);
+               }
+               \endcode
+            */
+            class watcher : private boost::noncopyable
+            {
+                friend class shared_source;
+
+            public:
+                class batch_awaiter
+                {
+                public:
+                    explicit batch_awaiter(watcher& w)
+                        : m_watcher(w)
+                    {
+                    }
+
+                    bool await_ready()
+                    {
+                        boost::mutex::scoped_lock lock(m_watcher.m_source.m_mutex);
+
+                        return m_watcher.take();
+                    }
+
+                    bool await_suspend(std::coroutine_handle<> h)
+                    {
+                        boost::mutex::scoped_lock lock(m_watcher.m_source.m_mutex);
+
+                        // Events may have come in since await_ready().
+                        if(m_watcher.take())
+                            return false;
+
+                        m_watcher.m_handle = h;
+                        m_watcher.m_source.m_waiting.push_back(&m_watcher);
+                        m_watcher.m_source.arm();
+
+                        return true;
+                    }
+
+                    std::span<const event_record> await_resume() const
+                    {
+                        return std::span<const event_record>(m_watcher.m_records.data(),
+                                                             m_watcher.m_size);
+                    }
+
+                private:
+                    watcher& m_watcher;
+                };
+
+                explicit watcher(shared_source& s, size_t limit = 16384)
+                    : m_source(s),
+                      m_size(0),
+                      m_pending_size(0),
+                      m_limit(std::max<size_t>(limit, 1)),
+                      m_overflowed(false)
+                {
+                    boost::mutex::scoped_lock lock(m_source.m_mutex);
+                    m_source.m_watchers.push_back(this);
+                }
+
+                ~watcher()
+                {
+                    boost::mutex::scoped_lock lock(m_source.m_mutex);
+
+                    std::vector<watcher*>& watchers = m_source.m_watchers;
+                    watchers.erase(std::remove(watchers.begin(), watchers.end(), this),
+                                   watchers.end());
+
+                    for(std::vector<std::string>::const_iterator it = m_roots.begin();
+                        it != m_roots.end(); ++it) {
+                        boost::unordered_map<std::string, watcher*>::iterator r =
+                            m_source.m_roots.find(*it);
+
+                        if(r != m_source.m_roots.end() && r->second == this)
+                            m_source.m_roots.erase(r);
+                    }
+
+                    std::vector<watcher*>& waiting = m_source.m_waiting;
+                    waiting.erase(std::remove(waiting.begin(), waiting.end(), this),
+                                  waiting.end());
+                }
+
+                /**
+                   \brief Watches a directory, see inotify::add_watch().
+                */
+                void add_watch(const boost::filesystem::path& path, uint32_t mask)
+                {
+                    boost::mutex::scoped_lock lock(m_source.m_poll_mutex);
+
+                    claim(path);
+                    m_source.m_inotify.add_watch(path, mask);
+                }
+
+                /**
+                   \brief Watches a tree, see
+                   inotify::add_recursive_watch().
+                */
+                void add_recursive_watch(const boost::filesystem::path& root, uint32_t mask,
+                                         unsigned threads = 0)
+                {
+                    boost::mutex::scoped_lock lock(m_source.m_poll_mutex);
+
+                    claim(root);
+                    m_source.m_inotify.add_recursive_watch(root, mask, threads);
+                }
+
+                /**
+                   \brief The shared inotify object.
+                */
+                inotify& source()
+                {
+                    return m_source.get();
+                }
+
+                /**
+                   \brief Waits for the next events.
+
+                   The batch stays valid until the next call. An empty
+                   batch means that source().stop() was called.
+                */
+                batch_awaiter next_batch()
+                {
+                    return batch_awaiter(*this);
+                }
+
+            private:
+                // Routes the events below path to this watcher.
+                void claim(const boost::filesystem::path& path)
+                {
+                    std::string dir = path.string();
+
+                    if(dir.size() > 1 && dir[dir.size() - 1] == '/')
+                        dir.erase(dir.size() - 1);
+
+                    boost::mutex::scoped_lock lock(m_source.m_mutex);
+
+                    m_source.m_roots[dir] = this;
+                    m_roots.push_back(dir);
+                }
+
+                // Turns the pending events into the batch. Called with
+                // the mutex of the source held, returns true if there
+                // is a batch or the source was stopped.
+                bool take()
+                {
+                    if(m_pending_size == 0 && !m_source.m_stopped)
+                        return false;
+
+                    // Both keep the storage of their records.
+                    m_records.swap(m_pending);
+                    m_size = m_pending_size;
+                    m_pending_size = 0;
+                    m_overflowed = false;
+
+                    return true;
+                }
+
+                // Appends a record for ev to the pending events.
+                void add(const event& ev, boost::filesystem::path& buffer)
+                {
+                    // Nothing is kept after an overflow until the
+                    // coroutine took it.
+                    if(m_overflowed)
+                        return;
+
+                    if(m_pending_size == m_limit) {
+                        overflow();
+                        return;
+                    }
+
+                    event_record& r = next_record();
+                    r.wd = ev.wd();
+                    r.mask = ev.mask();
+                    r.cookie = ev.cookie();
+
+                    boost::string_ref name = ev.name_ref();
+                    r.name.assign(name.data(), name.size());
+                    r.path = ev.path(buffer).string();
+
+                    if(ev.is_rename())
+                        r.old_path = ev.old_path(buffer).string();
+                    else
+                        r.old_path.clear();
+                }
+
+                // Replaces the pending events by an IN_Q_OVERFLOW.
+                void overflow()
+                {
+                    if(m_overflowed)
+                        return;
+
+                    m_pending_size = 0;
+                    m_overflowed = true;
+
+                    event_record& r = next_record();
+                    r.wd = -1;
+                    r.mask = IN_Q_OVERFLOW;
+                    r.cookie = 0;
+                    r.name.clear();
+                    r.path.clear();
+                    r.old_path.clear();
+                }
+
+                event_record& next_record()
+                {
+                    // The records keep their storage across batches.
+                    if(m_pending_size == m_pending.size())
+                        m_pending.resize(m_pending_size + 1);
+
+                    return m_pending[m_pending_size++];
+                }
+
+                shared_source& m_source;
+
+                // The directories claimed in the source.
+                std::vector<std::string> m_roots;
+
+                std::coroutine_handle<> m_handle;
+
+                // The batch handed out, and the events read since.
+                std::vector<event_record> m_records;
+                size_t m_size;
+
+                std::vector<event_record> m_pending;
+                size_t m_pending_size;
+
+                // The events kept at most, and whether they were
+                // replaced by an overflow.
+                size_t m_limit;
+                bool m_overflowed;
+            };
+
+
+            inline void shared_source::ready()
+            {
+                bool stopped;
+
+                {
+                    boost::mutex::scoped_lock lock(m_poll_mutex);
+                    stopped = m_inotify.poll_once();
+                }
+
+                std::vector<std::coroutine_handle<> > resume;
+
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    m_armed = false;
+
+                    if(stopped)
+                        m_stopped = true;
+
+                    for(size_t i = 0; i < m_waiting.size();) {
+                        watcher* w = m_waiting[i];
+
+                        if(!w->take()) {
+                            ++i;
+                            continue;
+                        }
+
+                        resume.push_back(w->m_handle);
+                        w->m_handle = std::coroutine_handle<>();
+
+                        m_waiting[i] = m_waiting.back();
+                        m_waiting.pop_back();
+                    }
+
+                    // Armed again before resuming, since a coroutine
+                    // may destroy its watcher.
+                    if(!m_waiting.empty())
+                        arm();
+                }
+
+                for(size_t i = 0; i < resume.size(); ++i)
+                    resume[i].resume();
+            }
+
+            inline bool shared_source::collect(const event_batch& batch)
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                for(event_batch::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+                    if(it->mask() & IN_Q_OVERFLOW) {
+                        for(size_t i = 0; i < m_watchers.size(); ++i)
+                            m_watchers[i]->overflow();
+
+                        continue;
+                    }
+
+                    watcher* w = owner(it->path(m_path).string());
+
+                    if(w)
+                        w->add(*it, m_path);
+                }
+
+                return false;
+            }
+
+            inline watcher* shared_source::owner(const std::string& path)
+            {
+                std::string dir = path;
+
+                for(;;) {
+                    boost::unordered_map<std::string, watcher*>::const_iterator it =
+                        m_roots.find(dir);
+
+                    if(it != m_roots.end())
+                        return it->second;
+
+                    std::string::size_type slash = dir.rfind('/');
+
+                    if(slash == std::string::npos || dir.size() == 1)
+                        return 0;
+
+                    // The root directory keeps its slash.
+                    dir.erase(std::max<std::string::size_type>(slash, 1));
+                }
+            }
+        }
+    }
+}
+
+#endif  // __cplusplus >= 202002L
+
+#endif  // DMCC_INOTIFY_COROUTINE_HPP
@@ -0,0 +1,224 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "dispatcher.hpp"
+
+#include <boost/bind.hpp>
+
+
+namespace dmcc {
+    namespace inotify {
+        dispatcher::dispatcher(inotify& owner, unsigned threads, size_t queue_limit)
+            : m_owner(owner),
+              m_queue_limit(queue_limit),
+              m_pending(threads)
+        {
+            for(unsigned i = 0; i < threads; ++i) {
+                boost::shared_ptr<shard> s(new shard(&owner.m_stats));
+
+                for(size_t j = 0; j < owner.m_slots.size(); ++j)
+                    s->signal.connect(owner.m_slots[j].first, owner.m_slots[j].second);
+
+                for(size_t j = 0; j < owner.m_batch_slots.size(); ++j)
+                    s->batch_signal.connect(owner.m_batch_slots[j].first,
+                                            owner.m_batch_slots[j].second);
+
+                m_shards.push_back(s);
+                m_threads.create_thread(boost::bind(&dispatcher::work, this, s.get()));
+            }
+        }
+
+        dispatcher::~dispatcher()
+        {
+            for(size_t i = 0; i < m_shards.size(); ++i) {
+                boost::mutex::scoped_lock lock(m_shards[i]->mutex);
+                m_shards[i]->shutdown = true;
+                m_shards[i]->cond.notify_all();
+            }
+
+            m_threads.join_all();
+        }
+
+        void dispatcher::connect(int id, const inotify::event_sig_t::slot_type& slot)
+        {
+            for(size_t i = 0; i < m_shards.size(); ++i)
+                m_shards[i]->signal.connect(id, slot);
+        }
+
+        void dispatcher::connect(int id, const inotify::batch_sig_t::slot_type& slot)
+        {
+            for(size_t i = 0; i < m_shards.size(); ++i)
+                m_shards[i]->batch_signal.connect(id, slot);
+        }
+
+        void dispatcher::disconnect(int id)
+        {
+            for(size_t i = 0; i < m_shards.size(); ++i) {
+                m_shards[i]->signal.disconnect(id);
+                m_shards[i]->batch_signal.disconnect(id);
+            }
+        }
+
+        void dispatcher::post(const std::vector<event>& batch, uint64_t read_time)
+        {
+            for(std::vector<event>::const_iterator it = batch.begin();
+                it != batch.end(); ++it) {
+                // All events of a watch go to the same worker.
+                chunk& c = m_pending[static_cast<unsigned int>(it->wd()) % m_shards.size()];
+
+                append(c, it->m_event, it->m_watch);
+                c.renames.push_back(it->m_from_event != 0);
+
+                if(it->m_from_event)
+                    append(c, it->m_from_event, it->m_from_watch);
+            }
+
+            for(size_t i = 0; i < m_pending.size(); ++i) {
+                chunk& c = m_pending[i];
+
+                if(c.watches.empty())
+                    continue;
+
+                shard& s = *m_shards[i];
+                boost::mutex::scoped_lock lock(s.mutex);
+
+                // Don't let a slow worker pile up events without bound.
+                while(s.queued >= m_queue_limit)
+                    s.cond.wait(lock);
+
+                s.queued += c.renames.size();
+                s.queue.push_back(chunk());
+                s.queue.back().raw.swap(c.raw);
+                s.queue.back().watches.swap(c.watches);
+                s.queue.back().renames.swap(c.renames);
+                s.queue.back().read_time = read_time;
+                s.cond.notify_all();
+            }
+        }
+
+        void dispatcher::append(chunk& c, const inotify_event* ev, watch* w)
+        {
+            const unsigned char* raw = reinterpret_cast<const unsigned char*>(ev);
+            c.raw.insert(c.raw.end(), raw, raw + sizeof(inotify_event) + ev->len);
+
+            // Keeps the watch alive even if it is removed before the
+            // worker gets to the event.
+            if(w)
+                c.watches.push_back(w->shared_from_this());
+            else
+                c.watches.push_back(boost::shared_ptr<watch>());
+        }
+
+        void dispatcher::wait_idle()
+        {
+            for(size_t i = 0; i < m_shards.size(); ++i) {
+                shard& s = *m_shards[i];
+                boost::mutex::scoped_lock lock(s.mutex);
+
+                while(!s.queue.empty() || s.busy)
+                    s.cond.wait(lock);
+            }
+        }
+
+        void dispatcher::rethrow()
+        {
+            boost::exception_ptr error;
+
+            {
+                boost::mutex::scoped_lock lock(m_error_mutex);
+                error = m_error;
+                m_error = boost::exception_ptr();
+            }
+
+            if(error)
+                boost::rethrow_exception(error);
+        }
+
+        void dispatcher::work(shard* s)
+        {
+            chunk c;
+            std::vector<event> events;
+
+            for(;;) {
+                {
+                    boost::mutex::scoped_lock lock(s->mutex);
+
+                    while(s->queue.empty() && !s->shutdown)
+                        s->cond.wait(lock);
+
+                    if(s->queue.empty())
+                        // Shut down and drained.
+                        return;
+
+                    c.raw.swap(s->queue.front().raw);
+                    c.watches.swap(s->queue.front().watches);
+                    c.renames.swap(s->queue.front().renames);
+                    c.read_time = s->queue.front().read_time;
+                    s->queue.pop_front();
+                    s->busy = true;
+                }
+
+                events.clear();
+
+                size_t offset = 0;
+                size_t w = 0;
+
+                for(size_t i = 0; i < c.renames.size(); ++i) {
+                    event ev;
+                    ev.m_event = reinterpret_cast<inotify_event*>(&c.raw[offset]);
+                    ev.m_watch = c.watches[w++].get();
+                    offset += sizeof(inotify_event) + ev.m_event->len;
+
+                    if(c.renames[i]) {
+                        ev.m_from_event = reinterpret_cast<inotify_event*>(&c.raw[offset]);
+                        ev.m_from_watch = c.watches[w++].get();
+                        offset += sizeof(inotify_event) + ev.m_from_event->len;
+                    }
+
+                    events.push_back(ev);
+                }
+
+                try {
+                    if(m_owner.emit(s->signal, s->batch_signal,
+                                    &events[0], &events[0] + events.size()))
+                        m_owner.stop();
+                }
+                catch(...) {
+                    // Handed to the listening thread, the worker goes on.
+                    boost::mutex::scoped_lock lock(m_error_mutex);
+
+                    if(!m_error)
+                        m_error = boost::current_exception();
+
+                    m_owner.stop();
+                }
+
+                if(m_owner.m_stats && c.read_time)
+                    m_owner.m_stats->local().record_batch(stats_collector::now() - c.read_time);
+
+                boost::mutex::scoped_lock lock(s->mutex);
+                s->queued -= c.renames.size();
+                s->busy = false;
+                s->cond.notify_all();
+
+                c.raw.clear();
+                c.watches.clear();
+                c.renames.clear();
+            }
+        }
+    }
+}
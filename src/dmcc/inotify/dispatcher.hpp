@@ -0,0 +1,156 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_DISPATCHER_HPP
+#define DMCC_INOTIFY_DISPATCHER_HPP
+
+#include <vector>
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "inotify.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Dispatches events on a pool of worker threads.
+
+           Every worker owns a shard of the watch-descriptors. All
+           events of a watch are handled by the same worker in the
+           order they were read, while events of different watches
+           are handled in parallel.
+        */
+        class dispatcher
+        {
+        public:
+            /**
+               \param owner The object whose slots are called.
+               \param threads The number of workers.
+               \param queue_limit The number of events a worker may
+               have queued before post() blocks.
+            */
+            dispatcher(inotify& owner, unsigned threads, size_t queue_limit = 65536);
+
+            /**
+               \brief Delivers all queued events and joins the workers.
+            */
+            ~dispatcher();
+
+            /**
+               \brief Connects a slot to the signals of all workers.
+            */
+            void connect(int id, const inotify::event_sig_t::slot_type& slot);
+
+            void connect(int id, const inotify::batch_sig_t::slot_type& slot);
+
+            /**
+               \brief Disconnects a slot from the signals of all workers.
+               Must not be called while events are delivered.
+            */
+            void disconnect(int id);
+
+            /**
+               \brief Hands a batch of events to the workers.
+
+               The events are copied, so the batch may be reused
+               right after the call. If a slot asks to stop, the owner
+               is stopped through inotify::stop().
+               \param read_time When the events were read, see
+               stats_collector::now(), or 0.
+            */
+            void post(const std::vector<event>& batch, uint64_t read_time = 0);
+
+            /**
+               \brief Blocks until all queued events were delivered.
+            */
+            void wait_idle();
+
+            /**
+               \brief Rethrows the first exception a slot has thrown
+               since the last call, if any.
+            */
+            void rethrow();
+
+        private:
+            // Events for one worker copied out of a read buffer.
+            struct chunk
+            {
+                // The raw events. Renames are followed by their
+                // IN_MOVED_FROM half.
+                std::vector<unsigned char> raw;
+                std::vector<boost::shared_ptr<watch> > watches;
+
+                // Tells for every event if it is a rename.
+                std::vector<bool> renames;
+
+                uint64_t read_time;
+            };
+
+            struct shard
+            {
+                explicit shard(const boost::scoped_ptr<stats_collector>* stats)
+                    : signal(timed_last_value(stats)),
+                      batch_signal(timed_last_value(stats)),
+                      queued(0),
+                      busy(false),
+                      shutdown(false)
+                {
+                }
+
+                // Boost.Signals may not be emitted concurrently, so every
+                // worker has its own copy of the connections.
+                inotify::event_sig_t signal;
+                inotify::batch_sig_t batch_signal;
+
+                boost::mutex mutex;
+                boost::condition_variable cond;
+                std::deque<chunk> queue;
+                size_t queued;
+                bool busy;
+                bool shutdown;
+            };
+
+            // Copies a raw event and a reference to its watch.
+            static void append(chunk& c, const inotify_event* ev, watch* w);
+
+            void work(shard* s);
+
+            inotify& m_owner;
+            size_t m_queue_limit;
+
+            std::vector<boost::shared_ptr<shard> > m_shards;
+            boost::thread_group m_threads;
+
+            // Per-shard chunks being filled by post().
+            std::vector<chunk> m_pending;
+
+            // First exception thrown by a slot on a worker.
+            boost::mutex m_error_mutex;
+            boost::exception_ptr m_error;
+
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_DISPATCHER_HPP
@@ -0,0 +1,370 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "event_log.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exception/raise.hpp"
+#include "inotify.hpp"
+
+#define INOTIFY_EVENT_SIZE (sizeof(struct inotify_event))
+#define FLUSH_SIZE (256 * 1024)
+
+namespace fs = boost::filesystem;
+
+
+namespace {
+    // Monotonic time in microseconds.
+    uint64_t now_us()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+}
+
+
+namespace dmcc {
+    namespace inotify {
+        const char event_recorder::MAGIC[8] = { 'D', 'M', 'C', 'C', 'E', 'L', 'O', 'G' };
+
+        event_recorder::event_recorder(const fs::path& file)
+            : m_fd(open(file.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+              m_last_read(now_us()),
+              m_events(0),
+              m_read_events(0),
+              m_next_id(1)
+        {
+            if(m_fd == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to create `" + file.string() + "'");
+
+            m_buffer.insert(m_buffer.end(), MAGIC, MAGIC + sizeof(MAGIC));
+
+            uint32_t version = VERSION;
+            const unsigned char* v = reinterpret_cast<const unsigned char*>(&version);
+            m_buffer.insert(m_buffer.end(), v, v + sizeof(version));
+        }
+
+        event_recorder::~event_recorder()
+        {
+            try {
+                end_read();
+                flush();
+            }
+            catch(...) {
+            }
+
+            close(m_fd);
+        }
+
+        void event_recorder::add(const inotify_event& ev, const watch* w)
+        {
+            put(m_read, w ? watch_id(w) : 0);
+            put(m_read, ev.mask);
+            put(m_read, ev.cookie);
+
+            // The name is padded with null bytes.
+            size_t name_len = ev.len ? strnlen(ev.name, ev.len) : 0;
+            put(m_read, name_len);
+            m_read.insert(m_read.end(), ev.name, ev.name + name_len);
+
+            ++m_read_events;
+        }
+
+        void event_recorder::end_read()
+        {
+            if(m_read_events == 0)
+                return;
+
+            uint64_t now = now_us();
+
+            m_buffer.push_back(READ_RECORD);
+            put(m_buffer, now - m_last_read);
+            put(m_buffer, m_read_events);
+            m_buffer.insert(m_buffer.end(), m_read.begin(), m_read.end());
+
+            m_last_read = now;
+            m_events += m_read_events;
+            m_read_events = 0;
+            m_read.clear();
+
+            if(m_buffer.size() >= FLUSH_SIZE)
+                flush();
+        }
+
+        void event_recorder::flush()
+        {
+            size_t done = 0;
+
+            while(done < m_buffer.size()) {
+                ssize_t n = write(m_fd, &m_buffer[done], m_buffer.size() - done);
+
+                if(n == -1) {
+                    if(errno == EINTR)
+                        continue;
+
+                    DMCC_RAISE_LINUX_SYS_ERR("writing the event log failed");
+                }
+
+                done += n;
+            }
+
+            m_buffer.clear();
+        }
+
+        uint64_t event_recorder::events() const
+        {
+            return m_events;
+        }
+
+        uint64_t event_recorder::watch_id(const watch* w)
+        {
+            std::pair<boost::weak_ptr<const watch>, uint64_t>& entry = m_ids[w];
+
+            if(entry.second != 0 && !entry.first.expired())
+                return entry.second;
+
+            entry.first = w->shared_from_this();
+            entry.second = m_next_id++;
+
+            // Written ahead of the read that refers to it.
+            const std::string& path = w->m_path.string();
+
+            m_buffer.push_back(WATCH_RECORD);
+            put(m_buffer, entry.second);
+            put(m_buffer, w->m_mask);
+            put(m_buffer, w->m_recursive);
+            put(m_buffer, w->m_root_length);
+            put(m_buffer, path.size());
+            m_buffer.insert(m_buffer.end(), path.begin(), path.end());
+
+            return entry.second;
+        }
+
+        void event_recorder::put(std::vector<unsigned char>& out, uint64_t value)
+        {
+            while(value >= 0x80) {
+                out.push_back(static_cast<unsigned char>(value) | 0x80);
+                value >>= 7;
+            }
+
+            out.push_back(static_cast<unsigned char>(value));
+        }
+
+
+        const int event_replayer::REPLAY_WD;
+
+        event_replayer::event_replayer(const fs::path& file)
+            : m_events(0)
+        {
+            int fd = open(file.string().c_str(), O_RDONLY | O_CLOEXEC);
+
+            if(fd == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to open `" + file.string() + "'");
+
+            struct stat st;
+            void* map = MAP_FAILED;
+
+            if(fstat(fd, &st) == 0 && st.st_size > 0)
+                map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            close(fd);
+
+            size_t header = sizeof(event_recorder::MAGIC) + sizeof(uint32_t);
+            const unsigned char* base = static_cast<const unsigned char*>(map);
+            uint32_t version = 0;
+
+            if(map != MAP_FAILED && static_cast<size_t>(st.st_size) >= header)
+                memcpy(&version, base + sizeof(event_recorder::MAGIC), sizeof(version));
+
+            if(version != event_recorder::VERSION ||
+               memcmp(base, event_recorder::MAGIC, sizeof(event_recorder::MAGIC)) != 0) {
+                if(map != MAP_FAILED)
+                    munmap(map, st.st_size);
+
+                DMCC_RAISE_CRITICAL("`" + file.string() + "' is no event log");
+            }
+
+            // Whole records only.
+            bool valid = decode(base + header, base + st.st_size);
+            munmap(map, st.st_size);
+
+            if(!valid)
+                DMCC_RAISE_CRITICAL("`" + file.string() + "' is corrupt");
+        }
+
+        size_t event_replayer::reads() const
+        {
+            return m_reads.size();
+        }
+
+        uint64_t event_replayer::events() const
+        {
+            return m_events;
+        }
+
+        bool event_replayer::run(inotify& target, bool timed)
+        {
+            {
+                boost::mutex::scoped_lock lock(target.m_mutex);
+
+                for(size_t i = 0; i < m_watches.size(); ++i)
+                    target.m_wd_map.insert(REPLAY_WD + 1 + i, m_watches[i]);
+            }
+
+            // Processing modifies the events, so they are copied.
+            std::vector<unsigned char> buf;
+            uint64_t due = now_us();
+            bool stopped = false;
+
+            for(size_t i = 0; i < m_reads.size() && !stopped; ++i) {
+                const read_record& r = m_reads[i];
+
+                if(r.length == 0)
+                    continue;
+
+                if(timed) {
+                    due += r.delay;
+
+                    // Released held events in the meantime.
+                    for(uint64_t now = now_us(); now < due && !stopped; now = now_us())
+                        stopped = target.poll_once(boost::posix_time::microseconds(due - now));
+
+                    if(stopped)
+                        break;
+                }
+
+                buf.assign(m_data.begin() + r.offset, m_data.begin() + r.offset + r.length);
+                stopped = target.inject(&buf[0], buf.size());
+            }
+
+            // Wait for the stages to release what they hold, the
+            // events refer to our watches.
+            for(int left = target.next_deadline(); left >= 0 && !stopped;
+                left = target.next_deadline())
+                stopped = target.poll_once(boost::posix_time::milliseconds(left));
+
+            boost::mutex::scoped_lock lock(target.m_mutex);
+
+            for(size_t i = 0; i < m_watches.size(); ++i)
+                target.m_wd_map.erase(REPLAY_WD + 1 + i);
+
+            return stopped;
+        }
+
+        bool event_replayer::decode(const unsigned char* pos, const unsigned char* end)
+        {
+            while(pos < end) {
+                unsigned char type = *pos++;
+
+                if(type == event_recorder::WATCH_RECORD) {
+                    uint64_t id, mask, recursive, root_length, len;
+
+                    if(!get(pos, end, id) || !get(pos, end, mask) || !get(pos, end, recursive) ||
+                       !get(pos, end, root_length) || !get(pos, end, len) ||
+                       static_cast<uint64_t>(end - pos) < len)
+                        return true;
+
+                    // Ids are handed out in order.
+                    if(id != m_watches.size() + 1)
+                        return false;
+
+                    boost::shared_ptr<watch> w(new watch(std::string(pos, pos + len)));
+                    w->m_mask = mask;
+                    w->m_recursive = recursive;
+                    w->m_root_length = root_length;
+                    m_watches.push_back(w);
+
+                    pos += len;
+                }
+                else if(type == event_recorder::READ_RECORD) {
+                    read_record r;
+                    uint64_t count;
+
+                    if(!get(pos, end, r.delay) || !get(pos, end, count))
+                        return true;
+
+                    r.offset = m_data.size();
+
+                    for(uint64_t i = 0; i < count; ++i) {
+                        uint64_t id, mask, cookie, len;
+
+                        if(!get(pos, end, id) || !get(pos, end, mask) || !get(pos, end, cookie) ||
+                           !get(pos, end, len) || static_cast<uint64_t>(end - pos) < len) {
+                            m_data.resize(r.offset);
+                            return true;
+                        }
+
+                        if(id > m_watches.size())
+                            return false;
+
+                        // Pad the name the same way the kernel does.
+                        size_t name_len = len ? (len + INOTIFY_EVENT_SIZE) &
+                            ~(INOTIFY_EVENT_SIZE - 1) : 0;
+
+                        inotify_event ev;
+                        ev.wd = id ? REPLAY_WD + id : -1;
+                        ev.mask = mask;
+                        ev.cookie = cookie;
+                        ev.len = name_len;
+
+                        size_t off = m_data.size();
+                        m_data.resize(off + INOTIFY_EVENT_SIZE + name_len, 0);
+                        memcpy(&m_data[off], &ev, INOTIFY_EVENT_SIZE);
+                        memcpy(&m_data[off + INOTIFY_EVENT_SIZE], pos, len);
+
+                        pos += len;
+                    }
+
+                    r.length = m_data.size() - r.offset;
+                    m_reads.push_back(r);
+                    m_events += count;
+                }
+                else
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool event_replayer::get(const unsigned char*& pos, const unsigned char* end,
+                                 uint64_t& value)
+        {
+            value = 0;
+
+            for(unsigned shift = 0; pos < end && shift < 64; shift += 7) {
+                unsigned char byte = *pos++;
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+                if(!(byte & 0x80))
+                    return true;
+            }
+
+            return false;
+        }
+    }
+}
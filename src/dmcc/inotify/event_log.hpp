@@ -0,0 +1,178 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_EVENT_LOG_HPP
+#define DMCC_INOTIFY_EVENT_LOG_HPP
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/filesystem/path.hpp>
+
+struct inotify_event;
+
+
+namespace dmcc {
+    namespace inotify {
+        class inotify;
+        class watch;
+
+        /**
+           \brief Appends the decoded events of an inotify object to a
+           file, see inotify::set_recorder().
+
+           The file starts with a magic string and a version, followed
+           by two kinds of records. A watch record assigns an id to a
+           watch and stores its path, mask and root the first time an
+           event refers to it. A read record holds the time since the
+           previous read in microseconds and the events of one read,
+           each as watch id, mask, cookie and name. Numbers are stored
+           as LEB128 varints, so most events take a few bytes plus
+           their name.
+        */
+        class event_recorder : private boost::noncopyable
+        {
+        public:
+            static const char MAGIC[8];
+            static const uint32_t VERSION = 1;
+
+            enum { WATCH_RECORD = 'W', READ_RECORD = 'R' };
+
+            /**
+               \brief Creates or truncates file.
+            */
+            explicit event_recorder(const boost::filesystem::path& file);
+
+            // Writes what is buffered.
+            ~event_recorder();
+
+            /**
+               \brief Adds an event to the current read.
+               \param w The watch of the event, 0 for overflows.
+            */
+            void add(const inotify_event& ev, const watch* w);
+
+            /**
+               \brief Completes the current read, if it has events.
+            */
+            void end_read();
+
+            /**
+               \brief Writes the buffered records to the file.
+            */
+            void flush();
+
+            uint64_t events() const;
+
+        private:
+            // Returns the id of w, writing a watch record if needed.
+            uint64_t watch_id(const watch* w);
+
+            static void put(std::vector<unsigned char>& out, uint64_t value);
+
+            int m_fd;
+            uint64_t m_last_read;
+            uint64_t m_events;
+
+            // Complete records not written yet.
+            std::vector<unsigned char> m_buffer;
+
+            // The events of the current read.
+            std::vector<unsigned char> m_read;
+            uint64_t m_read_events;
+
+            // Watches can be freed and their address reused, the
+            // weak pointer tells.
+            typedef boost::unordered_map<const watch*,
+                                         std::pair<boost::weak_ptr<const watch>, uint64_t> >
+            ids_t;
+
+            ids_t m_ids;
+            uint64_t m_next_id;
+        };
+
+
+        /**
+           \brief Feeds a file written by event_recorder through the
+           slots of an inotify object.
+
+           The events take the same path as events read from the
+           kernel, through the filter, the rename pairing, the
+           coalescing and the workers, but directories are neither
+           watched nor scanned. Nothing on the filesystem is touched.
+        */
+        class event_replayer : private boost::noncopyable
+        {
+        public:
+            // The watches of the log get descriptors from here on.
+            static const int REPLAY_WD = 0x20000000;
+
+            /**
+               \brief Reads and decodes a log.
+
+               A truncated last record, e.g. of a recorder that didn't
+               finish, is ignored.
+            */
+            explicit event_replayer(const boost::filesystem::path& file);
+
+            size_t reads() const;
+            uint64_t events() const;
+
+            /**
+               \brief Emits all events of the log.
+
+               The held events of all stages are released before
+               returning. The slots may still run on the workers then,
+               the replayer has to outlive them.
+               \param timed true to keep the original intervals
+               between reads, false to replay as fast as possible.
+               \return true if a slot or stop() ended the replay.
+            */
+            bool run(inotify& target, bool timed = false);
+
+        private:
+            struct read_record
+            {
+                // Microseconds since the previous read.
+                uint64_t delay;
+                size_t offset;
+                size_t length;
+            };
+
+            // Decodes the records in [pos, end). Returns false if the
+            // data ends within a record.
+            bool decode(const unsigned char* pos, const unsigned char* end);
+
+            static bool get(const unsigned char*& pos, const unsigned char* end,
+                            uint64_t& value);
+
+            std::vector<boost::shared_ptr<watch> > m_watches;
+            std::vector<read_record> m_reads;
+            uint64_t m_events;
+
+            // inotify_event records of all reads.
+            std::vector<unsigned char> m_data;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_EVENT_LOG_HPP
@@ -0,0 +1,497 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "fanotify_backend.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "exception/raise.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            // The fanotify events carry the bits of their inotify
+            // counterparts, so masks are passed through unchanged.
+            typedef char same_bits[(FAN_ACCESS == IN_ACCESS && FAN_MODIFY == IN_MODIFY &&
+                                    FAN_ATTRIB == IN_ATTRIB && FAN_CLOSE_WRITE == IN_CLOSE_WRITE &&
+                                    FAN_CLOSE_NOWRITE == IN_CLOSE_NOWRITE &&
+                                    FAN_OPEN == IN_OPEN && FAN_MOVED_FROM == IN_MOVED_FROM &&
+                                    FAN_MOVED_TO == IN_MOVED_TO && FAN_CREATE == IN_CREATE &&
+                                    FAN_DELETE == IN_DELETE && FAN_DELETE_SELF == IN_DELETE_SELF &&
+                                    FAN_MOVE_SELF == IN_MOVE_SELF && FAN_ONDIR == IN_ISDIR &&
+                                    FAN_Q_OVERFLOW == IN_Q_OVERFLOW) ? 1 : -1];
+
+            const size_t READ_BUFLEN = 64 * 1024;
+
+            bool below(const std::string& path, const std::string& prefix)
+            {
+                return path.compare(0, prefix.size(), prefix) == 0 &&
+                    (path.size() == prefix.size() || path[prefix.size()] == '/' ||
+                     prefix == "/");
+            }
+
+            // Returns the path a descriptor refers to.
+            bool fd_path(int fd, std::string& out)
+            {
+                char link[32], target[PATH_MAX];
+                std::sprintf(link, "/proc/self/fd/%d", fd);
+
+                ssize_t len = readlink(link, target, sizeof(target));
+
+                if(len < 0 || len == static_cast<ssize_t>(sizeof(target)))
+                    return false;
+
+                out.assign(target, len);
+                return true;
+            }
+
+            const struct file_handle* handle_of(const fanotify_event_info_fid* info)
+            {
+                return reinterpret_cast<const struct file_handle*>(info->handle);
+            }
+
+            std::string key_of(const void* fsid, const struct file_handle* fh)
+            {
+                std::string key(static_cast<const char*>(fsid), sizeof(__kernel_fsid_t));
+                key.append(reinterpret_cast<const char*>(fh),
+                           sizeof(struct file_handle) + fh->handle_bytes);
+                return key;
+            }
+
+            // The name following the handle, empty for events on the
+            // directory itself.
+            const char* name_of(const fanotify_event_info_fid* info)
+            {
+                if(info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID)
+                    return "";
+
+                const struct file_handle* fh = handle_of(info);
+                const char* name = reinterpret_cast<const char*>(fh->f_handle) + fh->handle_bytes;
+
+                return std::strcmp(name, ".") == 0 ? "" : name;
+            }
+        }
+
+
+        fanotify_backend::fanotify_backend()
+            : m_descr(fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                                    FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE)),
+              m_rename(true),
+              m_next_wd(1),
+              m_next_cookie(0),
+              m_raw(READ_BUFLEN),
+              m_out_pos(0)
+        {
+            if(m_descr == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to initialize fanotify");
+        }
+
+        fanotify_backend::~fanotify_backend()
+        {
+            for(size_t i = 0; i < m_marks.size(); ++i)
+                close(m_marks[i].mount_fd);
+
+            close(m_descr);
+        }
+
+        int fanotify_backend::fd() const
+        {
+            return m_descr;
+        }
+
+        bool fanotify_backend::whole_tree() const
+        {
+            return true;
+        }
+
+        int fanotify_backend::add_watch(const std::string& path, uint32_t mask, bool recursive)
+        {
+            mark m;
+            m.path = path;
+            m.recursive = recursive;
+
+            while(m.path.size() > 1 && m.path[m.path.size() - 1] == '/')
+                m.path.erase(m.path.size() - 1);
+
+            m.mount_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if(m.mount_fd == -1)
+                return -1;
+
+            struct statfs fs;
+            union
+            {
+                struct file_handle fh;
+                char storage[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+            } handle;
+            handle.fh.handle_bytes = MAX_HANDLE_SZ;
+            int mount_id;
+
+            if(!fd_path(m.mount_fd, m.real_path) || fstatfs(m.mount_fd, &fs) == -1 ||
+               name_to_handle_at(m.mount_fd, "", &handle.fh, &mount_id, AT_EMPTY_PATH) == -1) {
+                int err = errno;
+                close(m.mount_fd);
+                errno = err;
+                return -1;
+            }
+
+            uint64_t events = (mask & (IN_ALL_EVENTS & ~IN_UNMOUNT)) | FAN_ONDIR;
+            unsigned int flags = FAN_MARK_ADD | (recursive ? FAN_MARK_FILESYSTEM : FAN_MARK_ONLYDIR);
+
+            if(!recursive)
+                events |= FAN_EVENT_ON_CHILD;
+
+            int result = -1;
+
+            // FAN_RENAME reports both halves of a rename at once.
+            if(m_rename && (events & IN_MOVE)) {
+                result = fanotify_mark(m_descr, flags, (events & ~IN_MOVE) | FAN_RENAME,
+                                       m.mount_fd, 0);
+
+                if(result == -1 && errno == EINVAL)
+                    m_rename = false;
+            }
+
+            if(result == -1 && (!m_rename || !(events & IN_MOVE)))
+                result = fanotify_mark(m_descr, flags, events, m.mount_fd, 0);
+
+            if(result == -1) {
+                int err = errno;
+                close(m.mount_fd);
+                errno = err;
+                return -1;
+            }
+
+            m.wd = m_next_wd++;
+            m.fsid.assign(reinterpret_cast<const char*>(&fs.f_fsid), sizeof(fs.f_fsid));
+            m_handles[m.fsid + std::string(handle.storage, sizeof(struct file_handle) +
+                                           handle.fh.handle_bytes)] = m.wd;
+            m_marks.push_back(m);
+
+            return m.wd;
+        }
+
+        ssize_t fanotify_backend::read(unsigned char* buf, size_t len)
+        {
+            for(;;) {
+                if(m_out_pos < m_out.size()) {
+                    size_t n = 0;
+
+                    // Hand out whole records only.
+                    while(m_out_pos + n < m_out.size()) {
+                        const inotify_event* ev =
+                            reinterpret_cast<const inotify_event*>(&m_out[m_out_pos + n]);
+                        size_t size = sizeof(inotify_event) + ev->len;
+
+                        if(n + size > len)
+                            break;
+
+                        n += size;
+                    }
+
+                    if(n == 0) {
+                        errno = EINVAL;
+                        return -1;
+                    }
+
+                    std::memcpy(buf, &m_out[m_out_pos], n);
+                    m_out_pos += n;
+                    return n;
+                }
+
+                m_out.clear();
+                m_out_pos = 0;
+
+                // The records handed out before were processed, so
+                // the directories forgotten meanwhile can go.
+                boost::unordered_map<int, dir>::iterator it = m_dirs.begin();
+                while(it != m_dirs.end()) {
+                    if(it->second.retired)
+                        it = m_dirs.erase(it);
+                    else
+                        ++it;
+                }
+
+                ssize_t n = ::read(m_descr, &m_raw[0], m_raw.size());
+
+                if(n <= 0)
+                    return n;
+
+                const fanotify_event_metadata* meta =
+                    reinterpret_cast<const fanotify_event_metadata*>(&m_raw[0]);
+
+                for(; FAN_EVENT_OK(meta, n); meta = FAN_EVENT_NEXT(meta, n))
+                    convert(meta);
+            }
+        }
+
+        bool fanotify_backend::resolve(int wd, std::string& path, int& root)
+        {
+            boost::unordered_map<int, dir>::const_iterator it = m_dirs.find(wd);
+
+            if(it == m_dirs.end())
+                return false;
+
+            path = it->second.path;
+            root = it->second.root;
+            return true;
+        }
+
+        void fanotify_backend::convert(const fanotify_event_metadata* meta)
+        {
+            if(meta->vers != FANOTIFY_METADATA_VERSION)
+                DMCC_RAISE_CRITICAL("unsupported fanotify metadata version");
+
+            if(meta->fd >= 0)
+                close(meta->fd);
+
+            if(meta->mask & FAN_Q_OVERFLOW) {
+                append(-1, IN_Q_OVERFLOW, 0, "");
+                return;
+            }
+
+            const fanotify_event_info_fid* info = 0;
+            const fanotify_event_info_fid* from = 0;
+            const fanotify_event_info_fid* to = 0;
+
+            const char* p = reinterpret_cast<const char*>(meta) + meta->metadata_len;
+            const char* end = reinterpret_cast<const char*>(meta) + meta->event_len;
+
+            while(p + sizeof(fanotify_event_info_header) <= end) {
+                const fanotify_event_info_header* hdr =
+                    reinterpret_cast<const fanotify_event_info_header*>(p);
+
+                if(hdr->len == 0)
+                    break;
+
+                const fanotify_event_info_fid* fid =
+                    reinterpret_cast<const fanotify_event_info_fid*>(p);
+
+                switch(hdr->info_type) {
+                case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                case FAN_EVENT_INFO_TYPE_DFID:
+                    info = fid;
+                    break;
+#ifdef FAN_RENAME
+                case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                    from = fid;
+                    break;
+                case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                    to = fid;
+                    break;
+#endif
+                }
+
+                p += hdr->len;
+            }
+
+            uint32_t is_dir = meta->mask & IN_ISDIR;
+
+#ifdef FAN_RENAME
+            if((meta->mask & FAN_RENAME) && from && to) {
+                int from_wd = lookup(from);
+                int to_wd = lookup(to);
+                std::string old_path;
+
+                if(from_wd != -1)
+                    old_path = dir_path(from_wd) + '/' + name_of(from);
+
+                if(++m_next_cookie == 0)
+                    ++m_next_cookie;
+
+                // A half outside of the tree is a plain move in or out.
+                if(from_wd != -1)
+                    append(from_wd, IN_MOVED_FROM | is_dir, to_wd != -1 ? m_next_cookie : 0,
+                           name_of(from));
+                if(to_wd != -1)
+                    append(to_wd, IN_MOVED_TO | is_dir, from_wd != -1 ? m_next_cookie : 0,
+                           name_of(to));
+
+                if(is_dir) {
+                    if(!old_path.empty())
+                        forget(old_path);
+
+                    // A directory from outside may be inside now.
+                    m_outside.clear();
+                }
+            }
+#endif
+
+            uint32_t mask = meta->mask & (IN_ALL_EVENTS | IN_ISDIR);
+
+            if(!(mask & ~IN_ISDIR) || !info)
+                return;
+
+            int wd = lookup(info);
+
+            if(wd == -1)
+                return;
+
+            const char* name = name_of(info);
+            append(wd, mask, 0, name);
+
+            if(is_dir && (mask & (IN_DELETE | IN_MOVED_FROM)))
+                forget(dir_path(wd) + '/' + name);
+            else if(mask & IN_DELETE_SELF)
+                forget(dir_path(wd));
+
+            if(is_dir && (mask & IN_MOVED_TO))
+                m_outside.clear();
+        }
+
+        int fanotify_backend::lookup(const fanotify_event_info_fid* info)
+        {
+            std::string key = key_of(&info->fsid, handle_of(info));
+
+            boost::unordered_map<std::string, int>::const_iterator it = m_handles.find(key);
+
+            if(it != m_handles.end())
+                return it->second;
+
+            if(m_outside.count(key))
+                return -1;
+
+            // Resolve the handle through a mark on the same filesystem.
+            const mark* root = 0;
+            std::string path;
+
+            for(size_t i = 0; i < m_marks.size(); ++i) {
+                const mark& m = m_marks[i];
+
+                if(!m.recursive || m.fsid != key.substr(0, m.fsid.size()))
+                    continue;
+
+                if(path.empty()) {
+                    union
+                    {
+                        struct file_handle fh;
+                        char storage[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+                    } handle;
+
+                    const struct file_handle* fh = handle_of(info);
+
+                    if(fh->handle_bytes > MAX_HANDLE_SZ)
+                        return -1;
+
+                    std::memcpy(handle.storage, fh, sizeof(struct file_handle) + fh->handle_bytes);
+                    int fd = open_by_handle_at(m.mount_fd, &handle.fh, O_PATH | O_CLOEXEC);
+
+                    // Already gone.
+                    if(fd == -1)
+                        return -1;
+
+                    bool ok = fd_path(fd, path);
+                    close(fd);
+
+                    if(!ok)
+                        return -1;
+                }
+
+                if(below(path, m.real_path) &&
+                   (!root || m.real_path.size() > root->real_path.size()))
+                    root = &m;
+            }
+
+            if(!root) {
+                m_outside.insert(key);
+                return -1;
+            }
+
+            dir d;
+            d.path = root->path + path.substr(root->real_path.size());
+            d.key = key;
+            d.root = root->wd;
+            d.retired = false;
+
+            int wd = m_next_wd++;
+            m_handles[key] = wd;
+            m_paths[d.path] = wd;
+            m_dirs[wd] = d;
+
+            return wd;
+        }
+
+        const std::string& fanotify_backend::dir_path(int wd) const
+        {
+            boost::unordered_map<int, dir>::const_iterator it = m_dirs.find(wd);
+
+            if(it != m_dirs.end())
+                return it->second.path;
+
+            for(size_t i = 0; i < m_marks.size(); ++i) {
+                if(m_marks[i].wd == wd)
+                    return m_marks[i].path;
+            }
+
+            DMCC_RAISE_CRITICAL("unknown fanotify watch-descriptor");
+        }
+
+        void fanotify_backend::append(int wd, uint32_t mask, uint32_t cookie, const char* name)
+        {
+            size_t name_size = std::strlen(name);
+
+            // Pad the name the same way inotify does.
+            size_t len = name_size ? (name_size + sizeof(inotify_event)) &
+                ~(sizeof(inotify_event) - 1) : 0;
+
+            inotify_event ev;
+            ev.wd = wd;
+            ev.mask = mask;
+            ev.cookie = cookie;
+            ev.len = len;
+
+            size_t off = m_out.size();
+            m_out.resize(off + sizeof(inotify_event) + len, 0);
+            std::memcpy(&m_out[off], &ev, sizeof(inotify_event));
+            std::memcpy(&m_out[off + sizeof(inotify_event)], name, name_size);
+        }
+
+        void fanotify_backend::forget(const std::string& path)
+        {
+            std::vector<int> gone;
+
+            std::map<std::string, int>::iterator it = m_paths.find(path);
+            if(it != m_paths.end())
+                gone.push_back(it->second);
+
+            // Entries like "a-b" sort between "a" and "a/b".
+            it = m_paths.lower_bound(path + '/');
+            for(; it != m_paths.end() && below(it->first, path); ++it)
+                gone.push_back(it->second);
+
+            for(size_t i = 0; i < gone.size(); ++i) {
+                dir& d = m_dirs[gone[i]];
+
+                m_paths.erase(d.path);
+                m_handles.erase(d.key);
+                d.retired = true;
+
+                append(gone[i], IN_IGNORED, 0, "");
+            }
+        }
+    }
+}
@@ -0,0 +1,135 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_FANOTIFY_BACKEND_HPP
+#define DMCC_INOTIFY_FANOTIFY_BACKEND_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "backend.hpp"
+
+struct fanotify_event_metadata;
+struct fanotify_event_info_fid;
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Watches whole filesystems with fanotify.
+
+           A recursive watch is a single FAN_MARK_FILESYSTEM mark, so
+           its kernel cost doesn't grow with the number of
+           directories. Events are reported with the file handle of
+           their directory (FAN_REPORT_DFID_NAME). A directory gets a
+           watch-descriptor the first time it reports an event, and
+           its handle is resolved to a path then. Events of
+           directories outside the watched tree are dropped.
+
+           Renames are joined through FAN_RENAME where the kernel
+           supports it. A directory that is renamed or deleted gets
+           IN_IGNORED for itself and the directories below it, and
+           new descriptors once events arrive for them again.
+           Directories deleted before their events were read can't be
+           resolved anymore, so those events are lost.
+
+           Requires CAP_SYS_ADMIN, and a kernel and filesystem that
+           support FAN_REPORT_DFID_NAME (Linux 5.9).
+        */
+        class fanotify_backend : public backend
+        {
+        public:
+            fanotify_backend();
+            ~fanotify_backend();
+
+            int fd() const;
+            int add_watch(const std::string& path, uint32_t mask, bool recursive);
+            ssize_t read(unsigned char* buf, size_t len);
+            bool whole_tree() const;
+            bool resolve(int wd, std::string& path, int& root);
+
+        private:
+            struct mark
+            {
+                int wd;
+
+                // The path as given and as the kernel reports it.
+                std::string path;
+                std::string real_path;
+
+                int mount_fd;
+                std::string fsid;
+                bool recursive;
+            };
+
+            struct dir
+            {
+                std::string path;
+                std::string key;
+                int root;
+
+                // Forgotten, erased once its IN_IGNORED was read.
+                bool retired;
+            };
+
+            // Converts an event into inotify records.
+            void convert(const fanotify_event_metadata* meta);
+
+            // Returns the descriptor of the directory an info record
+            // refers to, or -1 if it is outside the watched trees.
+            int lookup(const fanotify_event_info_fid* info);
+
+            // Returns the path of the directory of a descriptor.
+            const std::string& dir_path(int wd) const;
+
+            void append(int wd, uint32_t mask, uint32_t cookie, const char* name);
+
+            // Forgets the directories at or below path, so their
+            // handles are resolved again.
+            void forget(const std::string& path);
+
+            int m_descr;
+            bool m_rename;
+
+            std::vector<mark> m_marks;
+
+            // Handle (fsid and struct file_handle) to descriptor.
+            boost::unordered_map<std::string, int> m_handles;
+            boost::unordered_map<int, dir> m_dirs;
+            std::map<std::string, int> m_paths;
+
+            // Handles of directories outside the watched trees.
+            boost::unordered_set<std::string> m_outside;
+
+            int m_next_wd;
+            uint32_t m_next_cookie;
+
+            std::vector<unsigned char> m_raw;
+
+            // Converted records not handed out yet.
+            std::vector<unsigned char> m_out;
+            size_t m_out_pos;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_FANOTIFY_BACKEND_HPP
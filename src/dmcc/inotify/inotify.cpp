@@ -20,12 +20,31 @@
 #include <iostream>
 #include <boost/filesystem/convenience.hpp>
 
+#include <algorithm>
 #include <cerrno>
+#include <ctime>
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "exception/raise.hpp"
+#include "tree_scanner.hpp"
+#include "coalescer.hpp"
+#include "rename_pairer.hpp"
+#include "snapshot_file.hpp"
+#include "dispatcher.hpp"
+#include "path_filter.hpp"
+#include "backend.hpp"
+#include "watch_budget.hpp"
+#include "event_log.hpp"
+#include "content_filter.hpp"
 
 #define INOTIFY_EVENT_SIZE (sizeof(struct inotify_event))
 #define INOTIFY_BUFLEN ((INOTIFY_EVENT_SIZE + 16) * 1024)
+#define MAX_READS_PER_POLL 64
 
 namespace fs = boost::filesystem;
 
@@ -36,95 +55,1140 @@ using boost::regex;
 using boost::system::system_category;
 using boost::shared_ptr;
 
+namespace {
+    // Events that are delivered regardless of the watch mask.
+    const uint32_t IN_ALWAYS = IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT;
+
+    // Events a recursive watch needs to notice new directories.
+    const uint32_t IN_NEW_DIR = IN_CREATE | IN_MOVED_TO;
+
+    // Marks synthesized events for directories that were already
+    // scanned. Not used by the kernel and stripped before dispatch.
+    const uint32_t IN_SCANNED = 0x00800000;
+
+    // Length of root including a separator, the offset of the
+    // relative paths below it.
+    size_t root_length(const fs::path& root)
+    {
+        const std::string& s = root.string();
+        return s.empty() || s[s.size() - 1] == '/' ? s.size() : s.size() + 1;
+    }
+
+    // Monotonic time in milliseconds.
+    uint64_t now_ms()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // Orders eviction candidates by their last event.
+    bool colder(const std::pair<uint64_t, int>& a, const std::pair<uint64_t, int>& b)
+    {
+        return a.first < b.first;
+    }
+}
+
 
 namespace dmcc {
     namespace inotify {
+        class inotify::recursive_visitor : public tree_scanner::visitor
+        {
+        public:
+            recursive_visitor(inotify& in, uint32_t mask, bool report, size_t root_length)
+                : m_inotify(in), m_mask(mask), m_report(report), m_root_length(root_length)
+            {
+            }
+
+            int enter(const fs::path& dir)
+            {
+                std::string buffer;
+
+                if(!m_inotify.accepts_dir(dir.string(), m_root_length, buffer))
+                    return -1;
+
+                return m_inotify.insert_watch(dir, m_mask, true, m_root_length);
+            }
+
+            bool entries(const fs::path& dir, int wd,
+                         const tree_scanner::entry_list_t& entries)
+            {
+                if(m_inotify.m_snapshot)
+                    m_inotify.m_snapshot->record(wd, dir, entries);
+
+                if(m_report && (m_mask & IN_CREATE)) {
+                    // Report what was created before the watch existed.
+                    tree_scanner::entry_list_t::const_iterator it = entries.begin();
+                    for(; it != entries.end(); ++it)
+                        m_inotify.synthesize(wd, IN_CREATE | IN_SCANNED |
+                                             (it->is_dir ? IN_ISDIR : 0), it->name);
+                }
+
+                return true;
+            }
+
+        private:
+            inotify& m_inotify;
+            uint32_t m_mask;
+            bool m_report;
+            size_t m_root_length;
+        };
+
+        class inotify::resume_visitor : public tree_scanner::visitor
+        {
+        public:
+            resume_visitor(inotify& in, uint32_t mask, const snapshot_file& previous,
+                           size_t root_length)
+                : m_inotify(in), m_mask(mask), m_previous(previous), m_root_length(root_length)
+            {
+            }
+
+            int enter(const fs::path& dir)
+            {
+                std::string buffer;
+
+                if(!m_inotify.accepts_dir(dir.string(), m_root_length, buffer))
+                    return -1;
+
+                return m_inotify.insert_watch(dir, m_mask, true, m_root_length);
+            }
+
+            bool list(const fs::path& dir, int, tree_scanner::entry_list_t& out)
+            {
+                int index = m_previous.find_dir(dir.string());
+
+                if(index < 0 || m_previous.dir_mtime(index) == 0)
+                    return false;
+
+                snapshot::info self;
+
+                if(!snapshot::stat_entry(AT_FDCWD, dir.string().c_str(), self) ||
+                   self.mtime != m_previous.dir_mtime(index))
+                    return false;
+
+                // Nothing was added or removed, the stored listing is
+                // still accurate.
+                m_previous.list(index, out);
+                return true;
+            }
+
+            bool entries(const fs::path& dir, int wd,
+                         const tree_scanner::entry_list_t& entries)
+            {
+                int dirfd = open(dir.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+                if(dirfd == -1)
+                    // Gone, the parent reports it.
+                    return true;
+
+                snapshot::info self;
+                self.mtime = 0;
+                snapshot::stat_entry(dirfd, ".", self);
+
+                std::vector<snapshot::change> changes;
+                snapshot::listing_t examined;
+
+                // Directories missing in the snapshot compare as empty,
+                // so their contents are reported as created.
+                m_previous.diff(m_previous.find_dir(dir.string()), dirfd, entries, wd,
+                                changes, examined);
+                close(dirfd);
+
+                if(m_inotify.m_snapshot)
+                    m_inotify.m_snapshot->assign(wd, self.mtime, examined);
+
+                // The scan continues into new directories itself.
+                for(size_t i = 0; i < changes.size(); ++i)
+                    m_inotify.synthesize(wd, changes[i].mask | IN_SCANNED, changes[i].name);
+
+                return true;
+            }
+
+        private:
+            inotify& m_inotify;
+            uint32_t m_mask;
+            const snapshot_file& m_previous;
+            size_t m_root_length;
+        };
+
         inotify::inotify()
-            : m_descr(inotify_init())
+            : m_signal(timed_last_value(&m_stats)),
+              m_batch_signal(timed_last_value(&m_stats)),
+              m_next_slot(0),
+              m_backend(new inotify_backend),
+              m_epoll(-1),
+              m_wakeup(-1),
+              m_timer(-1),
+              m_timer_deadline(0),
+              m_recovery_threads(0),
+              m_wakeup_events(0)
+        {
+            init();
+        }
+
+        inotify::inotify(boost::shared_ptr<backend> b)
+            : m_signal(timed_last_value(&m_stats)),
+              m_batch_signal(timed_last_value(&m_stats)),
+              m_next_slot(0),
+              m_backend(b),
+              m_epoll(-1),
+              m_wakeup(-1),
+              m_timer(-1),
+              m_timer_deadline(0),
+              m_recovery_threads(0),
+              m_wakeup_events(0)
+        {
+            DMCC_ASSERT(m_backend);
+            init();
+        }
+
+        void inotify::init()
+        {
+            m_epoll = epoll_create1(EPOLL_CLOEXEC);
+            m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+            if(m_epoll == -1 || m_wakeup == -1 || m_timer == -1) {
+                int err = errno;
+                close_descriptors();
+                errno = err;
+
+                DMCC_RAISE_LINUX_SYS_ERR("unable to initialize the event loop");
+            }
+
+            int fds[3] = { m_backend->fd(), m_wakeup, m_timer };
+
+            for(int i = 0; i < 3; ++i) {
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.u64 = 0;
+                ev.data.fd = fds[i];
+
+                if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+                    int err = errno;
+                    close_descriptors();
+                    errno = err;
+
+                    DMCC_RAISE_LINUX_SYS_ERR("unable to initialize the event loop");
+                }
+            }
+        }
+
+        inotify::~inotify()
         {
-            // Check inotify initialization.
-            if(m_descr <= 0)
-                DMCC_RAISE_LINUX_SYS_ERR("unable to initialize inotify");
+            // Deliver what is queued before the descriptors go away.
+            m_dispatcher.reset();
+            close_descriptors();
+        }
+
+        void inotify::close_descriptors()
+        {
+            if(m_wakeup != -1)
+                close(m_wakeup);
+
+            if(m_timer != -1)
+                close(m_timer);
+
+            if(m_epoll != -1)
+                close(m_epoll);
         }
 
         void inotify::add_watch(const fs::path& path, uint32_t mask)
         {
             // Add watch to underlaying inotify-descriptor.
-            int wd = inotify_add_watch(m_descr, path.string().c_str(), mask);
+            int wd = m_backend->add_watch(path.string(), mask, false);
 
             // Inform user about failure.
             if(wd <= 0)
                 DMCC_RAISE_LINUX_SYS_ERR("unable to add watch for `" + path.string() + "'");
 
             shared_ptr<watch> w = shared_ptr<watch>(new watch(path));
-            m_wd_map.insert(std::pair<int,shared_ptr<watch> >(wd, w));
+            w->m_mask = mask;
+            store_watch(wd, w);
         }
 
         void inotify::add_watch(boost::shared_ptr<watch> w, uint32_t mask)
         {
             // Add watch to underlaying inotify-descriptor.
-            int wd = inotify_add_watch(m_descr, w->path().string().c_str(), mask);
+            int wd = m_backend->add_watch(w->path().string(), mask, false);
 
             // Inform user about failure.
             if(wd <= 0)
                 DMCC_RAISE_LINUX_SYS_ERR("unable to add watch for `" + w->path().string() + "'");
 
-            m_wd_map.insert(std::pair<int,shared_ptr<watch> >(wd, w));
+            w->m_mask = mask;
+            store_watch(wd, w);
+        }
+
+        void inotify::add_recursive_watch(const fs::path& root, uint32_t mask,
+                                          unsigned threads)
+        {
+            if(m_backend->whole_tree()) {
+                int wd = m_backend->add_watch(root.string(), mask, true);
+
+                if(wd <= 0)
+                    DMCC_RAISE_LINUX_SYS_ERR("unable to add watch for `" + root.string() + "'");
+
+                shared_ptr<watch> w(new watch(root));
+                w->m_mask = mask;
+                store_watch(wd, w);
+                return;
+            }
+
+            recursive_visitor v(*this, mask, false, root_length(root));
+            tree_scanner(threads).run(root, v);
+        }
+
+        void inotify::resume_recursive_watch(const fs::path& root, uint32_t mask,
+                                             const fs::path& file, unsigned threads)
+        {
+            snapshot_file previous(file);
+
+            if(!previous.valid() || m_backend->whole_tree()) {
+                add_recursive_watch(root, mask, threads);
+                return;
+            }
+
+            resume_visitor v(*this, mask, previous, root_length(root));
+            tree_scanner(threads).run(root, v);
+        }
+
+        void inotify::save_snapshot(const fs::path& file) const
+        {
+            DMCC_ASSERT(m_snapshot);
+
+            std::vector<snapshot::dir> dirs;
+            recursive_dirs(dirs);
+
+            m_snapshot->save(file, dirs);
+        }
+
+        void inotify::set_coalescing(const boost::posix_time::time_duration& window,
+                                     uint32_t mask)
+        {
+            if(mask == 0)
+                m_coalescer.reset();
+            else
+                m_coalescer.reset(new coalescer(mask, window.total_milliseconds()));
+        }
+
+        void inotify::set_rename_pairing(const boost::posix_time::time_duration& window,
+                                         size_t limit)
+        {
+            if(limit == 0)
+                m_pairer.reset();
+            else
+                m_pairer.reset(new rename_pairer(window.total_milliseconds(), limit));
+        }
+
+        void inotify::set_content_filter(uint32_t mask, size_t cache_size, unsigned threads)
+        {
+            if(mask == 0)
+                m_content.reset();
+            else
+                m_content.reset(new content_filter(mask, cache_size, threads));
+        }
+
+        void inotify::set_overflow_recovery(bool enabled, unsigned threads)
+        {
+            m_recovery_threads = threads;
+
+            if(!enabled)
+                m_snapshot.reset();
+            else if(!m_snapshot)
+                m_snapshot.reset(new snapshot);
+        }
+
+        void inotify::set_dispatch_threads(unsigned threads)
+        {
+            m_dispatcher.reset();
+
+            if(threads > 0)
+                m_dispatcher.reset(new dispatcher(*this, threads));
+        }
+
+        void inotify::set_filter(const path_filter& filter)
+        {
+            if(filter.empty())
+                m_filter.reset();
+            else
+                m_filter.reset(new path_filter(filter));
+        }
+
+        void inotify::set_recorder(const boost::shared_ptr<event_recorder>& recorder)
+        {
+            m_recorder = recorder;
+        }
+
+        void inotify::set_watch_budget(const boost::posix_time::time_duration& interval,
+                                       size_t limit)
+        {
+            if(m_backend->whole_tree())
+                return;
+
+            m_budget.reset(new watch_budget(limit, interval.total_milliseconds()));
+        }
+
+        void inotify::set_statistics(bool enabled)
+        {
+            // Enabling twice keeps the figures gathered so far.
+            if(enabled && !m_stats)
+                m_stats.reset(new stats_collector);
+            else if(!enabled)
+                m_stats.reset();
+        }
+
+        statistics inotify::get_statistics() const
+        {
+            if(!m_stats)
+                return statistics();
+
+            return m_stats->snapshot();
+        }
+
+        void inotify::reset_statistics()
+        {
+            if(m_stats)
+                m_stats->reset();
+        }
+
+        int inotify::connect_slot(const event_sig_t::slot_type& slot)
+        {
+            int id = m_next_slot++;
+
+            m_signal.connect(id, slot);
+            m_slots.push_back(std::make_pair(id, slot));
+
+            if(m_dispatcher)
+                m_dispatcher->connect(id, slot);
+
+            return id;
+        }
+
+        int inotify::connect_batch_slot(const batch_sig_t::slot_type& slot)
+        {
+            int id = m_next_slot++;
+
+            m_batch_signal.connect(id, slot);
+            m_batch_slots.push_back(std::make_pair(id, slot));
+
+            if(m_dispatcher)
+                m_dispatcher->connect(id, slot);
+
+            return id;
         }
 
-        void inotify::connect_slot(const event_sig_t::slot_type& slot)
+        void inotify::disconnect_slot(int id)
         {
-            m_signal.connect(slot);
+            m_signal.disconnect(id);
+            m_batch_signal.disconnect(id);
+
+            for(size_t i = 0; i < m_slots.size(); ++i) {
+                if(m_slots[i].first == id)
+                    m_slots.erase(m_slots.begin() + i);
+            }
+
+            for(size_t i = 0; i < m_batch_slots.size(); ++i) {
+                if(m_batch_slots[i].first == id)
+                    m_batch_slots.erase(m_batch_slots.begin() + i);
+            }
+
+            if(m_dispatcher)
+                m_dispatcher->disconnect(id);
         }
 
         void inotify::listen()
         {
-            bool break_out = false;
+            while(!poll_once(boost::posix_time::pos_infin))
+                ;
+        }
+
+        bool inotify::listen_for(const boost::posix_time::time_duration& timeout)
+        {
+            uint64_t deadline = now_ms() + timeout.total_milliseconds();
+
+            for(;;) {
+                uint64_t now = now_ms();
+
+                if(now >= deadline)
+                    return false;
+
+                if(poll_once(boost::posix_time::milliseconds(deadline - now)))
+                    return true;
+            }
+        }
+
+        bool inotify::poll_once(const boost::posix_time::time_duration& timeout)
+        {
+            int timeout_ms = timeout.is_pos_infinity() ? -1 : timeout.total_milliseconds();
+
+            if(m_budget)
+                poll_dirs();
+
+            // Events synthesized outside of listening, e.g. by
+            // resume_recursive_watch(), come first.
+            if(!m_synthesized.empty()) {
+                if(process_synthesized())
+                    return true;
+
+                timeout_ms = 0;
+            }
+
+            // Wake up in time to release held events.
+            int left = next_deadline();
+
+            if(left >= 0 && (timeout_ms < 0 || left < timeout_ms))
+                timeout_ms = left;
+
+            struct epoll_event ready[3];
+            int n = epoll_wait(m_epoll, ready, 3, timeout_ms);
+
+            if(n == -1 && errno != EINTR)
+                DMCC_RAISE_LINUX_SYS_ERR("waiting for events failed");
+
+            bool readable = false;
+            bool stopped = false;
+
+            for(int i = 0; i < n; ++i) {
+                if(ready[i].data.fd == m_wakeup) {
+                    uint64_t count;
+
+                    // Reset the wakeup counter.
+                    if(read(m_wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                        DMCC_RAISE_LINUX_SYS_ERR("reading the wakeup descriptor failed");
+
+                    stopped = true;
+                }
+                else if(ready[i].data.fd == m_timer) {
+                    uint64_t expirations;
+
+                    if(read(m_timer, &expirations, sizeof(expirations)) == -1 &&
+                       errno != EAGAIN)
+                        DMCC_RAISE_LINUX_SYS_ERR("reading the timer failed");
 
-            while(!break_out) {
+                    // Expired, so it has to be armed again.
+                    m_timer_deadline = 0;
+                }
+                else
+                    readable = true;
+            }
+
+            if(stopped) {
+                // Maybe stopped by a slot that threw on a worker.
+                if(m_dispatcher)
+                    m_dispatcher->rethrow();
+
+                return true;
+            }
+
+            if(!readable)
+                // Only release held events.
+                return process(0, 0);
+
+            m_wakeup_events = 0;
+
+            // Bounded, so stop() is noticed even if events keep coming.
+            for(int reads = 0; reads < MAX_READS_PER_POLL; ++reads) {
                 // Buffer to store event stream chunks.
-                unsigned char buf[INOTIFY_BUFLEN];
+                unsigned char buf[INOTIFY_BUFLEN]
+                    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+                ssize_t len = m_backend->read(buf, INOTIFY_BUFLEN);
 
-                ssize_t len = 0;
+                if(len == -1) {
+                    if(errno == EINTR)
+                        continue;
 
-                do {
-                    // Read waiting events.
-                    len = read(m_descr, buf, INOTIFY_BUFLEN);
-            
-                } while (len == -1);
+                    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                        // Queue drained.
+                        if(m_stats)
+                            m_stats->local().record_wakeup(m_wakeup_events);
+
+                        return false;
+                    }
 
-                if (len == -1 && !(errno == EWOULDBLOCK || errno == EINTR))
                     DMCC_RAISE_LINUX_SYS_ERR("reading events failed");
+                }
+
+                if(process(buf, len, m_stats ? stats_collector::now() : 0))
+                    return true;
+
+                // Deliver the events that were generated while
+                // processing, e.g. the contents of new directories.
+                if(process_synthesized())
+                    return true;
+            }
 
-                if (len == -1)
-                    return;
+            return false;
+        }
 
-                ssize_t i = 0;
+        bool inotify::process_synthesized()
+        {
+            while(!m_synthesized.empty()) {
+                std::vector<unsigned char> pending;
+                pending.swap(m_synthesized);
 
-                // Parse events.
-                while (i < len) {
+                if(process(&pending[0], pending.size()))
+                    return true;
+            }
 
-                    // Is destroyed as early as possible.
-                    event ev;
+            return false;
+        }
 
-                    // Construct event from next chunk.
-                    ev.m_event = (inotify_event*)(&buf[i]);
+        int inotify::next_deadline() const
+        {
+            uint64_t deadline = this->deadline();
 
-                    ev.m_watch = m_wd_map[ev.wd()];
-                    DMCC_ASSERT(ev.m_watch);
+            if(deadline == 0)
+                return -1;
 
-                    // Emit signal.
-                    if((break_out = m_signal(*this, ev)) == true)
-                        break;
+            uint64_t now = now_ms();
+
+            return deadline > now ? deadline - now : 0;
+        }
+
+        uint64_t inotify::deadline() const
+        {
+            uint64_t deadline = 0;
+
+            if(m_pairer)
+                deadline = m_pairer->deadline();
+
+            if(m_coalescer && m_coalescer->deadline() != 0 &&
+               (deadline == 0 || m_coalescer->deadline() < deadline))
+                deadline = m_coalescer->deadline();
+
+            if(m_budget && m_budget->deadline() != 0 &&
+               (deadline == 0 || m_budget->deadline() < deadline))
+                deadline = m_budget->deadline();
+
+            return deadline;
+        }
+
+        void inotify::store_watch(int wd, const shared_ptr<watch>& w)
+        {
+            shared_ptr<watch> replaced = m_wd_map.insert(wd, w);
+
+            if(replaced && replaced != w)
+                m_replaced.push_back(std::make_pair(now_ms(), replaced));
+        }
+
+        void inotify::release_replaced(uint64_t now)
+        {
+            if(m_replaced.empty())
+                return;
+
+            // Events held before a watch was replaced are released
+            // within the longest window.
+            uint64_t hold = 0;
+
+            if(m_pairer)
+                hold = m_pairer->window();
+
+            if(m_coalescer)
+                hold = std::max(hold, m_coalescer->window());
+
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            size_t kept = 0;
+
+            for(size_t i = 0; i < m_replaced.size(); ++i) {
+                if(m_replaced[i].first + hold >= now)
+                    m_replaced[kept++] = m_replaced[i];
+            }
+
+            m_replaced.resize(kept);
+        }
+
+        void inotify::arm_timer()
+        {
+            uint64_t deadline = this->deadline();
+
+            if(deadline == m_timer_deadline)
+                return;
+
+            // A zero value disarms the timer.
+            struct itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            spec.it_value.tv_sec = deadline / 1000;
+            spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+            if(timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &spec, 0) == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to arm the timer");
+
+            m_timer_deadline = deadline;
+        }
+
+        void inotify::stop()
+        {
+            uint64_t one = 1;
+
+            if(write(m_wakeup, &one, sizeof(one)) == -1 && errno != EAGAIN)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to wake up the listener");
+        }
+
+        int inotify::fd() const
+        {
+            return m_epoll;
+        }
+
+
+        int inotify::insert_watch(const fs::path& path, uint32_t mask, bool recursive,
+                                  size_t root_length)
+        {
+            if(m_budget) {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                if(m_budget->full(kernel_watches()))
+                    evict();
+            }
+
+            int wd = m_backend->add_watch(path.string(), kernel_mask(mask, recursive), false);
+            int error = errno;
+
+            shared_ptr<watch> w = shared_ptr<watch>(new watch(path));
+            w->m_mask = mask;
+            w->m_recursive = recursive;
+            w->m_root_length = root_length;
+            w->m_last_event = m_budget ? now_ms() : 0;
+
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            if(wd < 0 && error == ENOSPC && m_budget && recursive) {
+                // Other programs use up the per-user limit as well.
+                evict();
+                wd = m_backend->add_watch(path.string(), kernel_mask(mask, recursive), false);
+                error = errno;
+
+                if(wd < 0 && error == ENOSPC)
+                    wd = m_budget->add(path, -1);
+            }
+
+            if(wd < 0) {
+                errno = error;
+
+                // The directory vanished before we got to it, its
+                // removal is reported by the parent watch.
+                if(recursive && (errno == ENOENT || errno == ENOTDIR))
+                    return -1;
+
+                DMCC_RAISE_LINUX_SYS_ERR("unable to add watch for `" + path.string() + "'");
+            }
+
+            store_watch(wd, w);
+
+            return wd;
+        }
+
+        uint32_t inotify::kernel_mask(uint32_t mask, bool recursive) const
+        {
+            if(!recursive)
+                return mask;
+
+            mask |= IN_NEW_DIR | IN_ONLYDIR;
+
+            if(m_snapshot)
+                mask |= snapshot::TRACKED_EVENTS;
+
+            return mask;
+        }
+
+        size_t inotify::kernel_watches() const
+        {
+            // Evicted watches stay in the map until the kernel
+            // confirms their removal.
+            return m_wd_map.size() - m_budget->polled_count() - m_budget->retired_count();
+        }
+
+        void inotify::evict()
+        {
+            std::vector<std::pair<int, watch*> > watches;
+            m_wd_map.entries(watches);
+
+            std::vector<std::pair<uint64_t, int> > candidates;
+
+            for(size_t i = 0; i < watches.size(); ++i) {
+                int wd = watches[i].first;
+                const watch& w = *watches[i].second;
+
+                // Watches added by the user stay.
+                if(w.m_recursive && !watch_budget::polled(wd) && !m_budget->retiring(wd))
+                    candidates.push_back(std::make_pair(w.m_last_event, wd));
+            }
+
+            // A few at once, so not every new directory evicts.
+            size_t count = std::min(candidates.size(),
+                                    std::max<size_t>(1, m_budget->limit() / 20));
+
+            if(count < candidates.size())
+                std::nth_element(candidates.begin(), candidates.begin() + count,
+                                 candidates.end(), colder);
+
+            for(size_t i = 0; i < count; ++i) {
+                int wd = candidates[i].second;
+                shared_ptr<watch> w = m_wd_map.get(wd);
+
+                // Listed before the watch goes, so nothing is missed
+                // in between. The kernel may have dropped the watch
+                // already, then its IN_IGNORED is on the way anyway.
+                store_watch(m_budget->add(w->path(), wd), w);
+                m_backend->remove_watch(wd);
+
+                if(m_snapshot)
+                    m_snapshot->drop(wd);
+            }
+        }
+
+        void inotify::poll_dirs()
+        {
+            std::vector<snapshot::change> changes;
+            std::vector<int> changed;
+
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                m_budget->run(now_ms(), changes, changed);
+
+                bool evicted = false;
+
+                // Directories that changed are active again and take
+                // the watches of colder ones. Queued events may still
+                // refer to the descriptors of polled directories, wait
+                // for them to be processed.
+                for(size_t i = 0; i < changed.size() && m_synthesized.empty(); ++i) {
+                    if(m_budget->full(kernel_watches())) {
+                        // Once per round, so two busy directories
+                        // don't take turns within it.
+                        if(evicted)
+                            break;
+
+                        evict();
+                        evicted = true;
+                    }
+
+                    int wd = changed[i];
+                    shared_ptr<watch> w = m_wd_map.get(wd);
+
+                    int new_wd = m_backend->add_watch(w->path().string(),
+                                                      kernel_mask(w->m_mask, true), false);
+
+                    if(new_wd < 0)
+                        continue;
+
+                    w->m_last_event = now_ms();
+                    store_watch(new_wd, w);
+
+                    for(size_t j = 0; j < changes.size(); ++j) {
+                        if(changes[j].wd == wd)
+                            changes[j].wd = new_wd;
+                    }
+
+                    m_budget->remove(wd, new_wd, changes, m_snapshot.get());
+                    m_wd_map.erase(wd);
+                }
+            }
+
+            for(size_t i = 0; i < changes.size(); ++i)
+                synthesize(changes[i].wd, changes[i].mask, changes[i].name);
+
+            arm_timer();
+        }
+
+        watch* inotify::resolve_watch(int wd)
+        {
+            std::string path;
+            int root_wd;
+
+            if(!m_backend->resolve(wd, path, root_wd))
+                return 0;
+
+            watch* root = m_wd_map.find(root_wd);
+
+            if(!root)
+                return 0;
+
+            // Belongs to the tree of root, so the filter sees the
+            // same relative paths.
+            shared_ptr<watch> w(new watch(path));
+            w->m_mask = root->m_mask;
+            w->m_root_length = root->m_root_length;
+
+            // Excluded directories are covered by the watch of the
+            // tree as well, so their events are dropped by the mask.
+            std::string buffer;
+            size_t pos = w->m_root_length;
+
+            while(w->m_mask && pos < path.size()) {
+                size_t slash = std::min(path.find('/', pos), path.size());
+
+                if(!accepts_dir(path.substr(0, slash), w->m_root_length, buffer))
+                    w->m_mask = 0;
+
+                pos = slash + 1;
+            }
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            store_watch(wd, w);
+
+            return w.get();
+        }
+
+        boost::string_ref inotify::relative_dir(const watch& w)
+        {
+            const std::string& path = w.m_path.string();
+
+            if(path.size() <= w.m_root_length)
+                return boost::string_ref();
+
+            return boost::string_ref(path).substr(w.m_root_length);
+        }
+
+        bool inotify::accepts_dir(const std::string& path, size_t root_length,
+                                  std::string& buffer) const
+        {
+            // The root itself is always watched.
+            if(!m_filter || path.size() <= root_length)
+                return true;
+
+            size_t slash = path.rfind('/');
+            boost::string_ref dir;
+
+            if(slash != std::string::npos && slash > root_length)
+                dir = boost::string_ref(path).substr(root_length, slash - root_length);
+
+            return m_filter->accepts(dir, path.c_str() + slash + 1, true, buffer);
+        }
+
+        void inotify::recursive_dirs(std::vector<snapshot::dir>& out) const
+        {
+            std::vector<std::pair<int, watch*> > watches;
+            m_wd_map.entries(watches);
+
+            for(size_t i = 0; i < watches.size(); ++i) {
+                if(!watches[i].second->m_recursive || watch_budget::polled(watches[i].first))
+                    continue;
+
+                snapshot::dir d;
+                d.wd = watches[i].first;
+                d.path = watches[i].second->path();
+                out.push_back(d);
+            }
+        }
+
+        void inotify::recover()
+        {
+            std::vector<snapshot::dir> dirs;
+            recursive_dirs(dirs);
+
+            std::vector<snapshot::change> changes;
+            m_snapshot->rescan(dirs, m_recovery_threads, changes);
+
+            // New directories are picked up by the recursion when these
+            // are processed.
+            for(size_t i = 0; i < changes.size(); ++i)
+                synthesize(changes[i].wd, changes[i].mask, changes[i].name);
+        }
+
+        void inotify::watch_new_dir(const fs::path& path, uint32_t mask, bool moved,
+                                    size_t root_length)
+        {
+            recursive_visitor v(*this, mask, true, root_length);
+
+            // Fresh directories are almost empty, only trees moved in
+            // from elsewhere are worth scanning in parallel.
+            tree_scanner(moved ? 0 : 1).run(path, v);
+        }
+
+        bool inotify::inject(unsigned char* buf, ssize_t len)
+        {
+            for(ssize_t i = 0; i < len;) {
+                inotify_event* ev = reinterpret_cast<inotify_event*>(&buf[i]);
+                ev->mask |= IN_SCANNED;
+                i += INOTIFY_EVENT_SIZE + ev->len;
+            }
+
+            return process(buf, len, m_stats ? stats_collector::now() : 0);
+        }
+
+        void inotify::synthesize(int wd, uint32_t mask, const std::string& name)
+        {
+            // Pad the name the same way the kernel does.
+            size_t name_len = (name.size() + INOTIFY_EVENT_SIZE) & ~(INOTIFY_EVENT_SIZE - 1);
+
+            inotify_event ev;
+            ev.wd = wd;
+            ev.mask = mask;
+            ev.cookie = 0;
+            ev.len = name_len;
+
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            size_t off = m_synthesized.size();
+            m_synthesized.resize(off + INOTIFY_EVENT_SIZE + name_len, 0);
+            memcpy(&m_synthesized[off], &ev, INOTIFY_EVENT_SIZE);
+            memcpy(&m_synthesized[off + INOTIFY_EVENT_SIZE], name.data(), name.size());
+        }
+
+        bool inotify::process(unsigned char* buf, ssize_t len, uint64_t read_time)
+        {
+            ssize_t i = 0;
+            size_t decoded = 0;
+            size_t overflows = 0;
+
+            m_batch.clear();
+
+            uint64_t now = now_ms();
+
+            // Parse events.
+            while (i < len) {
+                event ev;
+
+                // Construct event from next chunk.
+                ev.m_event = (inotify_event*)(&buf[i]);
+                i += INOTIFY_EVENT_SIZE + (ssize_t) ev.m_event->len;
+
+                bool scanned = ev.m_event->mask & IN_SCANNED;
+                ev.m_event->mask &= ~IN_SCANNED;
+
+                ev.m_watch = m_wd_map.find(ev.wd());
+                ++decoded;
+
+                if(m_budget && ev.m_watch) {
+                    if(ev.mask() & IN_IGNORED) {
+                        boost::mutex::scoped_lock lock(m_mutex);
+
+                        // The directory of an evicted watch is polled
+                        // under another descriptor.
+                        if(m_budget->retired(ev.wd())) {
+                            m_wd_map.erase(ev.wd());
+                            continue;
+                        }
+                    }
+
+                    ev.m_watch->m_last_event = now;
+                }
+
+                if(!ev.m_watch && !(ev.mask() & IN_Q_OVERFLOW))
+                    ev.m_watch = resolve_watch(ev.wd());
+
+                // Recorded with the watch resolved, replay needs it
+                // for the events of lazy backends as well.
+                if(m_recorder)
+                    m_recorder->add(*ev.m_event, ev.m_watch);
+
+                if(!ev.m_watch) {
+                    // Only overflows come without a watch.
+                    DMCC_ASSERT(ev.mask() & IN_Q_OVERFLOW);
+                    ++overflows;
+
+                    if(m_snapshot)
+                        recover();
+
+                    m_batch.push_back(ev);
+                    continue;
+                }
+
+                if(m_filter && ev.m_event->len &&
+                   !m_filter->accepts(relative_dir(*ev.m_watch), ev.m_event->name,
+                                      ev.mask() & IN_ISDIR, m_filter_path))
+                    continue;
+
+                if(m_snapshot && ev.m_watch->m_recursive && !watch_budget::polled(ev.wd()))
+                    m_snapshot->update(ev.wd(), ev.m_watch->path(), ev.mask(), ev.name_ref());
+
+                if(!scanned && ev.m_watch->m_recursive && (ev.mask() & IN_ISDIR) &&
+                   (ev.mask() & IN_NEW_DIR))
+                    watch_new_dir(ev.path(), ev.m_watch->m_mask, ev.mask() & IN_MOVED_TO,
+                                  ev.m_watch->m_root_length);
+
+                // Skip the events only requested for recursion.
+                if(!(ev.mask() & (ev.m_watch->m_mask | IN_ALWAYS)))
+                    continue;
+
+                m_batch.push_back(ev);
+            }
+
+            if(m_recorder)
+                m_recorder->end_read();
+
+            if(m_stats && read_time) {
+                m_stats->local().record_read(len, decoded, overflows);
+                m_wakeup_events += decoded;
+            }
 
-                    i += INOTIFY_EVENT_SIZE + (ssize_t) ev.m_event->len;
+            if(m_pairer) {
+                m_pairer->run(m_batch, m_staged, now);
+                m_batch.swap(m_staged);
+                m_staged.clear();
+            }
+
+            if(m_coalescer) {
+                m_coalescer->run(m_batch, m_staged, now, m_coalescer->window() == 0);
+                m_batch.swap(m_staged);
+                m_staged.clear();
+            }
+
+            if(m_content) {
+                m_content->run(m_batch, m_staged);
+                m_batch.swap(m_staged);
+                m_staged.clear();
+            }
+
+            bool break_out = false;
+
+            if(m_dispatcher)
+                m_dispatcher->post(m_batch, read_time);
+            else if(!m_batch.empty()) {
+                break_out = emit(m_signal, m_batch_signal,
+                                 &m_batch[0], &m_batch[0] + m_batch.size());
+
+                if(m_stats && read_time)
+                    m_stats->local().record_batch(stats_collector::now() - read_time);
+            }
+
+            // The kernel dropped these watches, so do we. Done after
+            // dispatching since the events still point to them.
+            for(std::vector<event>::const_iterator it = m_batch.begin();
+                it != m_batch.end(); ++it) {
+                if(it->mask() & IN_IGNORED)
+                    m_wd_map.erase(it->wd());
+            }
+
+            release_replaced(now);
+
+            arm_timer();
+
+            return break_out;
+        }
+
+        bool inotify::emit(event_sig_t& signal, batch_sig_t& batch_signal,
+                           const event* begin, const event* end)
+        {
+            if(!batch_signal.empty()) {
+                event_batch batch(begin, end);
+
+                if(batch_signal(*this, batch))
+                    return true;
+            }
+
+            if(!signal.empty()) {
+                for(const event* it = begin; it != end; ++it) {
+                    // Emit signal.
+                    if(signal(*this, *it))
+                        return true;
                 }
             }
+
+            return false;
         }
 
 
         event::event()
-            : m_event(static_cast<inotify_event*>(0))
+            : m_event(static_cast<inotify_event*>(0)),
+              m_watch(0),
+              m_from_event(0),
+              m_from_watch(0)
         {
         }
 
@@ -147,29 +1211,140 @@ namespace dmcc {
         }
 
         std::string event::name() const
+        {
+            boost::string_ref n = name_ref();
+            return std::string(n.data(), n.size());
+        }
+
+        boost::string_ref event::name_ref() const
         {
             DMCC_ASSERT(m_event);
 
             if(m_event->len <= 0)
-                return std::string();
+                return boost::string_ref();
 
-            return m_event->name;
+            // The name is padded with null bytes.
+            return boost::string_ref(m_event->name);
         }
 
         fs::path event::path() const
+        {
+            fs::path p;
+            return path(p);
+        }
+
+        const fs::path& event::path(fs::path& buffer) const
         {
             DMCC_ASSERT(m_event);
-            return m_watch->path() / name();
+
+            if(!m_watch) {
+                // Overflows have no path.
+                buffer.clear();
+                return buffer;
+            }
+
+            // Assigning reuses the storage of the buffer.
+            buffer = m_watch->path();
+
+            if(m_event->len > 0)
+                buffer /= m_event->name;
+
+            return buffer;
         }
 
         boost::shared_ptr<watch> event::parent() const
         {
-            return m_watch;
+            if(!m_watch)
+                return boost::shared_ptr<watch>();
+
+            return m_watch->shared_from_this();
+        }
+
+
+        bool event::is_rename() const
+        {
+            return m_from_event != 0;
+        }
+
+        std::string event::old_name() const
+        {
+            boost::string_ref n = old_name_ref();
+            return std::string(n.data(), n.size());
+        }
+
+        boost::string_ref event::old_name_ref() const
+        {
+            if(!m_from_event || m_from_event->len <= 0)
+                return boost::string_ref();
+
+            return boost::string_ref(m_from_event->name);
+        }
+
+        fs::path event::old_path() const
+        {
+            fs::path p;
+            return old_path(p);
+        }
+
+        const fs::path& event::old_path(fs::path& buffer) const
+        {
+            DMCC_ASSERT(m_from_event);
+
+            buffer = m_from_watch->path();
+
+            if(m_from_event->len > 0)
+                buffer /= m_from_event->name;
+
+            return buffer;
+        }
+
+        boost::shared_ptr<watch> event::old_parent() const
+        {
+            if(!m_from_watch)
+                return boost::shared_ptr<watch>();
+
+            return m_from_watch->shared_from_this();
+        }
+
+
+        event_batch::event_batch(const event* begin, const event* end)
+            : m_begin(begin),
+              m_end(end)
+        {
+        }
+
+        event_batch::const_iterator event_batch::begin() const
+        {
+            return m_begin;
+        }
+
+        event_batch::const_iterator event_batch::end() const
+        {
+            return m_end;
+        }
+
+        size_t event_batch::size() const
+        {
+            return m_end - m_begin;
+        }
+
+        bool event_batch::empty() const
+        {
+            return m_begin == m_end;
+        }
+
+        const event& event_batch::operator[](size_t i) const
+        {
+            return m_begin[i];
         }
 
 
         watch::watch(const boost::filesystem::path& path)
-            : m_path(path)
+            : m_path(path),
+              m_mask(0),
+              m_recursive(false),
+              m_root_length(root_length(path)),
+              m_last_event(0)
         {
         }
 
@@ -177,5 +1352,15 @@ namespace dmcc {
         {
             return m_path;
         }
+
+        uint32_t watch::mask() const
+        {
+            return m_mask;
+        }
+
+        bool watch::recursive() const
+        {
+            return m_recursive;
+        }
     }
 }
@@ -23,9 +23,18 @@
 #include <boost/signal.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/regex.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <sys/inotify.h>
 
+#include "wd_table.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+
 
 // Forward declaration
 class inotify;
@@ -36,7 +45,17 @@ struct inotify_event;
 namespace dmcc {
     namespace inotify {
         class event;
+        class event_batch;
         class watch;
+        class coalescer;
+        class dispatcher;
+        class rename_pairer;
+        class path_filter;
+        class backend;
+        class watch_budget;
+        class event_recorder;
+        class event_replayer;
+        class content_filter;
 
         /**
          * \brief Wraps all this low-level inotify stuff
@@ -44,13 +63,20 @@ namespace dmcc {
          */
         class inotify
         {
+            friend class dispatcher;
+            friend class event_replayer;
+
             // Type to save path together with the associated depth.
             //typedef std::pair<boost::filesystem::path, int> watch_tuple_t;
 
         public:
             // Event wrapper
 
-            typedef boost::signal<bool (inotify&, const event& event)> event_sig_t;
+            typedef boost::signal<bool (inotify&, const event& event), timed_last_value>
+            event_sig_t;
+
+            typedef boost::signal<bool (inotify&, const event_batch& batch), timed_last_value>
+            batch_sig_t;
 
             /**
              * \brief Constructs a new object and initializes the
@@ -58,6 +84,21 @@ namespace dmcc {
              */
             inotify();
 
+            /**
+             * \brief Constructs a new object that reads its events
+             * from the given backend.
+             *
+             * With a backend that covers whole trees, see
+             * backend::whole_tree(), add_recursive_watch() adds a
+             * single watch and the watches of the directories below
+             * are created as their events arrive. Overflow recovery
+             * and resume_recursive_watch() need a watch per directory
+             * and don't apply to such trees.
+             */
+            explicit inotify(boost::shared_ptr<backend> b);
+
+            ~inotify();
+
             /**
              * \brief Adds a new watch for a file.
              * \param path The path to watch
@@ -69,28 +110,412 @@ namespace dmcc {
 
             void add_watch(boost::shared_ptr<watch> w, uint32_t mask);
 
+            /**
+             * \brief Adds watches for a directory and all of its
+             * subdirectories.
+             *
+             * The tree is scanned by several threads. Directories that
+             * are created below the root later on are watched as soon as
+             * their IN_CREATE or IN_MOVED_TO event is read, and their
+             * contents are reported as IN_CREATE events, so nothing
+             * created during the scan is missed. Some entries may
+             * therefore be reported twice.
+             * \param root The root of the tree to watch
+             * \param mask The event-mask to listen for
+             * \param threads The number of scanner threads, 0 selects
+             * the number of available cores.
+             */
+            void add_recursive_watch(const boost::filesystem::path& root,
+                                     uint32_t mask, unsigned threads = 0);
+
+            /**
+             * \brief Merges bursts of events on the same file.
+             *
+             * Events covered by mask that arrive for the same watch and
+             * name are held back for window and delivered as one event
+             * with the masks or-ed together. Any other event for the
+             * same file releases the held one first, so the order per
+             * file is kept.
+             * \param window How long events are held back. A zero
+             * window merges the events of a single read only.
+             * \param mask The events that may be merged. 0 disables
+             * coalescing.
+             */
+            void set_coalescing(const boost::posix_time::time_duration& window,
+                                uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB);
+
+            /**
+             * \brief Joins the halves of renames by their cookie.
+             *
+             * IN_MOVED_FROM events wait up to window for the matching
+             * IN_MOVED_TO event and are delivered together with it as
+             * one event, see event::is_rename(). Halves without a
+             * partner are delivered unchanged.
+             * \param window How long an IN_MOVED_FROM event waits.
+             * \param limit The number of unmatched IN_MOVED_FROM
+             * events kept at most. 0 disables pairing.
+             */
+            void set_rename_pairing(const boost::posix_time::time_duration& window,
+                                    size_t limit = 4096);
+
+            /**
+             * \brief Drops modifications that didn't change the
+             * content of a file.
+             *
+             * Runs after the rename pairing and the coalescing. The
+             * files are compared to the size, mtime and content hash
+             * they had when their last event was delivered, see
+             * content_filter.
+             * \param mask The events that may be dropped. 0 disables
+             * the check.
+             * \param cache_size The number of files remembered.
+             * \param threads The threads hashing a large file, 0
+             * selects the number of available cores.
+             */
+            void set_content_filter(uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE,
+                                    size_t cache_size = 65536, unsigned threads = 0);
+
+            /**
+             * \brief Recovers from overflows of the kernel queue.
+             *
+             * Keeps the metadata of everything below recursive watches
+             * and rescans the watched directories in parallel once the
+             * kernel reports IN_Q_OVERFLOW. The changes that were lost
+             * are then delivered as IN_CREATE, IN_DELETE and IN_MODIFY
+             * events after the overflow event. Has to be enabled before
+             * adding recursive watches.
+             * \param threads The number of threads to rescan with, 0
+             * selects the number of available cores.
+             */
+            void set_overflow_recovery(bool enabled, unsigned threads = 0);
+
+            /**
+             * \brief Dispatches events on a pool of worker threads.
+             *
+             * Events are decoded by the listening thread and handed to
+             * the worker that owns their watch, so the events of a
+             * directory arrive in order while different directories are
+             * handled in parallel. Slots must be thread-safe then. A
+             * slot returning true stops the listener, but the events
+             * already queued are still delivered. The first exception
+             * thrown by a slot stops the listener as well and is
+             * rethrown from listen() or poll_once(). Must not be called
+             * while listening.
+             * \param threads The number of workers. 0 dispatches on the
+             * listening thread.
+             */
+            void set_dispatch_threads(unsigned threads);
+
+            /**
+             * \brief Like add_recursive_watch(), but reports what
+             * changed since a snapshot was saved.
+             *
+             * The tree is compared to the snapshot while it is scanned,
+             * and the differences are delivered as IN_CREATE, IN_DELETE
+             * and IN_MODIFY events once listening starts. Directories
+             * whose mtime is unchanged aren't read again. Without a
+             * usable snapshot file nothing is reported.
+             * \param snapshot_file A file written by save_snapshot().
+             */
+            void resume_recursive_watch(const boost::filesystem::path& root, uint32_t mask,
+                                        const boost::filesystem::path& snapshot_file,
+                                        unsigned threads = 0);
+
+            /**
+             * \brief Saves the snapshot kept for overflow recovery.
+             *
+             * Requires set_overflow_recovery(). The file can be passed
+             * to resume_recursive_watch() after a restart. Must not be
+             * called while listening on another thread.
+             */
+            void save_snapshot(const boost::filesystem::path& file) const;
+
+            /**
+             * \brief Drops the events of entries the filter rejects.
+             *
+             * Events are checked on their raw names before any slot
+             * is involved, and rejected directories below recursive
+             * watches aren't watched at all. Paths are relative to the
+             * directory the watch was added for. Must be called
+             * before adding watches.
+             */
+            void set_filter(const path_filter& filter);
+
+            /**
+             * \brief Appends all decoded events to a log that
+             * event_replayer can feed back.
+             *
+             * Events are recorded before the filter and the other
+             * stages, including those synthesized by the library.
+             * Pass a null pointer to stop recording. Must not be
+             * called while listening.
+             */
+            void set_recorder(const boost::shared_ptr<event_recorder>& recorder);
+
+            /**
+             * \brief Keeps recursive watches below a number of kernel
+             * watches.
+             *
+             * When the limit is reached, the directories that went
+             * longest without an event lose their watch and are polled
+             * every interval instead. Their changes are reported as
+             * IN_CREATE, IN_DELETE and IN_MODIFY events under a
+             * descriptor of their own, and they get a watch again once
+             * they change while there is room. Backends that cover
+             * whole trees with one watch ignore the budget. Must be
+             * called before adding watches.
+             * \param limit 0 selects 90% of the per-user limit in
+             * /proc/sys/fs/inotify/max_user_watches.
+             */
+            void set_watch_budget(const boost::posix_time::time_duration& interval =
+                                  boost::posix_time::seconds(5), size_t limit = 0);
+
+            /**
+             * \brief Gathers statistics about reads and slot calls.
+             *
+             * Every thread records into its own counters, see
+             * get_statistics(). While disabled, listening costs a
+             * pointer test per read and per emission. Must not be
+             * called while listening.
+             */
+            void set_statistics(bool enabled);
+
+            /**
+             * \brief Returns the statistics gathered so far.
+             *
+             * Can be called from any thread. All figures are zero if
+             * statistics are disabled.
+             */
+            statistics get_statistics() const;
+
+            void reset_statistics();
+
             /**
              * \brief Connect a slot to the event-signal.
              *
              * Everytime an event is read, a signal is fired.
              * See Boost.Signal for further information.
              * \param slot The slot to connect.
+             * \return An id for disconnect_slot().
+             */
+            int connect_slot(const event_sig_t::slot_type& slot);
+
+            /**
+             * \brief Connect a slot to the batch-signal.
+             *
+             * The signal is fired once per read with all events the
+             * read returned. Batch slots run before the slots connected
+             * with connect_slot().
+             * \param slot The slot to connect.
+             * \return An id for disconnect_slot().
+             */
+            int connect_batch_slot(const batch_sig_t::slot_type& slot);
+
+            /**
+             * \brief Disconnects a slot connected by connect_slot() or
+             * connect_batch_slot(), including the copies connected to
+             * the dispatch workers. Must not be called while listening.
              */
-            void connect_slot(const event_sig_t::slot_type& slot);
+            void disconnect_slot(int id);
 
             /**
              * \brief Start the listening process.
              *
-             * This functions blocks until the signal-slot returns false.
+             * This functions blocks until a signal-slot returns true or
+             * stop() is called.
              */
             void listen();
 
+            /**
+             * \brief Listens for at most timeout.
+             * \return true if a slot or stop() ended the listening
+             * before the timeout elapsed.
+             */
+            bool listen_for(const boost::posix_time::time_duration& timeout);
+
+            /**
+             * \brief Waits at most timeout for events and dispatches all
+             * events that are queued.
+             *
+             * Meant to be called from an external event loop once fd()
+             * became readable.
+             * \return true if a slot or stop() asked to stop listening.
+             */
+            bool poll_once(const boost::posix_time::time_duration& timeout =
+                           boost::posix_time::time_duration(0, 0, 0));
+
+            /**
+             * \brief Makes a running listen() return.
+             *
+             * Can be called from any thread. If nobody is listening,
+             * the next call to listen() or poll_once() returns at once.
+             */
+            void stop();
+
+            /**
+             * \brief Returns a descriptor that becomes readable when
+             * events are queued, held events are due or stop() was
+             * called.
+             */
+            int fd() const;
+
         private:
+            class recursive_visitor;
+            class resume_visitor;
 
-            event_sig_t m_signal;
-            int m_descr;
+            // Registers a watch for path and stores it in the wd-map.
+            // Safe to be called from the scanner threads. Returns the
+            // watch-descriptor or -1 if the directory vanished.
+            int insert_watch(const boost::filesystem::path& path,
+                             uint32_t mask, bool recursive, size_t root_length);
+
+            // The mask a watch is registered with in the kernel.
+            uint32_t kernel_mask(uint32_t mask, bool recursive) const;
+
+            // Returns the number of kernel watches in use. Called
+            // with m_mutex held.
+            size_t kernel_watches() const;
+
+            // Replaces the coldest watches by polling. Called with
+            // m_mutex held.
+            void evict();
+
+            // Polls the directories without a watch and queues their
+            // changes.
+            void poll_dirs();
+
+            // Returns the path of a watch relative to its root.
+            static boost::string_ref relative_dir(const watch& w);
+
+            // Tells if the filter accepts the directory path, which
+            // lies below a root whose length is root_length.
+            bool accepts_dir(const std::string& path, size_t root_length,
+                             std::string& buffer) const;
+
+            // Returns the directories of the recursive watches.
+            void recursive_dirs(std::vector<snapshot::dir>& out) const;
+
+            // Rescans the watched tree after an overflow and queues
+            // the events that were lost.
+            void recover();
+
+            // Watches a directory that appeared below a recursive watch.
+            void watch_new_dir(const boost::filesystem::path& path, uint32_t mask, bool moved,
+                               size_t root_length);
+
+            // Decodes and dispatches the events in buf. Returns true if
+            // a slot asked to stop listening. read_time is 0 unless
+            // buf was read from the kernel.
+            bool process(unsigned char* buf, ssize_t len, uint64_t read_time = 0);
+
+            // Returns the time until a stage has to release held
+            // events in milliseconds, or -1 if nothing is held.
+            int next_deadline() const;
+
+            // Returns when the next stage has to release held events,
+            // or 0.
+            uint64_t deadline() const;
+
+            // Makes the timer expire at deadline().
+            void arm_timer();
+
+            // Stores a watch in the wd-map, keeping a replaced one
+            // alive, see m_replaced.
+            void store_watch(int wd, const boost::shared_ptr<watch>& w);
+
+            // Drops the replaced watches nothing can refer to anymore.
+            void release_replaced(uint64_t now);
 
-            std::map<int,boost::shared_ptr<watch> > m_wd_map;
+            // Processes the synthesized events until none are left.
+            bool process_synthesized();
+
+            // Emits a sequence of events through the given signals.
+            // Returns true if a slot asked to stop listening.
+            bool emit(event_sig_t& signal, batch_sig_t& batch_signal,
+                      const event* begin, const event* end);
+
+            // Dispatches events that weren't read from the backend,
+            // without watching the directories they announce.
+            bool inject(unsigned char* buf, ssize_t len);
+
+            // Queues an event that is processed after the current buffer.
+            void synthesize(int wd, uint32_t mask, const std::string& name);
+
+            // Sets up the event loop around the backend.
+            void init();
+
+            // Creates the watch for a directory the backend reported
+            // without being asked to, or returns 0.
+            watch* resolve_watch(int wd);
+
+            void close_descriptors();
+
+            event_sig_t m_signal;
+            batch_sig_t m_batch_signal;
+
+            // The connected slots, to connect them to the workers'
+            // signals as well.
+            // The slots are connected in groups numbered by their id,
+            // so they are called in the order they were connected.
+            std::vector<std::pair<int, event_sig_t::slot_type> > m_slots;
+            std::vector<std::pair<int, batch_sig_t::slot_type> > m_batch_slots;
+            int m_next_slot;
+            boost::shared_ptr<backend> m_backend;
+
+            // The epoll instance waiting on the backend, m_wakeup and
+            // m_timer.
+            int m_epoll;
+
+            // Eventfd signalled by stop().
+            int m_wakeup;
+
+            // Timerfd that expires when held events are due, and the
+            // deadline it is armed for.
+            int m_timer;
+            uint64_t m_timer_deadline;
+
+            wd_table m_wd_map;
+
+            // Watches replaced in the wd-map, e.g. when a renamed
+            // directory is watched again and the kernel returns the
+            // same wd, with the time they were replaced. Decoded and
+            // held events may still point to them, so they are kept
+            // until the stages released everything held back then.
+            std::vector<std::pair<uint64_t, boost::shared_ptr<watch> > > m_replaced;
+
+            // Guards the wd-map and the synthesized events while
+            // scanning.
+            boost::mutex m_mutex;
+
+            // Raw events produced by the library itself.
+            std::vector<unsigned char> m_synthesized;
+
+            // Events decoded from the current buffer. Kept to reuse
+            // the storage.
+            std::vector<event> m_batch;
+            std::vector<event> m_staged;
+
+            boost::scoped_ptr<snapshot> m_snapshot;
+            unsigned m_recovery_threads;
+
+            boost::scoped_ptr<rename_pairer> m_pairer;
+            boost::scoped_ptr<coalescer> m_coalescer;
+            boost::scoped_ptr<content_filter> m_content;
+            boost::scoped_ptr<dispatcher> m_dispatcher;
+
+            boost::scoped_ptr<path_filter> m_filter;
+            boost::scoped_ptr<watch_budget> m_budget;
+            boost::shared_ptr<event_recorder> m_recorder;
+
+            // Holds the relative paths the filter is asked about.
+            std::string m_filter_path;
+
+            // The signal combiners of this object and of the workers
+            // refer to this member.
+            boost::scoped_ptr<stats_collector> m_stats;
+
+            // Events read since the descriptor became readable.
+            size_t m_wakeup_events;
         };
 
 
@@ -100,6 +525,9 @@ namespace dmcc {
         class event
         {
             friend class inotify;
+            friend class coalescer;
+            friend class dispatcher;
+            friend class rename_pairer;
             explicit event();
 
         public:
@@ -117,14 +545,94 @@ namespace dmcc {
 
             std::string name() const;
 
+            /**
+               \brief Returns the name without copying it.
+
+               The view points into the read buffer and is only valid
+               during the slot call.
+            */
+            boost::string_ref name_ref() const;
+
             boost::filesystem::path path() const;
 
+            /**
+               \brief Composes the path in buffer.
+
+               The storage of buffer is reused, so a buffer kept across
+               events avoids allocating for every event.
+               \return buffer
+            */
+            const boost::filesystem::path& path(boost::filesystem::path& buffer) const;
+
             boost::shared_ptr<watch> parent() const;
 
+            /**
+               \brief Returns true if the event joins an IN_MOVED_FROM
+               and an IN_MOVED_TO event.
+
+               Both bits are set in mask() then, and name() and path()
+               refer to the new location.
+            */
+            bool is_rename() const;
+
+            /**
+               \brief Returns the name before a rename.
+            */
+            std::string old_name() const;
+
+            boost::string_ref old_name_ref() const;
+
+            /**
+               \brief Returns the path before a rename.
+            */
+            boost::filesystem::path old_path() const;
+
+            const boost::filesystem::path& old_path(boost::filesystem::path& buffer) const;
+
+            /**
+               \brief Returns the watch of the directory the file was
+               renamed from.
+            */
+            boost::shared_ptr<watch> old_parent() const;
+
         private:
             inotify_event* m_event;
             //boost::filesystem::path m_path;
-            boost::shared_ptr<watch> m_watch;
+
+            // Owned by the wd-table of the inotify object.
+            watch* m_watch;
+
+            // The IN_MOVED_FROM half of a rename.
+            inotify_event* m_from_event;
+            watch* m_from_watch;
+        };
+
+
+        /**
+           \brief A contiguous sequence of events read at once.
+
+           The events point into the read buffer and are only valid
+           during the slot call.
+        */
+        class event_batch
+        {
+            friend class inotify;
+            event_batch(const event* begin, const event* end);
+
+        public:
+            typedef const event* const_iterator;
+
+            const_iterator begin() const;
+            const_iterator end() const;
+
+            size_t size() const;
+            bool empty() const;
+
+            const event& operator[](size_t i) const;
+
+        private:
+            const event* m_begin;
+            const event* m_end;
         };
 
 
@@ -132,15 +640,40 @@ namespace dmcc {
            \brief Used to transfer additional information with
            an event object.
         */
-        class watch
+        class watch : public boost::enable_shared_from_this<watch>
         {
+            friend class inotify;
+            friend class event_recorder;
+            friend class event_replayer;
+
         public:
             watch(const boost::filesystem::path& path);
 
             const boost::filesystem::path& path();
 
+            /**
+               \brief Returns the event-mask the watch was added with.
+            */
+            uint32_t mask() const;
+
+            /**
+               \brief Returns true if new subdirectories are watched
+               automatically.
+            */
+            bool recursive() const;
+
         private:
             boost::filesystem::path m_path;
+            uint32_t m_mask;
+            bool m_recursive;
+
+            // Length of the watched root including the separator, the
+            // rest of m_path is relative to it.
+            size_t m_root_length;
+
+            // When the last event arrived, kept if a watch budget is
+            // set.
+            uint64_t m_last_event;
         };
     }
 }
@@ -0,0 +1,624 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "mirror.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tree_scanner.hpp"
+#include "snapshot.hpp"
+
+namespace fs = boost::filesystem;
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            // Unit in which existing files are compared.
+            const size_t COMPARE_BLOCK = 256 * 1024;
+
+            bool below(const std::string& path, const std::string& prefix)
+            {
+                return path.compare(0, prefix.size(), prefix) == 0 &&
+                    (path.size() == prefix.size() || path[prefix.size()] == '/');
+            }
+
+            // Returns the entries of set that are prefix itself or
+            // lie below it.
+            void collect_below(const std::set<std::string>& set, const std::string& prefix,
+                               std::vector<std::string>& out)
+            {
+                if(set.count(prefix))
+                    out.push_back(prefix);
+
+                std::set<std::string>::const_iterator it = set.lower_bound(prefix + '/');
+                for(; it != set.end() && below(*it, prefix); ++it)
+                    out.push_back(*it);
+            }
+
+            ssize_t read_at(int fd, char* buf, size_t len, off_t offset)
+            {
+                size_t done = 0;
+
+                while(done < len) {
+                    ssize_t n = ::pread(fd, buf + done, len - done, offset + done);
+
+                    if(n < 0 && errno == EINTR)
+                        continue;
+                    if(n < 0)
+                        return -1;
+                    if(n == 0)
+                        break;
+
+                    done += n;
+                }
+
+                return done;
+            }
+
+            bool write_at(int fd, const char* buf, size_t len, off_t offset)
+            {
+                size_t done = 0;
+
+                while(done < len) {
+                    ssize_t n = ::pwrite(fd, buf + done, len - done, offset + done);
+
+                    if(n < 0 && errno == EINTR)
+                        continue;
+                    if(n < 0)
+                        return false;
+
+                    done += n;
+                }
+
+                return true;
+            }
+        }
+
+
+        class mirror::sync_visitor : public tree_scanner::visitor
+        {
+        public:
+            explicit sync_visitor(mirror& m)
+                : m_mirror(m)
+            {
+            }
+
+            int enter(const fs::path& dir)
+            {
+                std::string rel;
+
+                if(m_mirror.relative(dir, rel) && !rel.empty())
+                    m_mirror.make_dir(rel);
+
+                return 0;
+            }
+
+            bool entries(const fs::path& dir, int,
+                         const tree_scanner::entry_list_t& entries)
+            {
+                std::string rel;
+
+                if(!m_mirror.relative(dir, rel))
+                    return false;
+
+                tree_scanner::entry_list_t::const_iterator it = entries.begin();
+                for(; it != entries.end(); ++it) {
+                    if(it->is_dir)
+                        continue;
+
+                    std::string name = rel.empty() ? it->name : rel + '/' + it->name;
+                    snapshot::info source, target;
+
+                    if(!snapshot::stat_entry(AT_FDCWD, (dir / it->name).c_str(), source))
+                        continue;
+
+                    if(!snapshot::stat_entry(AT_FDCWD, (m_mirror.m_target_root / name).c_str(),
+                                             target) ||
+                       source.size != target.size || source.mtime != target.mtime)
+                        m_mirror.mark(name);
+                }
+
+                return true;
+            }
+
+        private:
+            mirror& m_mirror;
+        };
+
+
+        mirror::mirror(inotify& source, const fs::path& source_root,
+                       const fs::path& target_root, unsigned copies)
+            : m_inotify(source),
+              m_slot(-1),
+              m_source(source_root.string()),
+              m_source_root(source_root),
+              m_target_root(target_root),
+              m_shutdown(false),
+              m_reflink(true),
+              m_copy_range(true)
+        {
+            // Compare without trailing slashes, the root "/" becomes
+            // the empty string.
+            while(!m_source.empty() && m_source[m_source.size() - 1] == '/')
+                m_source.erase(m_source.size() - 1);
+
+            if(copies == 0)
+                copies = boost::thread::hardware_concurrency();
+
+            if(copies == 0)
+                copies = 1;
+
+            for(unsigned i = 0; i < copies; ++i)
+                m_threads.create_thread(boost::bind(&mirror::work, this));
+
+            m_slot = source.connect_batch_slot(boost::bind(&mirror::handle, this, _1, _2));
+        }
+
+        mirror::~mirror()
+        {
+            m_inotify.disconnect_slot(m_slot);
+
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_shutdown = true;
+                m_cond.notify_all();
+            }
+
+            m_threads.join_all();
+        }
+
+        void mirror::sync(unsigned threads)
+        {
+            sync_visitor v(*this);
+            tree_scanner(threads).run(m_source_root, v);
+        }
+
+        void mirror::wait_idle()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            while(!m_pending.empty() || !m_active.empty())
+                m_cond.wait(lock);
+        }
+
+        void mirror::connect_error_slot(const error_sig_t::slot_type& slot)
+        {
+            boost::mutex::scoped_lock lock(m_error_mutex);
+            m_error_signal.connect(slot);
+        }
+
+        bool mirror::handle(inotify&, const event_batch& batch)
+        {
+            fs::path path;
+            std::string rel, from;
+
+            for(event_batch::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+                uint32_t mask = it->mask();
+
+                // Overflows and events of the watched directories
+                // themselves.
+                if(it->name_ref().empty() || (mask & IN_IGNORED) ||
+                   !relative(it->path(path), rel))
+                    continue;
+
+                bool is_dir = mask & IN_ISDIR;
+
+                if(it->is_rename()) {
+                    if(relative(it->old_path(path), from))
+                        rename(from, rel, is_dir);
+                    else
+                        mark(rel);
+                }
+                else if(mask & (IN_DELETE | IN_MOVED_FROM))
+                    remove(rel);
+                else if(is_dir && (mask & (IN_CREATE | IN_MOVED_TO)))
+                    // The contents are reported by the recursive watch.
+                    make_dir(rel);
+                else if(mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY |
+                                IN_CLOSE_WRITE | IN_ATTRIB))
+                    mark(rel);
+            }
+
+            return false;
+        }
+
+        bool mirror::relative(const fs::path& p, std::string& out) const
+        {
+            const std::string& s = p.string();
+
+            if(s.compare(0, m_source.size(), m_source) != 0)
+                return false;
+
+            if(s.size() == m_source.size()) {
+                out.clear();
+                return true;
+            }
+
+            if(s[m_source.size()] != '/')
+                return false;
+
+            out.assign(s, m_source.size() + 1, std::string::npos);
+            return true;
+        }
+
+        void mirror::mark(const std::string& rel)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            if(m_pending.insert(rel).second)
+                m_cond.notify_all();
+        }
+
+        void mirror::make_dir(const std::string& rel)
+        {
+            struct stat st;
+
+            if(::lstat((m_source_root / rel).c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+                return;
+
+            fs::path target = m_target_root / rel;
+
+            if(::mkdir(target.c_str(), st.st_mode & 07777) == 0 || errno == EEXIST)
+                return;
+
+            boost::system::error_code ec;
+            fs::create_directories(target, ec);
+
+            if(ec)
+                fail(rel, ec.value());
+        }
+
+        void mirror::rename(const std::string& from, const std::string& to, bool is_dir)
+        {
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                wait_inactive(from, lock);
+                wait_inactive(to, lock);
+
+                // Queued copies move along with the files.
+                std::vector<std::string> moved;
+                collect_below(m_pending, from, moved);
+
+                for(size_t i = 0; i < moved.size(); ++i) {
+                    m_pending.erase(moved[i]);
+                    m_pending.insert(to + moved[i].substr(from.size()));
+                }
+
+                if(::rename((m_target_root / from).c_str(), (m_target_root / to).c_str()) == 0)
+                    return;
+
+                if(errno != ENOENT) {
+                    fail(to, errno);
+                    return;
+                }
+            }
+
+            // The source was never replicated, copy it instead.
+            if(is_dir) {
+                sync_visitor v(*this);
+                tree_scanner(1).run(m_source_root / to, v);
+            }
+            else
+                mark(to);
+        }
+
+        void mirror::remove(const std::string& rel)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            wait_inactive(rel, lock);
+
+            std::vector<std::string> dropped;
+            collect_below(m_pending, rel, dropped);
+
+            for(size_t i = 0; i < dropped.size(); ++i)
+                m_pending.erase(dropped[i]);
+
+            boost::system::error_code ec;
+            fs::remove_all(m_target_root / rel, ec);
+
+            if(ec)
+                fail(rel, ec.value());
+        }
+
+        void mirror::wait_inactive(const std::string& rel, boost::mutex::scoped_lock& lock)
+        {
+            for(;;) {
+                std::set<std::string>::const_iterator it = m_active.lower_bound(rel);
+
+                if(it == m_active.end() || !below(*it, rel)) {
+                    // Entries like "a-b" sort between "a" and "a/b".
+                    it = m_active.lower_bound(rel + '/');
+
+                    if(it == m_active.end() || !below(*it, rel))
+                        return;
+                }
+
+                m_cond.wait(lock);
+            }
+        }
+
+        void mirror::copy(const std::string& rel, std::vector<char>& buffer)
+        {
+            fs::path source = m_source_root / rel;
+            fs::path target = m_target_root / rel;
+            struct stat st;
+
+            if(::lstat(source.c_str(), &st) < 0) {
+                // Removed meanwhile, the event for that follows.
+                if(errno != ENOENT)
+                    fail(rel, errno);
+                return;
+            }
+
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+            if(S_ISDIR(st.st_mode)) {
+                if((::mkdir(target.c_str(), st.st_mode & 07777) < 0 && errno != EEXIST) ||
+                   ::chmod(target.c_str(), st.st_mode & 07777) < 0)
+                    fail(rel, errno);
+                return;
+            }
+
+            if(S_ISLNK(st.st_mode)) {
+                buffer.resize(st.st_size + 1);
+                ssize_t len = ::readlink(source.c_str(), &buffer[0], buffer.size());
+
+                if(len < 0 || len == static_cast<ssize_t>(buffer.size())) {
+                    // Removed or replaced meanwhile.
+                    if(len < 0 && errno != ENOENT)
+                        fail(rel, errno);
+                    return;
+                }
+
+                buffer[len] = '\0';
+
+                if((::unlink(target.c_str()) < 0 && errno != ENOENT) ||
+                   ::symlink(&buffer[0], target.c_str()) < 0 ||
+                   ::utimensat(AT_FDCWD, target.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0)
+                    fail(rel, errno);
+                return;
+            }
+
+            if(!S_ISREG(st.st_mode))
+                return;
+
+            int in = ::open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+            if(in < 0) {
+                if(errno != ENOENT)
+                    fail(rel, errno);
+                return;
+            }
+
+            int out = -1;
+
+            for(int attempt = 0; out < 0 && attempt < 2; ++attempt) {
+                out = ::open(target.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+                if(out >= 0 || attempt > 0)
+                    break;
+
+                boost::system::error_code ec;
+
+                if(errno == ENOENT)
+                    // The directory wasn't created yet.
+                    fs::create_directories(target.parent_path(), ec);
+                else if(errno == ELOOP || errno == EISDIR)
+                    // The target has a different type.
+                    fs::remove_all(target, ec);
+                else
+                    break;
+            }
+
+            struct stat target_st;
+            bool ok = out >= 0 && ::fstat(in, &st) == 0 && ::fstat(out, &target_st) == 0;
+
+            // Cut the target first, the stale tail isn't compared then.
+            if(ok && target_st.st_size > st.st_size) {
+                ok = ::ftruncate(out, st.st_size) == 0;
+                target_st.st_size = st.st_size;
+            }
+
+            if(ok) {
+                bool reflink;
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    reflink = m_reflink;
+                }
+
+#ifdef FICLONE
+                if(reflink && ::ioctl(out, FICLONE, in) == 0)
+                    reflink = true;
+                else {
+                    if(reflink && (errno == EOPNOTSUPP || errno == ENOTTY)) {
+                        boost::mutex::scoped_lock lock(m_mutex);
+                        m_reflink = false;
+                    }
+
+                    reflink = false;
+                }
+#else
+                reflink = false;
+#endif
+
+                if(!reflink)
+                    ok = update(in, out, st.st_size, target_st.st_size, buffer);
+            }
+
+            times[0] = st.st_atim;
+            times[1] = st.st_mtim;
+
+            if(!ok || ::fchmod(out, st.st_mode & 07777) < 0 || ::futimens(out, times) < 0)
+                fail(rel, errno);
+
+            if(out >= 0)
+                ::close(out);
+
+            ::close(in);
+        }
+
+        bool mirror::update(int in, int out, off_t in_size, off_t out_size,
+                            std::vector<char>& buffer)
+        {
+            off_t common = std::min(in_size, out_size);
+
+            if(common > 0)
+                buffer.resize(2 * COMPARE_BLOCK);
+
+            // Rewrite only the blocks that differ, reading is cheaper
+            // than writing and keeps shared extents intact.
+            for(off_t offset = 0; offset < common; offset += COMPARE_BLOCK) {
+                size_t len = std::min<off_t>(COMPARE_BLOCK, common - offset);
+
+                ssize_t a = read_at(in, &buffer[0], len, offset);
+                ssize_t b = read_at(out, &buffer[COMPARE_BLOCK], len, offset);
+
+                if(a < 0 || b < 0)
+                    return false;
+
+                if((a != b || std::memcmp(&buffer[0], &buffer[COMPARE_BLOCK], a) != 0) &&
+                   !write_at(out, &buffer[0], a, offset))
+                    return false;
+
+                if(static_cast<size_t>(a) < len)
+                    // The source shrank, its next event brings the
+                    // target up to date.
+                    return true;
+            }
+
+            return copy_range(in, out, common, in_size, buffer);
+        }
+
+        bool mirror::copy_range(int in, int out, off_t offset, off_t end,
+                                std::vector<char>& buffer)
+        {
+#ifdef __NR_copy_file_range
+            bool kernel;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                kernel = m_copy_range;
+            }
+
+            loff_t in_offset = offset;
+            loff_t out_offset = offset;
+
+            while(kernel && in_offset < end) {
+                ssize_t n = ::syscall(__NR_copy_file_range, in, &in_offset, out, &out_offset,
+                                      static_cast<size_t>(end - in_offset), 0u);
+
+                if(n > 0)
+                    continue;
+                if(n == 0)
+                    return true;
+                if(errno == EINTR)
+                    continue;
+
+                if(errno == ENOSYS) {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    m_copy_range = false;
+                }
+                else if(errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL)
+                    return false;
+
+                // Not supported between these files, copy the rest
+                // through userspace.
+                kernel = false;
+            }
+
+            offset = in_offset;
+#endif
+
+            buffer.resize(2 * COMPARE_BLOCK);
+
+            while(offset < end) {
+                ssize_t n = read_at(in, &buffer[0], std::min<off_t>(buffer.size(), end - offset),
+                                    offset);
+
+                if(n < 0)
+                    return false;
+                if(n == 0)
+                    break;
+                if(!write_at(out, &buffer[0], n, offset))
+                    return false;
+
+                offset += n;
+            }
+
+            return true;
+        }
+
+        void mirror::fail(const std::string& rel, int error)
+        {
+            boost::mutex::scoped_lock lock(m_error_mutex);
+            m_error_signal(m_target_root / rel, error);
+        }
+
+        void mirror::work()
+        {
+            std::vector<char> buffer;
+
+            for(;;) {
+                std::string rel;
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    for(;;) {
+                        // A file changed while it is copied is copied
+                        // again once the running copy finished.
+                        std::set<std::string>::iterator it = m_pending.begin();
+                        while(it != m_pending.end() && m_active.count(*it))
+                            ++it;
+
+                        if(it != m_pending.end()) {
+                            rel = *it;
+                            m_pending.erase(it);
+                            m_active.insert(rel);
+                            break;
+                        }
+
+                        if(m_shutdown && m_pending.empty())
+                            return;
+
+                        m_cond.wait(lock);
+                    }
+                }
+
+                copy(rel, buffer);
+
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_active.erase(rel);
+                m_cond.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,172 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_MIRROR_HPP
+#define DMCC_INOTIFY_MIRROR_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/signal.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <sys/inotify.h>
+
+#include "inotify.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Replicates the changes below a watched directory to
+           another location.
+
+           Directories are created, renamed and removed right away
+           while the events are handled. File contents are copied by
+           a pool of threads in the kernel, with FICLONE if both trees
+           share a filesystem that supports it and copy_file_range()
+           otherwise. Files that exist in the target already are
+           compared block by block and only the blocks that differ are
+           written.
+
+           A file changed again while it waits to be copied is copied
+           only once. A file is never copied by two threads at once.
+        */
+        class mirror
+        {
+        public:
+            typedef boost::signal<void (const boost::filesystem::path& path, int error)>
+            error_sig_t;
+
+            /**
+               \brief The events the source has to be watched for.
+            */
+            static const uint32_t EVENTS = IN_CREATE | IN_DELETE | IN_MOVE |
+                IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB;
+
+            /**
+               \brief Connects to the batch-signal of source.
+
+               source should watch source_root recursively for EVENTS,
+               and has to be listened on while the mirror exists. It
+               has to outlive the mirror, which disconnects from it
+               when it is destroyed, so it must not be listening then. Rename
+               pairing should be enabled, otherwise renamed files are
+               copied again.
+               \param copies The number of files copied at once, 0
+               selects the number of available cores.
+            */
+            mirror(inotify& source, const boost::filesystem::path& source_root,
+                   const boost::filesystem::path& target_root, unsigned copies = 4);
+
+            /**
+               \brief Finishes the pending copies.
+            */
+            ~mirror();
+
+            /**
+               \brief Copies everything that differs in size or mtime
+               from the target.
+
+               Used to bring the target up to date before listening.
+               Entries missing from the source aren't removed.
+               \param threads The number of threads to scan with.
+            */
+            void sync(unsigned threads = 0);
+
+            /**
+               \brief Blocks until no copies are pending.
+            */
+            void wait_idle();
+
+            /**
+               \brief Connects a slot that is called with the target
+               path and the errno-value when replicating fails.
+
+               Called from the copying threads as well.
+            */
+            void connect_error_slot(const error_sig_t::slot_type& slot);
+
+        private:
+            class sync_visitor;
+
+            bool handle(inotify& in, const event_batch& batch);
+
+            // Returns the path of p relative to the source root, or
+            // false if it isn't below the root.
+            bool relative(const boost::filesystem::path& p, std::string& out) const;
+
+            // Queues a file to be copied.
+            void mark(const std::string& rel);
+
+            void make_dir(const std::string& rel);
+            void rename(const std::string& from, const std::string& to, bool is_dir);
+            void remove(const std::string& rel);
+
+            // Waits until no copy below rel is running. The lock has
+            // to be held.
+            void wait_inactive(const std::string& rel, boost::mutex::scoped_lock& lock);
+
+            void copy(const std::string& rel, std::vector<char>& buffer);
+
+            // Updates the changed blocks of out, returns false on error.
+            bool update(int in, int out, off_t in_size, off_t out_size,
+                        std::vector<char>& buffer);
+
+            // Copies [offset, end) of in to out.
+            bool copy_range(int in, int out, off_t offset, off_t end,
+                            std::vector<char>& buffer);
+
+            void fail(const std::string& rel, int error);
+
+            void work();
+
+            inotify& m_inotify;
+            int m_slot;
+
+            std::string m_source;
+            boost::filesystem::path m_source_root;
+            boost::filesystem::path m_target_root;
+
+            // Boost.Signals can't be emitted from several threads at once.
+            boost::mutex m_error_mutex;
+            error_sig_t m_error_signal;
+
+            boost::mutex m_mutex;
+            boost::condition_variable m_cond;
+
+            // Files waiting to be copied and files being copied.
+            std::set<std::string> m_pending;
+            std::set<std::string> m_active;
+            bool m_shutdown;
+
+            // Cleared once the filesystems turned out not to support
+            // the operation.
+            bool m_reflink;
+            bool m_copy_range;
+
+            boost::thread_group m_threads;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_MIRROR_HPP
@@ -0,0 +1,256 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "path_filter.hpp"
+
+#include <algorithm>
+
+#include <fnmatch.h>
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            bool has_wildcard(const std::string& s)
+            {
+                return s.find_first_of("*?[\\") != std::string::npos;
+            }
+
+            // Tells if path is prefix or lies below it.
+            bool below(boost::string_ref path, boost::string_ref prefix)
+            {
+                return path.starts_with(prefix) &&
+                    (path.size() == prefix.size() || path[prefix.size()] == '/');
+            }
+
+            std::string strip_slashes(std::string s)
+            {
+                while(!s.empty() && s[0] == '/')
+                    s.erase(0, 1);
+
+                while(!s.empty() && s[s.size() - 1] == '/')
+                    s.erase(s.size() - 1);
+
+                return s;
+            }
+
+            std::string dotted(const std::string& extension)
+            {
+                return extension.empty() || extension[0] == '.' ? extension : '.' + extension;
+            }
+
+            struct less_ref
+            {
+                bool operator()(const std::string& a, boost::string_ref b) const
+                {
+                    return boost::string_ref(a).compare(b) < 0;
+                }
+            };
+        }
+
+
+        void path_filter::rule_set::add_glob(const std::string& pattern)
+        {
+            std::string glob = strip_slashes(pattern);
+
+            if(glob.find('/') != std::string::npos) {
+                if(has_wildcard(glob))
+                    path_globs.push_back(glob);
+                else
+                    path_prefixes.push_back(glob);
+                return;
+            }
+
+            if(!has_wildcard(glob)) {
+                names.insert(std::lower_bound(names.begin(), names.end(), glob), glob);
+                return;
+            }
+
+            std::string rest = glob.substr(1);
+
+            if(glob[0] == '*' && !has_wildcard(rest))
+                suffixes.push_back(rest);
+            else if(glob[glob.size() - 1] == '*' &&
+                    !has_wildcard(glob.substr(0, glob.size() - 1)))
+                name_prefixes.push_back(glob.substr(0, glob.size() - 1));
+            else
+                name_globs.push_back(glob);
+        }
+
+        bool path_filter::rule_set::empty() const
+        {
+            return names.empty() && suffixes.empty() && name_prefixes.empty() &&
+                name_globs.empty() && !has_path_rules();
+        }
+
+        bool path_filter::rule_set::has_path_rules() const
+        {
+            return !path_prefixes.empty() || !path_globs.empty() || !regexes.empty();
+        }
+
+        bool path_filter::rule_set::match_name(boost::string_ref name, const char* cname) const
+        {
+            if(!names.empty()) {
+                std::vector<std::string>::const_iterator it =
+                    std::lower_bound(names.begin(), names.end(), name, less_ref());
+
+                if(it != names.end() && boost::string_ref(*it) == name)
+                    return true;
+            }
+
+            for(size_t i = 0; i < suffixes.size(); ++i) {
+                if(name.ends_with(suffixes[i]))
+                    return true;
+            }
+
+            for(size_t i = 0; i < name_prefixes.size(); ++i) {
+                if(name.starts_with(name_prefixes[i]))
+                    return true;
+            }
+
+            for(size_t i = 0; i < name_globs.size(); ++i) {
+                if(fnmatch(name_globs[i].c_str(), cname, 0) == 0)
+                    return true;
+            }
+
+            return false;
+        }
+
+        bool path_filter::rule_set::match_path(const std::string& path) const
+        {
+            for(size_t i = 0; i < path_prefixes.size(); ++i) {
+                if(below(path, path_prefixes[i]))
+                    return true;
+            }
+
+            for(size_t i = 0; i < path_globs.size(); ++i) {
+                if(fnmatch(path_globs[i].c_str(), path.c_str(), FNM_PATHNAME) == 0)
+                    return true;
+            }
+
+            for(size_t i = 0; i < regexes.size(); ++i) {
+                if(boost::regex_match(path, regexes[i]))
+                    return true;
+            }
+
+            return false;
+        }
+
+
+        path_filter::path_filter()
+        {
+        }
+
+        path_filter& path_filter::include(const std::string& glob)
+        {
+            m_include.add_glob(glob);
+            return *this;
+        }
+
+        path_filter& path_filter::exclude(const std::string& glob)
+        {
+            m_exclude.add_glob(glob);
+            return *this;
+        }
+
+        path_filter& path_filter::include_extension(const std::string& extension)
+        {
+            m_include.suffixes.push_back(dotted(extension));
+            return *this;
+        }
+
+        path_filter& path_filter::exclude_extension(const std::string& extension)
+        {
+            m_exclude.suffixes.push_back(dotted(extension));
+            return *this;
+        }
+
+        path_filter& path_filter::include_prefix(const std::string& dir)
+        {
+            m_include.path_prefixes.push_back(strip_slashes(dir));
+            return *this;
+        }
+
+        path_filter& path_filter::exclude_prefix(const std::string& dir)
+        {
+            m_exclude.path_prefixes.push_back(strip_slashes(dir));
+            return *this;
+        }
+
+        path_filter& path_filter::include_regex(const boost::regex& re)
+        {
+            m_include.regexes.push_back(re);
+            return *this;
+        }
+
+        path_filter& path_filter::exclude_regex(const boost::regex& re)
+        {
+            m_exclude.regexes.push_back(re);
+            return *this;
+        }
+
+        bool path_filter::empty() const
+        {
+            return m_include.empty() && m_exclude.empty();
+        }
+
+        const std::string& path_filter::compose(boost::string_ref dir, boost::string_ref name,
+                                                std::string& buffer)
+        {
+            buffer.assign(dir.data(), dir.size());
+
+            if(!buffer.empty())
+                buffer += '/';
+
+            buffer.append(name.data(), name.size());
+            return buffer;
+        }
+
+        bool path_filter::accepts(boost::string_ref dir, const char* cname, bool is_dir,
+                                  std::string& buffer) const
+        {
+            boost::string_ref name(cname);
+
+            if(m_exclude.match_name(name, cname) ||
+               (m_exclude.has_path_rules() && m_exclude.match_path(compose(dir, name, buffer))))
+                return false;
+
+            if(is_dir) {
+                if(m_include.path_prefixes.empty())
+                    return true;
+
+                // Directories leading to an included one are needed
+                // as well.
+                const std::string& path = compose(dir, name, buffer);
+
+                for(size_t i = 0; i < m_include.path_prefixes.size(); ++i) {
+                    if(below(path, m_include.path_prefixes[i]) ||
+                       below(m_include.path_prefixes[i], path))
+                        return true;
+                }
+
+                return false;
+            }
+
+            if(m_include.empty())
+                return true;
+
+            return m_include.match_name(name, cname) ||
+                (m_include.has_path_rules() && m_include.match_path(compose(dir, name, buffer)));
+        }
+    }
+}
@@ -0,0 +1,132 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_PATH_FILTER_HPP
+#define DMCC_INOTIFY_PATH_FILTER_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/regex.hpp>
+#include <boost/utility/string_ref.hpp>
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Include and exclude rules for the entries below a
+           watched directory.
+
+           Patterns are sorted into cheap tests when they are added:
+           literal names are looked up in a sorted table, "*.ext" and
+           "name*" become suffix and prefix tests, and only the rest is
+           left to fnmatch(3) or boost::regex. Rules that only look at
+           the name of an entry are checked first, so the relative
+           path is composed only when a rule needs it.
+
+           An entry is accepted if no exclude rule matches it and,
+           for files, if there are no include rules or one of them
+           matches. Excluded directories aren't watched at all.
+           Directories pass the include rules, except that include
+           prefixes restrict them to the prefixes and their parents.
+        */
+        class path_filter
+        {
+        public:
+            path_filter();
+
+            /**
+               \brief Adds a glob pattern as understood by fnmatch(3).
+
+               Patterns without a slash match the name of an entry
+               anywhere in the tree, e.g. ".git" or "*.o". Patterns
+               with a slash match the path relative to the watched
+               directory, e.g. "build/out" or "test/data?".
+            */
+            path_filter& include(const std::string& glob);
+            path_filter& exclude(const std::string& glob);
+
+            /**
+               \brief Adds a file extension, with or without its dot.
+            */
+            path_filter& include_extension(const std::string& extension);
+            path_filter& exclude_extension(const std::string& extension);
+
+            /**
+               \brief Adds a directory, relative to the watched one,
+               that matches itself and everything below it.
+            */
+            path_filter& include_prefix(const std::string& dir);
+            path_filter& exclude_prefix(const std::string& dir);
+
+            /**
+               \brief Adds a regular expression that has to match the
+               whole relative path.
+            */
+            path_filter& include_regex(const boost::regex& re);
+            path_filter& exclude_regex(const boost::regex& re);
+
+            /**
+               \brief Returns true if there are no rules.
+            */
+            bool empty() const;
+
+            /**
+               \brief Decides on an entry.
+               \param dir The directory of the entry relative to the
+               watched one, empty for the watched one itself.
+               \param name The name of the entry.
+               \param buffer Storage for the relative path, reused
+               across calls.
+            */
+            bool accepts(boost::string_ref dir, const char* name, bool is_dir,
+                         std::string& buffer) const;
+
+        private:
+            struct rule_set
+            {
+                // Names in sorted order.
+                std::vector<std::string> names;
+                std::vector<std::string> suffixes;
+                std::vector<std::string> name_prefixes;
+                std::vector<std::string> name_globs;
+
+                std::vector<std::string> path_prefixes;
+                std::vector<std::string> path_globs;
+                std::vector<boost::regex> regexes;
+
+                void add_glob(const std::string& glob);
+
+                bool empty() const;
+                bool has_path_rules() const;
+
+                bool match_name(boost::string_ref name, const char* cname) const;
+                bool match_path(const std::string& path) const;
+            };
+
+            // Composes the relative path of an entry.
+            static const std::string& compose(boost::string_ref dir, boost::string_ref name,
+                                              std::string& buffer);
+
+            rule_set m_include;
+            rule_set m_exclude;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_PATH_FILTER_HPP
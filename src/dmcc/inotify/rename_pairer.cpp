@@ -0,0 +1,132 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "rename_pairer.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+        rename_pairer::rename_pairer(uint64_t window_ms, size_t limit)
+            : m_window(window_ms),
+              m_limit(limit)
+        {
+        }
+
+        void rename_pairer::run(const std::vector<event>& in, std::vector<event>& out,
+                                uint64_t now)
+        {
+            // Everything released last time was dispatched by now.
+            m_released.clear();
+
+            for(std::vector<event>::const_iterator ev = in.begin(); ev != in.end(); ++ev) {
+                uint32_t mask = ev->mask();
+
+                if(!ev->m_watch || (mask & IN_IGNORED)) {
+                    // The watch goes away, nothing may refer to it
+                    // after this event.
+                    release_watch(ev->m_watch, out);
+                    out.push_back(*ev);
+                }
+                else if((mask & IN_MOVE) == IN_MOVED_FROM) {
+                    index_t::iterator stale = m_index.find(ev->cookie());
+
+                    // Reused cookie or full cache: give up on the old one.
+                    if(stale != m_index.end())
+                        out.push_back(release(stale->second));
+                    else if(m_held.size() >= m_limit)
+                        out.push_back(release(m_held.begin()));
+
+                    entry e;
+                    e.cookie = ev->cookie();
+                    e.parent = ev->m_watch;
+                    e.since = now;
+
+                    const unsigned char* raw =
+                        reinterpret_cast<const unsigned char*>(ev->m_event);
+                    e.raw.assign(raw, raw + sizeof(inotify_event) + ev->m_event->len);
+
+                    entry_list_t::iterator it = m_held.insert(m_held.end(), e);
+                    m_index.insert(index_t::value_type(e.cookie, it));
+                }
+                else if((mask & IN_MOVE) == IN_MOVED_TO) {
+                    index_t::iterator found = m_index.find(ev->cookie());
+
+                    if(found == m_index.end()) {
+                        // Moved in from somewhere we don't watch.
+                        out.push_back(*ev);
+                        continue;
+                    }
+
+                    event from = release(found->second);
+
+                    event renamed = *ev;
+                    renamed.m_event->mask |= IN_MOVED_FROM;
+                    renamed.m_from_event = from.m_event;
+                    renamed.m_from_watch = from.m_watch;
+                    out.push_back(renamed);
+                }
+                else
+                    out.push_back(*ev);
+            }
+
+            // Whatever waited too long was moved out of our sight.
+            while(!m_held.empty() && m_held.front().since + m_window <= now)
+                out.push_back(release(m_held.begin()));
+        }
+
+        uint64_t rename_pairer::window() const
+        {
+            return m_window;
+        }
+
+        uint64_t rename_pairer::deadline() const
+        {
+            if(m_held.empty())
+                return 0;
+
+            return m_held.front().since + m_window;
+        }
+
+        event rename_pairer::release(entry_list_t::iterator it)
+        {
+            m_index.erase(it->cookie);
+            m_released.splice(m_released.end(), m_held, it);
+
+            event ev;
+            ev.m_event = reinterpret_cast<inotify_event*>(&it->raw[0]);
+            ev.m_watch = it->parent;
+
+            return ev;
+        }
+
+        void rename_pairer::release_watch(watch* w, std::vector<event>& out)
+        {
+            entry_list_t::iterator it = m_held.begin();
+
+            while(it != m_held.end()) {
+                entry_list_t::iterator next = it;
+                ++next;
+
+                // Events without a watch (overflows) release everything.
+                if(!w || it->parent == w)
+                    out.push_back(release(it));
+
+                it = next;
+            }
+        }
+    }
+}
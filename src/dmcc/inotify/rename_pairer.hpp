@@ -0,0 +1,104 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_RENAME_PAIRER_HPP
+#define DMCC_INOTIFY_RENAME_PAIRER_HPP
+
+#include <list>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "inotify.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Joins IN_MOVED_FROM and IN_MOVED_TO events to renames.
+
+           IN_MOVED_FROM events are held back until the IN_MOVED_TO
+           event with the same cookie arrives. The pair is then
+           released as a single event carrying both masks, with the
+           old name available through event::old_path(). Halves that
+           find no partner in time, or are pushed out of the bounded
+           cache, are released unchanged.
+        */
+        class rename_pairer
+        {
+        public:
+            /**
+               \param window_ms How long an IN_MOVED_FROM event waits
+               for its partner in milliseconds.
+               \param limit The number of IN_MOVED_FROM events held at
+               most.
+            */
+            rename_pairer(uint64_t window_ms, size_t limit);
+
+            /**
+               \brief Runs a batch of events through the stage.
+
+               Released events are appended to out. They stay valid
+               until the next call.
+               \param now The current time in milliseconds.
+            */
+            void run(const std::vector<event>& in, std::vector<event>& out, uint64_t now);
+
+            /**
+               \brief Returns the time at which the oldest held event
+               has to be released, or 0 if nothing is held.
+            */
+            uint64_t deadline() const;
+
+            uint64_t window() const;
+
+        private:
+            struct entry
+            {
+                uint32_t cookie;
+                watch* parent;
+                uint64_t since;
+
+                // Copy of the inotify_event including its name.
+                std::vector<unsigned char> raw;
+            };
+
+            typedef std::list<entry> entry_list_t;
+            typedef boost::unordered_map<uint32_t, entry_list_t::iterator> index_t;
+
+            // Moves an entry to the released ones and returns its event.
+            event release(entry_list_t::iterator it);
+
+            // Releases all held events of a watch.
+            void release_watch(watch* w, std::vector<event>& out);
+
+            uint64_t m_window;
+            size_t m_limit;
+
+            // Held events in the order they arrived.
+            entry_list_t m_held;
+            index_t m_index;
+
+            // Released entries whose events are still being dispatched.
+            entry_list_t m_released;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_RENAME_PAIRER_HPP
@@ -0,0 +1,360 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "sharded_backend.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "exception/raise.hpp"
+
+#define INOTIFY_EVENT_SIZE (sizeof(struct inotify_event))
+#define SHARD_BUFLEN ((INOTIFY_EVENT_SIZE + 16) * 1024)
+
+
+namespace dmcc {
+    namespace inotify {
+        sharded_backend::shard::shard()
+            : fd(-1),
+              offset(0),
+              buffered(0)
+        {
+        }
+
+        sharded_backend::shard::~shard()
+        {
+            if(fd != -1)
+                close(fd);
+        }
+
+        sharded_backend::sharded_backend(unsigned shards, size_t buffer)
+            : m_buffer(buffer),
+              m_ready(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+              m_stop(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+              m_stopping(false),
+              m_next(0)
+        {
+            if(shards == 0)
+                shards = boost::thread::hardware_concurrency();
+
+            if(shards == 0)
+                shards = 1;
+
+            for(unsigned i = 0; i < shards; ++i) {
+                m_shards.push_back(new shard);
+                m_shards.back()->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+                if(m_shards.back()->fd == -1)
+                    break;
+            }
+
+            if(m_ready == -1 || m_stop == -1 || m_shards.back()->fd == -1) {
+                int err = errno;
+
+                for(size_t i = 0; i < m_shards.size(); ++i)
+                    delete m_shards[i];
+
+                if(m_ready != -1)
+                    close(m_ready);
+
+                if(m_stop != -1)
+                    close(m_stop);
+
+                errno = err;
+                DMCC_RAISE_LINUX_SYS_ERR("unable to initialize inotify");
+            }
+
+            for(unsigned i = 0; i < shards; ++i)
+                m_threads.create_thread(boost::bind(&sharded_backend::drain, this, i));
+        }
+
+        sharded_backend::~sharded_backend()
+        {
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_stopping = true;
+
+                for(size_t i = 0; i < m_shards.size(); ++i)
+                    m_shards[i]->space.notify_all();
+            }
+
+            uint64_t one = 1;
+
+            if(write(m_stop, &one, sizeof(one)) == -1) {
+                // Can't happen for a fresh eventfd.
+            }
+
+            m_threads.join_all();
+
+            for(size_t i = 0; i < m_shards.size(); ++i)
+                delete m_shards[i];
+
+            close(m_ready);
+            close(m_stop);
+        }
+
+        int sharded_backend::fd() const
+        {
+            return m_ready;
+        }
+
+        int sharded_backend::add_watch(const std::string& path, uint32_t mask, bool)
+        {
+            unsigned shards = m_shards.size();
+
+            // Errors are left to inotify_add_watch().
+            struct stat st;
+            bool known = ((mask & IN_DONT_FOLLOW) ? lstat(path.c_str(), &st)
+                          : stat(path.c_str(), &st)) == 0;
+            inode_t inode(known ? st.st_dev : 0, known ? st.st_ino : 0);
+
+            int index = -1;
+
+            if(known) {
+                // A directory moved to another subtree would get a
+                // second watch on the shard of its new path.
+                boost::mutex::scoped_lock lock(m_roots_mutex);
+                boost::unordered_map<inode_t, int>::const_iterator it = m_inodes.find(inode);
+
+                if(it != m_inodes.end())
+                    index = it->second % shards;
+            }
+
+            if(index == -1)
+                index = shard_of(path);
+
+            int wd = inotify_add_watch(m_shards[index]->fd, path.c_str(), mask);
+
+            if(wd < 0)
+                return wd;
+
+            wd = wd * static_cast<int>(shards) + index;
+
+            if(known) {
+                boost::mutex::scoped_lock lock(m_roots_mutex);
+                m_inodes[inode] = wd;
+                m_watched[wd] = inode;
+            }
+
+            return wd;
+        }
+
+        int sharded_backend::remove_watch(int wd)
+        {
+            unsigned shards = m_shards.size();
+
+            return inotify_rm_watch(m_shards[wd % shards]->fd, wd / shards);
+        }
+
+        void sharded_backend::forget_watch(int wd)
+        {
+            boost::mutex::scoped_lock lock(m_roots_mutex);
+            boost::unordered_map<int, inode_t>::iterator it = m_watched.find(wd);
+
+            if(it == m_watched.end())
+                return;
+
+            // The inode may be watched under another descriptor by
+            // now.
+            boost::unordered_map<inode_t, int>::iterator inode = m_inodes.find(it->second);
+
+            if(inode != m_inodes.end() && inode->second == wd)
+                m_inodes.erase(inode);
+
+            m_watched.erase(it);
+        }
+
+        ssize_t sharded_backend::read(unsigned char* buf, size_t len)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for(unsigned i = 0; i < m_shards.size(); ++i) {
+                unsigned index = (m_next + i) % m_shards.size();
+                shard& s = *m_shards[index];
+
+                if(s.reads.empty())
+                    continue;
+
+                // The next read starts with the next shard.
+                m_next = index + 1;
+
+                const std::vector<unsigned char>& r = s.reads.front();
+                size_t n = 0;
+
+                // Whole events only, the kernel doesn't split them
+                // either.
+                while(s.offset + n < r.size()) {
+                    const inotify_event* ev =
+                        reinterpret_cast<const inotify_event*>(&r[s.offset + n]);
+                    size_t size = INOTIFY_EVENT_SIZE + ev->len;
+
+                    if(n + size > len)
+                        break;
+
+                    n += size;
+                }
+
+                if(n == 0) {
+                    errno = EINVAL;
+                    return -1;
+                }
+
+                memcpy(buf, &r[s.offset], n);
+                s.offset += n;
+
+                if(s.offset == r.size()) {
+                    s.buffered -= r.size();
+                    s.reads.pop_front();
+                    s.offset = 0;
+                    s.space.notify_one();
+                }
+
+                return n;
+            }
+
+            // Drained, the threads signal the descriptor again under
+            // the lock.
+            uint64_t count;
+
+            if(::read(m_ready, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                return -1;
+
+            errno = EAGAIN;
+            return -1;
+        }
+
+        unsigned sharded_backend::shards() const
+        {
+            return m_shards.size();
+        }
+
+        unsigned sharded_backend::shard_of(const std::string& path)
+        {
+            std::string dir = path;
+
+            if(dir.size() > 1 && dir[dir.size() - 1] == '/')
+                dir.erase(dir.size() - 1);
+
+            boost::hash<std::string> hash;
+
+            boost::mutex::scoped_lock lock(m_roots_mutex);
+
+            // Look for the root the directory lies below, remembering
+            // the subtree right below it.
+            std::string::size_type end = dir.size();
+            std::string::size_type subtree = std::string::npos;
+
+            while(end != std::string::npos) {
+                // The root directory keeps its slash.
+                boost::unordered_map<std::string, unsigned>::const_iterator it =
+                    m_roots.find(dir.substr(0, std::max<std::string::size_type>(end, 1)));
+
+                if(it != m_roots.end()) {
+                    if(subtree == std::string::npos)
+                        return it->second;
+
+                    return hash(dir.substr(0, subtree)) % m_shards.size();
+                }
+
+                if(end == 0)
+                    break;
+
+                subtree = end;
+                end = dir.rfind('/', end - 1);
+            }
+
+            unsigned index = hash(dir) % m_shards.size();
+            m_roots[dir] = index;
+
+            return index;
+        }
+
+        void sharded_backend::drain(unsigned index)
+        {
+            shard& s = *m_shards[index];
+            int shards = m_shards.size();
+
+            std::vector<unsigned char> buf(SHARD_BUFLEN);
+
+            struct pollfd fds[2];
+            fds[0].fd = s.fd;
+            fds[0].events = POLLIN;
+            fds[1].fd = m_stop;
+            fds[1].events = POLLIN;
+
+            for(;;) {
+                {
+                    // Leave the events to the kernel queue while the
+                    // buffer is full.
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    while(s.buffered >= m_buffer && !m_stopping)
+                        s.space.wait(lock);
+
+                    if(m_stopping)
+                        return;
+                }
+
+                if(poll(fds, 2, -1) == -1)
+                    continue;
+
+                if(fds[1].revents)
+                    return;
+
+                ssize_t len = ::read(s.fd, &buf[0], buf.size());
+
+                if(len <= 0)
+                    continue;
+
+                for(ssize_t i = 0; i < len;) {
+                    inotify_event* ev = reinterpret_cast<inotify_event*>(&buf[i]);
+
+                    // Overflows keep their -1.
+                    if(ev->wd >= 0) {
+                        ev->wd = ev->wd * shards + index;
+
+                        if(ev->mask & IN_IGNORED)
+                            forget_watch(ev->wd);
+                    }
+
+                    i += INOTIFY_EVENT_SIZE + ev->len;
+                }
+
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                s.reads.push_back(std::vector<unsigned char>(buf.begin(), buf.begin() + len));
+                s.buffered += len;
+
+                uint64_t one = 1;
+
+                if(write(m_ready, &one, sizeof(one)) == -1) {
+                    // The counter can't overflow, it is reset by read().
+                }
+            }
+        }
+    }
+}
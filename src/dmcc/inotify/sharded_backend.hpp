@@ -0,0 +1,136 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_SHARDED_BACKEND_HPP
+#define DMCC_INOTIFY_SHARDED_BACKEND_HPP
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "backend.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Spreads the watches over several inotify instances.
+
+           Each instance has a kernel queue of its own and is drained
+           by a thread of its own into a bounded buffer, so the
+           capacity and the read throughput grow with the number of
+           shards. The subtrees right below a watched root are
+           assigned to shards by the hash of their path, and all
+           directories of a subtree share its shard. Since the events
+           of a file are reported by the watch of its directory, they
+           keep their order. Reads return the buffered reads of the
+           shards in turn.
+
+           A directory that is already watched stays on its shard
+           when it is watched again, e.g. after it was moved to
+           another subtree, so it keeps a single watch like it would
+           with one inotify instance.
+
+           Watch-descriptors are the ones of the instances, multiplied
+           by the number of shards plus the index of the shard.
+        */
+        class sharded_backend : public backend
+        {
+        public:
+            /**
+               \param shards The number of inotify instances, 0 for
+               one per core.
+               \param buffer The bytes a shard buffers at most before
+               it leaves the events in its kernel queue.
+            */
+            explicit sharded_backend(unsigned shards = 0, size_t buffer = 4 << 20);
+            ~sharded_backend();
+
+            int fd() const;
+            int add_watch(const std::string& path, uint32_t mask, bool recursive);
+            ssize_t read(unsigned char* buf, size_t len);
+            int remove_watch(int wd);
+
+            unsigned shards() const;
+
+        private:
+            struct shard
+            {
+                shard();
+                ~shard();
+
+                int fd;
+
+                // Reads not taken yet, and the offset into the first.
+                std::deque<std::vector<unsigned char> > reads;
+                size_t offset;
+                size_t buffered;
+
+                boost::condition_variable space;
+            };
+
+            // Returns the shard that watches path.
+            unsigned shard_of(const std::string& path);
+
+            // Forgets the inode of a watch the kernel removed.
+            void forget_watch(int wd);
+
+            // Reads a shard until the backend is destroyed.
+            void drain(unsigned index);
+
+            std::vector<shard*> m_shards;
+            boost::thread_group m_threads;
+            size_t m_buffer;
+
+            // Eventfd that is readable while reads are buffered.
+            int m_ready;
+
+            // Eventfd that stops the threads.
+            int m_stop;
+
+            // Guards the buffers and m_stopping.
+            boost::mutex m_mutex;
+            bool m_stopping;
+
+            // The shard read() looks at first.
+            unsigned m_next;
+
+            // The paths add_watch() was called with for directories
+            // outside of all known trees, and their shards.
+            boost::unordered_map<std::string, unsigned> m_roots;
+
+            // The watched directories by device and inode, and their
+            // watch-descriptors.
+            typedef std::pair<uint64_t, uint64_t> inode_t;
+            boost::unordered_map<inode_t, int> m_inodes;
+            boost::unordered_map<int, inode_t> m_watched;
+
+            // Guards m_roots, m_inodes and m_watched.
+            boost::mutex m_roots_mutex;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_SHARDED_BACKEND_HPP
@@ -0,0 +1,423 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "snapshot.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exception/raise.hpp"
+#include "snapshot_file.hpp"
+
+namespace fs = boost::filesystem;
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            bool path_less(const snapshot::dir& a, const snapshot::dir& b)
+            {
+                return a.path.string() < b.path.string();
+            }
+
+            bool name_less(const snapshot::listing_t::value_type& a,
+                           const snapshot::listing_t::value_type& b)
+            {
+                return a.first < b.first;
+            }
+
+            void write_all(FILE* f, const void* data, size_t size, const std::string& file)
+            {
+                if(size > 0 && fwrite(data, size, 1, f) != 1)
+                    DMCC_RAISE_LINUX_SYS_ERR("unable to write snapshot `" + file + "'");
+            }
+        }
+
+        const uint32_t snapshot::TRACKED_EVENTS = IN_CREATE | IN_DELETE | IN_MOVE |
+            IN_CLOSE_WRITE | IN_ATTRIB;
+
+        bool snapshot::info::operator==(const info& other) const
+        {
+            return ino == other.ino && size == other.size &&
+                mtime == other.mtime && is_dir == other.is_dir;
+        }
+
+        bool snapshot::info::operator!=(const info& other) const
+        {
+            return !(*this == other);
+        }
+
+        void snapshot::record(int wd, const fs::path& dir,
+                              const tree_scanner::entry_list_t& entries)
+        {
+            dir_state listing;
+            listing.mtime = 0;
+
+            int dirfd = open(dir.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if(dirfd != -1) {
+                info self;
+
+                // Later changes are reported by the watch, which resets
+                // the mtime again.
+                if(stat_entry(dirfd, ".", self))
+                    listing.mtime = self.mtime;
+
+                tree_scanner::entry_list_t::const_iterator it = entries.begin();
+
+                for(; it != entries.end(); ++it) {
+                    info i;
+
+                    if(stat_entry(dirfd, it->name.c_str(), i))
+                        listing.entries[it->name] = i;
+                }
+
+                close(dirfd);
+            }
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            dir_state& d = m_dirs[wd];
+            d.mtime = listing.mtime;
+            d.entries.swap(listing.entries);
+        }
+
+        void snapshot::assign(int wd, int64_t mtime, const listing_t& entries)
+        {
+            entries_t listing(entries.begin(), entries.end());
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            dir_state& d = m_dirs[wd];
+            d.mtime = mtime;
+            d.entries.swap(listing);
+        }
+
+        void snapshot::update(int wd, const fs::path& dir, uint32_t mask,
+                              boost::string_ref name)
+        {
+            if(name.empty()) {
+                if(mask & (IN_DELETE_SELF | IN_IGNORED))
+                    drop(wd);
+
+                return;
+            }
+
+            dir_state& d = state(wd);
+            entries_t& listing = d.entries;
+            std::string key(name.data(), name.size());
+
+            if(mask & (IN_CREATE | IN_DELETE | IN_MOVE))
+                d.mtime = 0;
+
+            if(mask & (IN_DELETE | IN_MOVED_FROM)) {
+                listing.erase(key);
+                return;
+            }
+
+            if(!(mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)))
+                return;
+
+            info i;
+
+            if(stat_entry(AT_FDCWD, (dir / key).string().c_str(), i))
+                listing[key] = i;
+            else
+                listing.erase(key);
+        }
+
+        void snapshot::drop(int wd)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_dirs.erase(wd);
+        }
+
+        void snapshot::rescan(const std::vector<dir>& dirs, unsigned threads,
+                              std::vector<change>& out)
+        {
+            if(threads == 0)
+                threads = boost::thread::hardware_concurrency();
+
+            if(threads == 0)
+                threads = 1;
+
+            size_t next = 0;
+            boost::mutex out_mutex;
+            boost::thread_group group;
+
+            for(unsigned i = 1; i < threads; ++i)
+                group.create_thread(boost::bind(&snapshot::rescan_worker, this,
+                                                &dirs, &next, &out, &out_mutex));
+
+            rescan_worker(&dirs, &next, &out, &out_mutex);
+            group.join_all();
+        }
+
+        void snapshot::save(const fs::path& file, const std::vector<dir>& dirs) const
+        {
+            // Parents sort before their children.
+            std::vector<dir> sorted(dirs);
+            std::sort(sorted.begin(), sorted.end(), path_less);
+
+            boost::unordered_map<std::string, uint32_t> index;
+
+            std::vector<snapshot_file::dir_record> dir_records;
+            std::vector<snapshot_file::entry_record> entry_records;
+            std::string names;
+
+            listing_t listing;
+
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for(std::vector<dir>::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+                dirs_t::const_iterator state = m_dirs.find(it->wd);
+
+                if(state == m_dirs.end())
+                    continue;
+
+                const std::string& path = it->path.string();
+
+                snapshot_file::dir_record d;
+                d.reserved = 0;
+                d.mtime = state->second.mtime;
+
+                // Store the last component only if the parent is known.
+                std::string name = path;
+                boost::unordered_map<std::string, uint32_t>::const_iterator parent =
+                    index.find(it->path.parent_path().string());
+
+                if(parent != index.end() && it->path.has_filename()) {
+                    d.parent = parent->second;
+                    name = it->path.filename().string();
+                }
+                else
+                    d.parent = snapshot_file::NO_PARENT;
+
+                d.name_offset = names.size();
+                d.name_length = name.size();
+                names += name;
+
+                listing.assign(state->second.entries.begin(), state->second.entries.end());
+                std::sort(listing.begin(), listing.end(), name_less);
+
+                d.first_entry = entry_records.size();
+                d.entry_count = listing.size();
+
+                for(size_t i = 0; i < listing.size(); ++i) {
+                    snapshot_file::entry_record e;
+                    e.ino = listing[i].second.ino;
+                    e.size = listing[i].second.size;
+                    e.mtime = listing[i].second.mtime;
+                    e.name_offset = names.size();
+                    e.name_length = listing[i].first.size();
+                    e.is_dir = listing[i].second.is_dir;
+                    names += listing[i].first;
+
+                    entry_records.push_back(e);
+                }
+
+                if(names.size() > 0xffffffffu || entry_records.size() > 0xffffffffu)
+                    DMCC_RAISE_CRITICAL("snapshot too large");
+
+                index[path] = dir_records.size();
+                dir_records.push_back(d);
+            }
+
+            lock.unlock();
+
+            snapshot_file::header h;
+            memcpy(h.magic, snapshot_file::MAGIC, sizeof(h.magic));
+            h.version = snapshot_file::VERSION;
+            h.dir_count = dir_records.size();
+            h.entry_count = entry_records.size();
+            h.names_size = names.size();
+
+            // Write to a temporary file and move it over the old one,
+            // so a crash never leaves a half-written snapshot.
+            std::string tmp = file.string() + ".tmp";
+            FILE* f = fopen(tmp.c_str(), "wb");
+
+            if(!f)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to write snapshot `" + tmp + "'");
+
+            try {
+                write_all(f, &h, sizeof(h), tmp);
+                write_all(f, dir_records.empty() ? 0 : &dir_records[0],
+                          dir_records.size() * sizeof(dir_records[0]), tmp);
+                write_all(f, entry_records.empty() ? 0 : &entry_records[0],
+                          entry_records.size() * sizeof(entry_records[0]), tmp);
+                write_all(f, names.data(), names.size(), tmp);
+
+                if(fflush(f) != 0 || fsync(fileno(f)) != 0)
+                    DMCC_RAISE_LINUX_SYS_ERR("unable to write snapshot `" + tmp + "'");
+            }
+            catch(...) {
+                fclose(f);
+                unlink(tmp.c_str());
+                throw;
+            }
+
+            fclose(f);
+
+            if(rename(tmp.c_str(), file.string().c_str()) != 0)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to replace snapshot `" + file.string() + "'");
+        }
+
+        size_t snapshot::size() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_dirs.size();
+        }
+
+        snapshot::dir_state& snapshot::state(int wd)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            std::pair<dirs_t::iterator, bool> res =
+                m_dirs.insert(dirs_t::value_type(wd, dir_state()));
+
+            if(res.second)
+                res.first->second.mtime = 0;
+
+            return res.first->second;
+        }
+
+        bool snapshot::stat_entry(int dirfd, const char* name, info& out)
+        {
+            struct stat st;
+
+            if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                return false;
+
+            out.ino = st.st_ino;
+            out.size = st.st_size;
+            out.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                st.st_mtim.tv_nsec;
+            out.is_dir = S_ISDIR(st.st_mode);
+
+            return true;
+        }
+
+        void snapshot::rescan_dir(const dir& d, std::vector<change>& out)
+        {
+            int dirfd = open(d.path.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if(dirfd == -1)
+                // Gone, the parent's rescan reports the deletion.
+                return;
+
+            entries_t current;
+            int64_t mtime = 0;
+
+            info self;
+
+            if(stat_entry(dirfd, ".", self))
+                mtime = self.mtime;
+
+            // fdopendir takes ownership, keep our own descriptor for
+            // the fstatat calls.
+            DIR* listing = fdopendir(dup(dirfd));
+
+            if(listing) {
+                while(struct dirent* ent = readdir(listing)) {
+                    const char* name = ent->d_name;
+
+                    if(name[0] == '.' && (name[1] == '\0' ||
+                                          (name[1] == '.' && name[2] == '\0')))
+                        continue;
+
+                    info i;
+
+                    if(stat_entry(dirfd, name, i))
+                        current[name] = i;
+                }
+
+                closedir(listing);
+            }
+
+            close(dirfd);
+
+            dir_state& state = this->state(d.wd);
+            entries_t& known = state.entries;
+
+            change c;
+            c.wd = d.wd;
+
+            for(entries_t::const_iterator it = known.begin(); it != known.end(); ++it) {
+                entries_t::const_iterator now = current.find(it->first);
+
+                // Replaced entries are reported as deleted and created.
+                if(now == current.end() || now->second.ino != it->second.ino ||
+                   now->second.is_dir != it->second.is_dir) {
+                    c.mask = IN_DELETE | (it->second.is_dir ? IN_ISDIR : 0);
+                    c.name = it->first;
+                    out.push_back(c);
+                }
+            }
+
+            for(entries_t::const_iterator it = current.begin(); it != current.end(); ++it) {
+                entries_t::const_iterator before = known.find(it->first);
+
+                if(before == known.end() || before->second.ino != it->second.ino ||
+                   before->second.is_dir != it->second.is_dir)
+                    c.mask = IN_CREATE | (it->second.is_dir ? IN_ISDIR : 0);
+                else if(before->second != it->second && !it->second.is_dir)
+                    c.mask = IN_MODIFY;
+                else
+                    continue;
+
+                c.name = it->first;
+                out.push_back(c);
+            }
+
+            known.swap(current);
+            state.mtime = mtime;
+        }
+
+        void snapshot::rescan_worker(const std::vector<dir>* dirs, size_t* next,
+                                     std::vector<change>* out, boost::mutex* out_mutex)
+        {
+            std::vector<change> changes;
+
+            for(;;) {
+                size_t i;
+
+                {
+                    boost::mutex::scoped_lock lock(*out_mutex);
+
+                    if(*next >= dirs->size())
+                        break;
+
+                    i = (*next)++;
+                }
+
+                rescan_dir((*dirs)[i], changes);
+            }
+
+            boost::mutex::scoped_lock lock(*out_mutex);
+            out->insert(out->end(), changes.begin(), changes.end());
+        }
+    }
+}
@@ -0,0 +1,171 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_SNAPSHOT_HPP
+#define DMCC_INOTIFY_SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "tree_scanner.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief The metadata of all watched directories' entries.
+
+           Kept up to date from the events, so after the kernel queue
+           overflowed a rescan can tell what was missed.
+        */
+        class snapshot
+        {
+        public:
+            /**
+               \brief What is remembered about a directory entry.
+            */
+            struct info
+            {
+                uint64_t ino;
+                uint64_t size;
+                int64_t mtime;
+                bool is_dir;
+
+                bool operator==(const info& other) const;
+                bool operator!=(const info& other) const;
+            };
+
+            /**
+               \brief A difference found by rescan().
+            */
+            struct change
+            {
+                int wd;
+                uint32_t mask;
+                std::string name;
+            };
+
+            /**
+               \brief A directory to rescan.
+            */
+            struct dir
+            {
+                int wd;
+                boost::filesystem::path path;
+            };
+
+            typedef std::vector<std::pair<std::string, info> > listing_t;
+
+            /**
+               \brief The events that have to be watched to keep the
+               snapshot up to date.
+            */
+            static const uint32_t TRACKED_EVENTS;
+
+            /**
+               \brief Stores the listing of a directory.
+
+               Safe to be called concurrently for different watches.
+            */
+            void record(int wd, const boost::filesystem::path& dir,
+                        const tree_scanner::entry_list_t& entries);
+
+            /**
+               \brief Stores the already examined entries of a directory.
+               \param mtime The mtime of the directory when it was
+               listed.
+            */
+            void assign(int wd, int64_t mtime, const listing_t& entries);
+
+            /**
+               \brief Applies an event to the snapshot.
+            */
+            void update(int wd, const boost::filesystem::path& dir, uint32_t mask,
+                        boost::string_ref name);
+
+            /**
+               \brief Forgets a directory whose watch was removed.
+            */
+            void drop(int wd);
+
+            /**
+               \brief Lists directories again and reports what changed.
+
+               The directories are split among threads. The found
+               changes are stored in the snapshot and appended to out
+               as IN_CREATE, IN_DELETE and IN_MODIFY changes.
+            */
+            void rescan(const std::vector<dir>& dirs, unsigned threads,
+                        std::vector<change>& out);
+
+            /**
+               \brief Writes the snapshot of the given directories to a
+               file that can be mapped by snapshot_file.
+
+               The file is replaced atomically.
+            */
+            void save(const boost::filesystem::path& file,
+                      const std::vector<dir>& dirs) const;
+
+            size_t size() const;
+
+            /**
+               \brief Reads the metadata of a directory entry.
+               \param dirfd The directory name is relative to, or
+               AT_FDCWD.
+               \return false if the entry doesn't exist.
+            */
+            static bool stat_entry(int dirfd, const char* name, info& out);
+
+        private:
+            typedef boost::unordered_map<std::string, info> entries_t;
+
+            struct dir_state
+            {
+                // The directory's mtime when it was listed, or 0 once
+                // entries were added or removed since.
+                int64_t mtime;
+                entries_t entries;
+            };
+
+            typedef boost::unordered_map<int, dir_state> dirs_t;
+
+            // Returns the state of a directory, creating it if
+            // necessary. References stay valid until the directory
+            // is dropped.
+            dir_state& state(int wd);
+
+            // Rescans a single directory.
+            void rescan_dir(const dir& d, std::vector<change>& out);
+
+            void rescan_worker(const std::vector<dir>* dirs, size_t* next,
+                               std::vector<change>* out, boost::mutex* out_mutex);
+
+            dirs_t m_dirs;
+            mutable boost::mutex m_mutex;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_SNAPSHOT_HPP
@@ -0,0 +1,258 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "snapshot_file.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+using boost::string_ref;
+
+
+namespace dmcc {
+    namespace inotify {
+        const char snapshot_file::MAGIC[8] = { 'D', 'M', 'C', 'C', 'S', 'N', 'A', 'P' };
+
+        snapshot_file::snapshot_file(const fs::path& file)
+            : m_map(0),
+              m_size(0),
+              m_header(0),
+              m_dirs(0),
+              m_entries(0),
+              m_names(0)
+        {
+            int fd = open(file.string().c_str(), O_RDONLY | O_CLOEXEC);
+
+            if(fd == -1)
+                return;
+
+            struct stat st;
+
+            if(fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(header))) {
+                m_size = st.st_size;
+                m_map = mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if(m_map == MAP_FAILED)
+                    m_map = 0;
+            }
+
+            close(fd);
+
+            if(!m_map)
+                return;
+
+            const header* h = static_cast<const header*>(m_map);
+
+            uint64_t expected = sizeof(header) +
+                static_cast<uint64_t>(h->dir_count) * sizeof(dir_record) +
+                h->entry_count * sizeof(entry_record) + h->names_size;
+
+            if(memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION ||
+               expected != m_size) {
+                munmap(m_map, m_size);
+                m_map = 0;
+                return;
+            }
+
+            const char* base = static_cast<const char*>(m_map);
+            m_header = h;
+            m_dirs = reinterpret_cast<const dir_record*>(base + sizeof(header));
+            m_entries = reinterpret_cast<const entry_record*>(m_dirs + h->dir_count);
+            m_names = reinterpret_cast<const char*>(m_entries + h->entry_count);
+
+            for(uint64_t i = 0; i < h->entry_count; ++i) {
+                if(static_cast<uint64_t>(m_entries[i].name_offset) +
+                   m_entries[i].name_length > h->names_size) {
+                    m_header = 0;
+                    return;
+                }
+            }
+
+            // Rebuild the full paths. Parents are stored before their
+            // children.
+            std::vector<std::string> paths(h->dir_count);
+
+            for(uint32_t i = 0; i < h->dir_count; ++i) {
+                const dir_record& d = m_dirs[i];
+
+                if(static_cast<uint64_t>(d.name_offset) + d.name_length > h->names_size ||
+                   static_cast<uint64_t>(d.first_entry) + d.entry_count > h->entry_count ||
+                   (d.parent != NO_PARENT && d.parent >= i)) {
+                    // Corrupt, better start from scratch.
+                    m_paths.clear();
+                    m_header = 0;
+                    return;
+                }
+
+                string_ref n = name(d.name_offset, d.name_length);
+
+                if(d.parent == NO_PARENT)
+                    paths[i].assign(n.data(), n.size());
+                else {
+                    paths[i].reserve(paths[d.parent].size() + 1 + n.size());
+                    paths[i] = paths[d.parent];
+                    paths[i] += '/';
+                    paths[i].append(n.data(), n.size());
+                }
+
+                m_paths[paths[i]] = i;
+            }
+        }
+
+        snapshot_file::~snapshot_file()
+        {
+            if(m_map)
+                munmap(m_map, m_size);
+        }
+
+        bool snapshot_file::valid() const
+        {
+            return m_header != 0;
+        }
+
+        int snapshot_file::find_dir(const std::string& path) const
+        {
+            boost::unordered_map<std::string, uint32_t>::const_iterator it = m_paths.find(path);
+
+            if(it == m_paths.end())
+                return -1;
+
+            return it->second;
+        }
+
+        int64_t snapshot_file::dir_mtime(int dir) const
+        {
+            return m_dirs[dir].mtime;
+        }
+
+        void snapshot_file::list(int dir, tree_scanner::entry_list_t& out) const
+        {
+            const dir_record& d = m_dirs[dir];
+
+            for(uint32_t i = 0; i < d.entry_count; ++i) {
+                const entry_record& e = m_entries[d.first_entry + i];
+                string_ref n = name(e.name_offset, e.name_length);
+
+                tree_scanner::entry entry;
+                entry.name.assign(n.data(), n.size());
+                entry.is_dir = e.is_dir != 0;
+                out.push_back(entry);
+            }
+        }
+
+        void snapshot_file::diff(int dir, int dirfd, const tree_scanner::entry_list_t& current,
+                                 int wd, std::vector<snapshot::change>& out,
+                                 snapshot::listing_t& examined) const
+        {
+            dir_record empty;
+            memset(&empty, 0, sizeof(empty));
+
+            const dir_record& d = dir < 0 ? empty : m_dirs[dir];
+
+            snapshot::change c;
+            c.wd = wd;
+
+            std::vector<string_ref> names;
+            names.reserve(current.size());
+
+            for(tree_scanner::entry_list_t::const_iterator it = current.begin();
+                it != current.end(); ++it) {
+                names.push_back(it->name);
+
+                snapshot::info now;
+
+                if(!snapshot::stat_entry(dirfd, it->name.c_str(), now))
+                    // Gone again, its removal is reported by the watch.
+                    continue;
+
+                examined.push_back(snapshot::listing_t::value_type(it->name, now));
+
+                const entry_record* before = find_entry(d, it->name);
+
+                if(!before || before->ino != now.ino || (before->is_dir != 0) != now.is_dir) {
+                    // Replaced entries are reported as deleted and created.
+                    if(before) {
+                        c.mask = IN_DELETE | (before->is_dir ? IN_ISDIR : 0);
+                        c.name = it->name;
+                        out.push_back(c);
+                    }
+
+                    c.mask = IN_CREATE | (now.is_dir ? IN_ISDIR : 0);
+                }
+                else if(!now.is_dir && (before->size != now.size || before->mtime != now.mtime))
+                    c.mask = IN_MODIFY;
+                else
+                    continue;
+
+                c.name = it->name;
+                out.push_back(c);
+            }
+
+            std::sort(names.begin(), names.end());
+
+            for(uint32_t i = 0; i < d.entry_count; ++i) {
+                const entry_record& e = m_entries[d.first_entry + i];
+                string_ref n = name(e.name_offset, e.name_length);
+
+                if(!std::binary_search(names.begin(), names.end(), n)) {
+                    c.mask = IN_DELETE | (e.is_dir ? IN_ISDIR : 0);
+                    c.name.assign(n.data(), n.size());
+                    out.push_back(c);
+                }
+            }
+        }
+
+        string_ref snapshot_file::name(uint32_t offset, uint32_t length) const
+        {
+            return string_ref(m_names + offset, length);
+        }
+
+        const snapshot_file::entry_record* snapshot_file::find_entry(const dir_record& d,
+                                                                     string_ref n) const
+        {
+            // Entries are sorted by name.
+            const entry_record* first = m_entries + d.first_entry;
+            size_t count = d.entry_count;
+
+            while(count > 0) {
+                size_t half = count / 2;
+                const entry_record* mid = first + half;
+
+                if(name(mid->name_offset, mid->name_length) < n) {
+                    first = mid + 1;
+                    count -= half + 1;
+                }
+                else
+                    count = half;
+            }
+
+            if(first != m_entries + d.first_entry + d.entry_count &&
+               name(first->name_offset, first->name_length) == n)
+                return first;
+
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,153 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_SNAPSHOT_FILE_HPP
+#define DMCC_INOTIFY_SNAPSHOT_FILE_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "snapshot.hpp"
+#include "tree_scanner.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief A snapshot written by snapshot::save(), mapped into
+           memory.
+
+           The file consists of a header, a table of directories, a
+           table of entries and a blob of names. Directories are
+           stored as their last path component plus the index of
+           their parent, and the entries of a directory are stored
+           contiguously and sorted by name, so they can be searched
+           right in the mapping. Numbers are stored in host byte order.
+        */
+        class snapshot_file : private boost::noncopyable
+        {
+        public:
+            struct header
+            {
+                char magic[8];
+                uint32_t version;
+                uint32_t dir_count;
+                uint64_t entry_count;
+                uint64_t names_size;
+            };
+
+            struct dir_record
+            {
+                // Index of the parent or NO_PARENT for top-level
+                // directories, whose name is their full path.
+                uint32_t parent;
+                uint32_t name_offset;
+                uint32_t name_length;
+                uint32_t first_entry;
+                uint32_t entry_count;
+                uint32_t reserved;
+                int64_t mtime;
+            };
+
+            struct entry_record
+            {
+                uint64_t ino;
+                uint64_t size;
+                int64_t mtime;
+                uint32_t name_offset;
+                uint16_t name_length;
+                uint16_t is_dir;
+            };
+
+            static const char MAGIC[8];
+            static const uint32_t VERSION = 1;
+            static const uint32_t NO_PARENT = 0xffffffff;
+
+            /**
+               \brief Maps a snapshot file.
+
+               A missing, truncated or incompatible file yields an
+               empty snapshot.
+            */
+            explicit snapshot_file(const boost::filesystem::path& file);
+
+            ~snapshot_file();
+
+            /**
+               \brief Returns false if the file couldn't be used.
+            */
+            bool valid() const;
+
+            /**
+               \brief Looks a directory up by its full path.
+               \return The index of the directory or -1.
+            */
+            int find_dir(const std::string& path) const;
+
+            /**
+               \brief Returns the mtime of a directory when it was last
+               listed, or 0 if it changed after that.
+            */
+            int64_t dir_mtime(int dir) const;
+
+            /**
+               \brief Lists a directory as it was stored.
+            */
+            void list(int dir, tree_scanner::entry_list_t& out) const;
+
+            /**
+               \brief Compares a directory's stored entries with the
+               current ones.
+
+               Appends IN_CREATE, IN_DELETE and IN_MODIFY changes to out.
+               \param dir The index of the directory or -1 if it is new.
+               \param dirfd A descriptor of the directory, used to stat
+               the current entries.
+               \param examined Receives the metadata of the current
+               entries.
+            */
+            void diff(int dir, int dirfd, const tree_scanner::entry_list_t& current,
+                      int wd, std::vector<snapshot::change>& out,
+                      snapshot::listing_t& examined) const;
+
+        private:
+            boost::string_ref name(uint32_t offset, uint32_t length) const;
+
+            // Returns the stored entry or 0.
+            const entry_record* find_entry(const dir_record& d, boost::string_ref name) const;
+
+            void* m_map;
+            size_t m_size;
+
+            const header* m_header;
+            const dir_record* m_dirs;
+            const entry_record* m_entries;
+            const char* m_names;
+
+            boost::unordered_map<std::string, uint32_t> m_paths;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_SNAPSHOT_FILE_HPP
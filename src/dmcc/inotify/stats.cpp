@@ -0,0 +1,294 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "stats.hpp"
+
+#include <cstdio>
+#include <algorithm>
+#include <limits>
+
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <time.h>
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            struct thread_entry
+            {
+                uint64_t id;
+                stats_collector::block* block;
+
+                // Tells if the collector is gone.
+                boost::weak_ptr<stats_collector::block> owner;
+            };
+
+            // The blocks of the calling thread by collector.
+            boost::thread_specific_ptr<std::vector<thread_entry> > thread_blocks;
+
+            boost::mutex id_mutex;
+            uint64_t next_id = 0;
+        }
+
+
+        histogram::histogram()
+            : m_count(0),
+              m_min(std::numeric_limits<uint64_t>::max()),
+              m_max(0),
+              m_sum(0)
+        {
+            std::fill(m_buckets, m_buckets + BUCKETS, 0);
+        }
+
+        unsigned histogram::bucket(uint64_t value)
+        {
+            if(value < 16)
+                return value;
+
+            unsigned exponent = 63 - __builtin_clzll(value);
+            unsigned sub = (value >> (exponent - 3)) & 7;
+
+            return 16 + (exponent - 4) * 8 + sub;
+        }
+
+        uint64_t histogram::upper_bound(unsigned bucket)
+        {
+            if(bucket < 16)
+                return bucket;
+
+            unsigned exponent = (bucket - 16) / 8 + 4;
+            uint64_t sub = (bucket - 16) % 8;
+
+            return ((8 + sub + 1) << (exponent - 3)) - 1;
+        }
+
+        void histogram::record(uint64_t value)
+        {
+            ++m_buckets[bucket(value)];
+            ++m_count;
+            m_sum += value;
+            m_min = std::min(m_min, value);
+            m_max = std::max(m_max, value);
+        }
+
+        void histogram::merge(const histogram& other)
+        {
+            for(unsigned i = 0; i < BUCKETS; ++i)
+                m_buckets[i] += other.m_buckets[i];
+
+            m_count += other.m_count;
+            m_sum += other.m_sum;
+            m_min = std::min(m_min, other.m_min);
+            m_max = std::max(m_max, other.m_max);
+        }
+
+        uint64_t histogram::count() const
+        {
+            return m_count;
+        }
+
+        uint64_t histogram::min() const
+        {
+            return m_count ? m_min : 0;
+        }
+
+        uint64_t histogram::max() const
+        {
+            return m_max;
+        }
+
+        double histogram::mean() const
+        {
+            return m_count ? static_cast<double>(m_sum) / m_count : 0;
+        }
+
+        uint64_t histogram::percentile(double p) const
+        {
+            if(m_count == 0)
+                return 0;
+
+            uint64_t rank = static_cast<uint64_t>(p / 100 * m_count + 0.5);
+            rank = std::max<uint64_t>(1, std::min(rank, m_count));
+
+            uint64_t seen = 0;
+
+            for(unsigned i = 0; i < BUCKETS; ++i) {
+                seen += m_buckets[i];
+
+                if(seen >= rank)
+                    return std::min(upper_bound(i), m_max);
+            }
+
+            return m_max;
+        }
+
+
+        statistics::statistics()
+            : reads(0),
+              bytes_read(0),
+              events(0),
+              overflows(0),
+              batches(0),
+              slot_calls(0),
+              queue_limit(0)
+        {
+        }
+
+        void statistics::merge(const statistics& other)
+        {
+            reads += other.reads;
+            bytes_read += other.bytes_read;
+            events += other.events;
+            overflows += other.overflows;
+            batches += other.batches;
+            slot_calls += other.slot_calls;
+
+            read_size.merge(other.read_size);
+            events_per_read.merge(other.events_per_read);
+            events_per_wakeup.merge(other.events_per_wakeup);
+            slot_time.merge(other.slot_time);
+            batch_age.merge(other.batch_age);
+        }
+
+
+        void stats_collector::block::record_read(size_t bytes, size_t events,
+                                                 size_t overflows)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            ++m_data.reads;
+            m_data.bytes_read += bytes;
+            m_data.events += events;
+            m_data.overflows += overflows;
+            m_data.read_size.record(bytes);
+            m_data.events_per_read.record(events);
+        }
+
+        void stats_collector::block::record_wakeup(size_t events)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_data.events_per_wakeup.record(events);
+        }
+
+        void stats_collector::block::record_batch(uint64_t age)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            ++m_data.batches;
+            m_data.batch_age.record(age);
+        }
+
+        void stats_collector::block::record_slot(uint64_t time)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            ++m_data.slot_calls;
+            m_data.slot_time.record(time);
+        }
+
+
+        stats_collector::stats_collector()
+            : m_queue_limit(0)
+        {
+            {
+                boost::mutex::scoped_lock lock(id_mutex);
+                m_id = next_id++;
+            }
+
+            FILE* f = std::fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+
+            if(f) {
+                unsigned long limit;
+
+                if(std::fscanf(f, "%lu", &limit) == 1)
+                    m_queue_limit = limit;
+
+                std::fclose(f);
+            }
+        }
+
+        stats_collector::block& stats_collector::local()
+        {
+            std::vector<thread_entry>* entries = thread_blocks.get();
+
+            if(!entries) {
+                entries = new std::vector<thread_entry>;
+                thread_blocks.reset(entries);
+            }
+
+            for(size_t i = 0; i < entries->size(); ++i) {
+                if((*entries)[i].id == m_id)
+                    return *(*entries)[i].block;
+            }
+
+            // Forget the blocks of destroyed collectors.
+            for(size_t i = entries->size(); i-- > 0;) {
+                if((*entries)[i].owner.expired())
+                    entries->erase(entries->begin() + i);
+            }
+
+            boost::shared_ptr<block> owned(new block);
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_blocks.push_back(owned);
+            }
+
+            thread_entry e;
+            e.id = m_id;
+            e.block = owned.get();
+            e.owner = owned;
+            entries->push_back(e);
+
+            return *owned;
+        }
+
+        statistics stats_collector::snapshot() const
+        {
+            statistics result;
+            result.queue_limit = m_queue_limit;
+
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for(size_t i = 0; i < m_blocks.size(); ++i) {
+                boost::mutex::scoped_lock block_lock(m_blocks[i]->m_mutex);
+                result.merge(m_blocks[i]->m_data);
+            }
+
+            return result;
+        }
+
+        void stats_collector::reset()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for(size_t i = 0; i < m_blocks.size(); ++i) {
+                boost::mutex::scoped_lock block_lock(m_blocks[i]->m_mutex);
+                m_blocks[i]->m_data = statistics();
+            }
+        }
+
+        uint64_t stats_collector::now()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+        }
+    }
+}
@@ -0,0 +1,210 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_STATS_HPP
+#define DMCC_INOTIFY_STATS_HPP
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief A histogram with logarithmic buckets.
+
+           Values below 16 are counted exactly, larger ones in eight
+           buckets per power of two, so every value is known within
+           12.5%.
+        */
+        class histogram
+        {
+        public:
+            histogram();
+
+            void record(uint64_t value);
+            void merge(const histogram& other);
+
+            uint64_t count() const;
+            uint64_t min() const;
+            uint64_t max() const;
+            double mean() const;
+
+            /**
+               \brief Returns the upper bound of the bucket the value
+               at percentile p (0-100) fell into.
+            */
+            uint64_t percentile(double p) const;
+
+        private:
+            static const unsigned BUCKETS = 16 + 60 * 8;
+
+            static unsigned bucket(uint64_t value);
+            static uint64_t upper_bound(unsigned bucket);
+
+            uint64_t m_buckets[BUCKETS];
+            uint64_t m_count;
+            uint64_t m_min;
+            uint64_t m_max;
+            uint64_t m_sum;
+        };
+
+
+        /**
+           \brief Figures gathered while listening.
+
+           Times are in nanoseconds.
+        */
+        struct statistics
+        {
+            statistics();
+
+            void merge(const statistics& other);
+
+            // Successful reads of the inotify descriptor.
+            uint64_t reads;
+            uint64_t bytes_read;
+
+            // Events read from the kernel.
+            uint64_t events;
+            uint64_t overflows;
+
+            // Batches handed to the slots.
+            uint64_t batches;
+            uint64_t slot_calls;
+
+            // The kernel's limit of queued events, see
+            // /proc/sys/fs/inotify/max_queued_events.
+            uint64_t queue_limit;
+
+            histogram read_size;
+            histogram events_per_read;
+
+            // Events read after the descriptor became readable. Shows
+            // how full the kernel queue was, compared to queue_limit.
+            histogram events_per_wakeup;
+
+            histogram slot_time;
+
+            // From the read until the slots returned.
+            histogram batch_age;
+        };
+
+
+        /**
+           \brief Collects statistics in per-thread blocks.
+
+           Every thread records into its own block, so threads don't
+           contend with each other. snapshot() merges the blocks.
+        */
+        class stats_collector
+        {
+        public:
+            class block
+            {
+                friend class stats_collector;
+
+            public:
+                void record_read(size_t bytes, size_t events, size_t overflows);
+                void record_wakeup(size_t events);
+                void record_batch(uint64_t age);
+                void record_slot(uint64_t time);
+
+            private:
+                boost::mutex m_mutex;
+                statistics m_data;
+            };
+
+            stats_collector();
+
+            /**
+               \brief Returns the block of the calling thread.
+            */
+            block& local();
+
+            statistics snapshot() const;
+
+            void reset();
+
+            /**
+               \brief Monotonic time in nanoseconds.
+            */
+            static uint64_t now();
+
+        private:
+            // Identifies the blocks of this collector in the threads.
+            // Never reused, unlike the address.
+            uint64_t m_id;
+
+            mutable boost::mutex m_mutex;
+            std::vector<boost::shared_ptr<block> > m_blocks;
+            uint64_t m_queue_limit;
+        };
+
+
+        /**
+           \brief Signal combiner that returns the result of the last
+           slot, like the default one, and measures every slot call
+           while statistics are enabled.
+        */
+        class timed_last_value
+        {
+        public:
+            typedef bool result_type;
+
+            explicit timed_last_value(const boost::scoped_ptr<stats_collector>* stats = 0)
+                : m_stats(stats)
+            {
+            }
+
+            template<typename InputIterator>
+            bool operator()(InputIterator first, InputIterator last) const
+            {
+                bool result = false;
+                stats_collector* stats = m_stats ? m_stats->get() : 0;
+
+                if(!stats) {
+                    for(; first != last; ++first)
+                        result = *first;
+
+                    return result;
+                }
+
+                stats_collector::block& b = stats->local();
+
+                for(; first != last; ++first) {
+                    uint64_t start = stats_collector::now();
+                    result = *first;
+                    b.record_slot(stats_collector::now() - start);
+                }
+
+                return result;
+            }
+
+        private:
+            const boost::scoped_ptr<stats_collector>* m_stats;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_STATS_HPP
@@ -0,0 +1,198 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "tree_scanner.hpp"
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "exception/raise.hpp"
+
+namespace fs = boost::filesystem;
+
+
+namespace dmcc {
+    namespace inotify {
+        tree_scanner::visitor::~visitor()
+        {
+        }
+
+        bool tree_scanner::visitor::list(const fs::path&, int, entry_list_t&)
+        {
+            return false;
+        }
+
+        bool tree_scanner::visitor::entries(const fs::path&, int, const entry_list_t&)
+        {
+            return true;
+        }
+
+
+        tree_scanner::tree_scanner(unsigned threads)
+            : m_threads(threads),
+              m_pending(0),
+              m_failed(false)
+        {
+            if(m_threads == 0)
+                m_threads = boost::thread::hardware_concurrency();
+
+            if(m_threads == 0)
+                m_threads = 1;
+        }
+
+        void tree_scanner::run(const fs::path& root, visitor& v)
+        {
+            m_queue.clear();
+            m_queue.push_back(root);
+            m_pending = 1;
+            m_failed = false;
+
+            boost::thread_group group;
+
+            for(unsigned i = 1; i < m_threads; ++i)
+                group.create_thread(boost::bind(&tree_scanner::work, this, &v));
+
+            // The calling thread takes part in the scan.
+            work(&v);
+            group.join_all();
+
+            if(m_failed) {
+                if(m_error_code)
+                    DMCC_RAISE(dmcc::exception::system_error(m_error_code, m_error));
+                else
+                    DMCC_RAISE_CRITICAL(m_error);
+            }
+        }
+
+        void tree_scanner::list(const fs::path& dir, entry_list_t& out)
+        {
+            DIR* d = opendir(dir.string().c_str());
+
+            if(!d) {
+                // Vanished directories are no error, the kernel will
+                // report their removal anyway.
+                if(errno == ENOENT || errno == ENOTDIR)
+                    return;
+
+                DMCC_RAISE_LINUX_SYS_ERR("unable to list `" + dir.string() + "'");
+            }
+
+            while(struct dirent* ent = readdir(d)) {
+                const char* name = ent->d_name;
+
+                if(name[0] == '.' && (name[1] == '\0' ||
+                                      (name[1] == '.' && name[2] == '\0')))
+                    continue;
+
+                entry e;
+                e.name = name;
+
+                if(ent->d_type == DT_UNKNOWN) {
+                    // Some filesystems don't fill in the type.
+                    struct stat st;
+                    e.is_dir = lstat((dir / name).string().c_str(), &st) == 0 &&
+                        S_ISDIR(st.st_mode);
+                }
+                else
+                    e.is_dir = ent->d_type == DT_DIR;
+
+                out.push_back(e);
+            }
+
+            closedir(d);
+        }
+
+        void tree_scanner::work(visitor* v)
+        {
+            entry_list_t entries;
+
+            for(;;) {
+                fs::path dir;
+
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    while(m_queue.empty() && m_pending > 0)
+                        m_cond.wait(lock);
+
+                    if(m_queue.empty())
+                        // Nothing queued and nothing in progress -> done.
+                        return;
+
+                    dir.swap(m_queue.front());
+                    m_queue.pop_front();
+                }
+
+                std::vector<fs::path> subdirs;
+
+                try {
+                    entries.clear();
+
+                    int tag = v->enter(dir);
+
+                    if(tag >= 0) {
+                        if(!v->list(dir, tag, entries))
+                            list(dir, entries);
+
+                        if(v->entries(dir, tag, entries)) {
+                            for(entry_list_t::const_iterator it = entries.begin();
+                                it != entries.end(); ++it) {
+                                if(it->is_dir)
+                                    subdirs.push_back(dir / it->name);
+                            }
+                        }
+                    }
+                }
+                catch(const dmcc::exception::system_error& e) {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    if(!m_failed) {
+                        m_failed = true;
+                        m_error_code = e.code();
+                        m_error = e.what();
+                    }
+                }
+                catch(const std::exception& e) {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    if(!m_failed) {
+                        m_failed = true;
+                        m_error = e.what();
+                    }
+                }
+
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                // Stop descending once something went wrong.
+                if(!m_failed) {
+                    m_queue.insert(m_queue.end(), subdirs.begin(), subdirs.end());
+                    m_pending += subdirs.size();
+                }
+                else {
+                    m_pending -= m_queue.size();
+                    m_queue.clear();
+                }
+
+                --m_pending;
+                m_cond.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,133 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_TREE_SCANNER_HPP
+#define DMCC_INOTIFY_TREE_SCANNER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/system/error_code.hpp>
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Walks a directory tree with several threads.
+
+           Directories are handed to a visitor before and after they
+           are listed, so a watch can be installed before the listing
+           is taken. Everything created in between is then either
+           seen by the listing or reported by the kernel.
+        */
+        class tree_scanner
+        {
+        public:
+            /**
+               \brief An entry of a listed directory.
+            */
+            struct entry
+            {
+                std::string name;
+                bool is_dir;
+            };
+
+            typedef std::vector<entry> entry_list_t;
+
+            /**
+               \brief Receives the directories found by the scanner.
+
+               All methods are called concurrently from the scanner
+               threads.
+            */
+            class visitor
+            {
+            public:
+                virtual ~visitor();
+
+                /**
+                   \brief Called before a directory is listed.
+                   \return A tag that is passed on to entries(), or a
+                   negative value to skip the directory and its subtree.
+                */
+                virtual int enter(const boost::filesystem::path& dir) = 0;
+
+                /**
+                   \brief Lets the visitor provide the contents of a
+                   directory instead of reading it.
+                   \return true if out was filled.
+                */
+                virtual bool list(const boost::filesystem::path& dir, int tag,
+                                  entry_list_t& out);
+
+                /**
+                   \brief Called with the contents of a directory.
+                   \param tag The value enter() returned for dir.
+                   \return false to not descend into its subdirectories.
+                */
+                virtual bool entries(const boost::filesystem::path& dir, int tag,
+                                     const entry_list_t& entries);
+            };
+
+            /**
+               \param threads The number of threads to scan with.
+               0 selects the number of available cores.
+            */
+            explicit tree_scanner(unsigned threads = 0);
+
+            /**
+               \brief Scans the tree below (and including) root.
+
+               Blocks until the whole tree was visited. The first
+               exception thrown by the visitor is rethrown here.
+            */
+            void run(const boost::filesystem::path& root, visitor& v);
+
+            /**
+               \brief Lists a single directory.
+
+               Directories that vanished in the meantime are reported
+               as empty.
+            */
+            static void list(const boost::filesystem::path& dir, entry_list_t& out);
+
+        private:
+            void work(visitor* v);
+
+            unsigned m_threads;
+
+            boost::mutex m_mutex;
+            boost::condition_variable m_cond;
+            std::deque<boost::filesystem::path> m_queue;
+
+            // Number of directories queued or in progress.
+            size_t m_pending;
+
+            // First error raised by the visitor.
+            bool m_failed;
+            boost::system::error_code m_error_code;
+            std::string m_error;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_TREE_SCANNER_HPP
@@ -0,0 +1,290 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "watch_budget.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            bool name_less(const snapshot::listing_t::value_type& a,
+                           const snapshot::listing_t::value_type& b)
+            {
+                return a.first < b.first;
+            }
+
+            size_t default_limit()
+            {
+                std::ifstream in("/proc/sys/fs/inotify/max_user_watches");
+                size_t max = 0;
+
+                if(!(in >> max) || max == 0)
+                    max = 8192;
+
+                return max - max / 10;
+            }
+        }
+
+        const int watch_budget::POLLED_WD;
+
+        watch_budget::watch_budget(size_t limit, uint64_t interval)
+            : m_limit(limit ? limit : default_limit()),
+              m_interval(interval ? interval : 1),
+              m_next_wd(POLLED_WD)
+        {
+        }
+
+        size_t watch_budget::limit() const
+        {
+            return m_limit;
+        }
+
+        bool watch_budget::polled(int wd)
+        {
+            return wd >= POLLED_WD;
+        }
+
+        size_t watch_budget::polled_count() const
+        {
+            return m_dirs.size();
+        }
+
+        size_t watch_budget::retired_count() const
+        {
+            return m_retired.size();
+        }
+
+        bool watch_budget::full(size_t watches) const
+        {
+            return watches >= m_limit;
+        }
+
+        int watch_budget::add(const fs::path& dir, int evicted)
+        {
+            int wd = m_next_wd++;
+
+            polled_dir& d = m_dirs[wd];
+            d.path = dir;
+            d.mtime = 0;
+
+            read_dir(dir, d.mtime, snapshot::listing_t(), d.entries);
+
+            if(evicted != -1)
+                m_retired.insert(evicted);
+
+            // Polled right away, the listing above may already have
+            // missed changes made since the watch was removed. Queued
+            // in front, so the queue stays ordered by deadline.
+            m_queue.push_front(std::make_pair(static_cast<uint64_t>(0), wd));
+
+            return wd;
+        }
+
+        bool watch_budget::retired(int wd)
+        {
+            return m_retired.erase(wd) != 0;
+        }
+
+        bool watch_budget::retiring(int wd) const
+        {
+            return m_retired.count(wd) != 0;
+        }
+
+        void watch_budget::run(uint64_t now, std::vector<snapshot::change>& out,
+                               std::vector<int>& changed)
+        {
+            // Directories added while running are due next time.
+            size_t pending = m_queue.size();
+
+            while(pending-- && m_queue.front().first <= now) {
+                int wd = m_queue.front().second;
+                m_queue.pop_front();
+
+                boost::unordered_map<int, polled_dir>::iterator it = m_dirs.find(wd);
+
+                if(it == m_dirs.end())
+                    continue;
+
+                polled_dir& d = it->second;
+                snapshot::listing_t current;
+
+                if(!read_dir(d.path, d.mtime, d.entries, current)) {
+                    snapshot::change c;
+                    c.wd = wd;
+                    c.mask = IN_IGNORED;
+                    out.push_back(c);
+
+                    m_dirs.erase(it);
+                    continue;
+                }
+
+                size_t before = out.size();
+                diff(wd, d.entries, current, out);
+
+                if(out.size() != before)
+                    changed.push_back(wd);
+
+                d.entries.swap(current);
+                m_queue.push_back(std::make_pair(now + m_interval, wd));
+            }
+        }
+
+        void watch_budget::remove(int wd, int new_wd, std::vector<snapshot::change>& out,
+                                  snapshot* snap)
+        {
+            boost::unordered_map<int, polled_dir>::iterator it = m_dirs.find(wd);
+
+            if(it == m_dirs.end())
+                return;
+
+            polled_dir& d = it->second;
+            snapshot::listing_t current;
+
+            if(read_dir(d.path, d.mtime, d.entries, current)) {
+                diff(new_wd, d.entries, current, out);
+
+                if(snap)
+                    snap->assign(new_wd, d.mtime, current);
+            }
+
+            // The queue entry is skipped once it comes up.
+            m_dirs.erase(it);
+        }
+
+        uint64_t watch_budget::deadline() const
+        {
+            return m_queue.empty() ? 0 : std::max<uint64_t>(m_queue.front().first, 1);
+        }
+
+        bool watch_budget::read_dir(const fs::path& dir, int64_t& mtime,
+                                    const snapshot::listing_t& previous,
+                                    snapshot::listing_t& out)
+        {
+            int dirfd = open(dir.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if(dirfd == -1)
+                return false;
+
+            snapshot::info self;
+
+            if(!snapshot::stat_entry(dirfd, ".", self)) {
+                close(dirfd);
+                return false;
+            }
+
+            if(self.mtime == mtime && !previous.empty()) {
+                // No entry was added or removed, only the entries
+                // themselves need a look.
+                out.reserve(previous.size());
+
+                for(snapshot::listing_t::const_iterator it = previous.begin();
+                    it != previous.end(); ++it) {
+                    snapshot::info i;
+
+                    if(snapshot::stat_entry(dirfd, it->first.c_str(), i))
+                        out.push_back(std::make_pair(it->first, i));
+                }
+
+                close(dirfd);
+                return true;
+            }
+
+            mtime = self.mtime;
+
+            // fdopendir takes ownership, keep our own descriptor for
+            // the fstatat calls.
+            DIR* listing = fdopendir(dup(dirfd));
+
+            if(listing) {
+                while(struct dirent* ent = readdir(listing)) {
+                    const char* name = ent->d_name;
+
+                    if(name[0] == '.' && (name[1] == '\0' ||
+                                          (name[1] == '.' && name[2] == '\0')))
+                        continue;
+
+                    snapshot::info i;
+
+                    if(snapshot::stat_entry(dirfd, name, i))
+                        out.push_back(std::make_pair(std::string(name), i));
+                }
+
+                closedir(listing);
+            }
+
+            close(dirfd);
+
+            std::sort(out.begin(), out.end(), name_less);
+            return true;
+        }
+
+        void watch_budget::diff(int wd, const snapshot::listing_t& before,
+                                const snapshot::listing_t& after,
+                                std::vector<snapshot::change>& out)
+        {
+            snapshot::listing_t::const_iterator b = before.begin();
+            snapshot::listing_t::const_iterator a = after.begin();
+
+            snapshot::change c;
+            c.wd = wd;
+
+            while(b != before.end() || a != after.end()) {
+                if(a == after.end() || (b != before.end() && b->first < a->first)) {
+                    c.mask = IN_DELETE | (b->second.is_dir ? IN_ISDIR : 0);
+                    c.name = b->first;
+                    out.push_back(c);
+                    ++b;
+                }
+                else if(b == before.end() || a->first < b->first) {
+                    c.mask = IN_CREATE | (a->second.is_dir ? IN_ISDIR : 0);
+                    c.name = a->first;
+                    out.push_back(c);
+                    ++a;
+                }
+                else {
+                    c.name = a->first;
+
+                    // Replaced entries are reported as deleted and
+                    // created.
+                    if(a->second.ino != b->second.ino || a->second.is_dir != b->second.is_dir) {
+                        c.mask = IN_DELETE | (b->second.is_dir ? IN_ISDIR : 0);
+                        out.push_back(c);
+                        c.mask = IN_CREATE | (a->second.is_dir ? IN_ISDIR : 0);
+                        out.push_back(c);
+                    }
+                    else if(a->second != b->second && !a->second.is_dir) {
+                        c.mask = IN_MODIFY;
+                        out.push_back(c);
+                    }
+
+                    ++a;
+                    ++b;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,146 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_WATCH_BUDGET_HPP
+#define DMCC_INOTIFY_WATCH_BUDGET_HPP
+
+#include <deque>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "snapshot.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+
+        /**
+           \brief Keeps the number of kernel watches below a limit by
+           polling directories instead.
+
+           Directories that lost their watch are listed every interval
+           and the differences are reported as IN_CREATE, IN_DELETE
+           and IN_MODIFY events, or as IN_IGNORED once the directory is
+           gone. Polled directories get descriptors of their own,
+           starting at POLLED_WD, so their events pass through the
+           owner like any other.
+
+           Not thread-safe, the owner serializes the calls.
+        */
+        class watch_budget
+        {
+        public:
+            // Far above the descriptors the kernel hands out.
+            static const int POLLED_WD = 0x40000000;
+
+            /**
+               \param limit The number of kernel watches to use at
+               most. 0 selects 90% of the per-user limit.
+               \param interval Milliseconds between two polls of a
+               directory.
+            */
+            watch_budget(size_t limit, uint64_t interval);
+
+            size_t limit() const;
+
+            static bool polled(int wd);
+
+            size_t polled_count() const;
+
+            // Evicted watches whose IN_IGNORED is still to come.
+            size_t retired_count() const;
+
+            /**
+               \brief Tells if no further watch may be added.
+            */
+            bool full(size_t watches) const;
+
+            /**
+               \brief Starts polling a directory.
+               \param evicted The watch the directory had, or -1.
+               \return The descriptor of the polled directory.
+            */
+            int add(const boost::filesystem::path& dir, int evicted);
+
+            /**
+               \brief Returns true once for the IN_IGNORED event of an
+               evicted watch.
+            */
+            bool retired(int wd);
+
+            bool retiring(int wd) const;
+
+            /**
+               \brief Polls the directories that are due.
+               \param changed Receives the directories that changed.
+            */
+            void run(uint64_t now, std::vector<snapshot::change>& out,
+                     std::vector<int>& changed);
+
+            /**
+               \brief Stops polling a directory that has a watch again.
+
+               The changes since the last poll are reported for the
+               new descriptor.
+               \param snap Receives the listing for the new descriptor
+               if not null.
+            */
+            void remove(int wd, int new_wd, std::vector<snapshot::change>& out,
+                        snapshot* snap);
+
+            /**
+               \brief Returns when the next directory is due, or 0 if
+               nothing is polled.
+            */
+            uint64_t deadline() const;
+
+        private:
+            struct polled_dir
+            {
+                boost::filesystem::path path;
+                int64_t mtime;
+                snapshot::listing_t entries;
+            };
+
+            // Lists dir with the metadata of its entries, reusing the
+            // names of previous if the directory didn't change.
+            static bool read_dir(const boost::filesystem::path& dir, int64_t& mtime,
+                                 const snapshot::listing_t& previous,
+                                 snapshot::listing_t& out);
+
+            static void diff(int wd, const snapshot::listing_t& before,
+                             const snapshot::listing_t& after,
+                             std::vector<snapshot::change>& out);
+
+            size_t m_limit;
+            uint64_t m_interval;
+            int m_next_wd;
+
+            boost::unordered_map<int, polled_dir> m_dirs;
+
+            // Due times in the order they were set.
+            std::deque<std::pair<uint64_t, int> > m_queue;
+
+            boost::unordered_set<int> m_retired;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_WATCH_BUDGET_HPP
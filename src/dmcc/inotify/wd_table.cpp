@@ -0,0 +1,148 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "wd_table.hpp"
+
+
+namespace dmcc {
+    namespace inotify {
+        namespace {
+            const size_t INITIAL_CAPACITY = 64;
+        }
+
+        wd_table::wd_table()
+            : m_mask(0),
+              m_size(0)
+        {
+        }
+
+        boost::shared_ptr<watch> wd_table::insert(int wd, const boost::shared_ptr<watch>& w)
+        {
+            // Keep the load factor below one half.
+            if((m_size + 1) * 2 > m_slots.size())
+                grow();
+
+            size_t i = probe(wd);
+
+            if(m_slots[i].wd == EMPTY)
+                ++m_size;
+
+            m_slots[i].wd = wd;
+            m_slots[i].ptr = w.get();
+
+            boost::shared_ptr<watch> replaced = w;
+            m_owners[i].swap(replaced);
+
+            return replaced;
+        }
+
+        boost::shared_ptr<watch> wd_table::get(int wd) const
+        {
+            if(m_size == 0)
+                return boost::shared_ptr<watch>();
+
+            size_t i = probe(wd);
+
+            return m_owners[i];
+        }
+
+        void wd_table::erase(int wd)
+        {
+            if(m_size == 0)
+                return;
+
+            size_t i = probe(wd);
+
+            if(m_slots[i].wd == EMPTY)
+                return;
+
+            // Shift following entries of the cluster back, so no
+            // tombstones are needed.
+            size_t j = i;
+
+            for(;;) {
+                j = (j + 1) & m_mask;
+
+                if(m_slots[j].wd == EMPTY)
+                    break;
+
+                size_t home = hash(m_slots[j].wd) & m_mask;
+
+                // Move j into the hole if its home isn't cyclically
+                // within (i, j].
+                if((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+                    m_slots[i] = m_slots[j];
+                    m_owners[i].swap(m_owners[j]);
+                    i = j;
+                }
+            }
+
+            m_slots[i].wd = EMPTY;
+            m_slots[i].ptr = 0;
+            m_owners[i].reset();
+            --m_size;
+        }
+
+        size_t wd_table::size() const
+        {
+            return m_size;
+        }
+
+        void wd_table::entries(std::vector<std::pair<int, watch*> >& out) const
+        {
+            for(size_t i = 0; i < m_slots.size(); ++i) {
+                if(m_slots[i].wd != EMPTY)
+                    out.push_back(std::make_pair(m_slots[i].wd, m_slots[i].ptr));
+            }
+        }
+
+        size_t wd_table::probe(int wd) const
+        {
+            size_t i = hash(wd) & m_mask;
+
+            while(m_slots[i].wd != wd && m_slots[i].wd != EMPTY)
+                i = (i + 1) & m_mask;
+
+            return i;
+        }
+
+        void wd_table::grow()
+        {
+            size_t capacity = m_slots.empty() ? INITIAL_CAPACITY : m_slots.size() * 2;
+
+            slot empty;
+            empty.wd = EMPTY;
+            empty.ptr = 0;
+
+            std::vector<slot> slots(capacity, empty);
+            std::vector<boost::shared_ptr<watch> > owners(capacity);
+
+            slots.swap(m_slots);
+            owners.swap(m_owners);
+            m_mask = capacity - 1;
+
+            for(size_t i = 0; i < slots.size(); ++i) {
+                if(slots[i].wd == EMPTY)
+                    continue;
+
+                size_t j = probe(slots[i].wd);
+                m_slots[j] = slots[i];
+                m_owners[j].swap(owners[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,119 @@
+/* This program listens on a directory for changes and applies them
+ * to another location, too.
+ * Copyright (C) 2010  Dominik Burgdörfer <dominik.burgdoerfer@googlemail.com>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DMCC_INOTIFY_WD_TABLE_HPP
+#define DMCC_INOTIFY_WD_TABLE_HPP
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+#include <boost/shared_ptr.hpp>
+
+
+namespace dmcc {
+    namespace inotify {
+        class watch;
+
+        /**
+           \brief Maps watch-descriptors to their watches.
+
+           An open-addressing hash table with linear probing. The
+           probed slots only hold the descriptor and a raw pointer, so
+           a lookup touches one or two cache lines and never copies a
+           shared pointer. The owning pointers are kept in a parallel
+           array that is only used when watches are added or removed.
+        */
+        class wd_table
+        {
+        public:
+            wd_table();
+
+            /**
+               \brief Stores a watch, replacing the one stored for wd.
+               \return The replaced watch or a null pointer.
+            */
+            boost::shared_ptr<watch> insert(int wd, const boost::shared_ptr<watch>& w);
+
+            /**
+               \brief Looks a watch up.
+               \return The watch or 0 if wd is unknown.
+            */
+            watch* find(int wd) const
+            {
+                if(m_size == 0)
+                    return 0;
+
+                for(size_t i = hash(wd) & m_mask;; i = (i + 1) & m_mask) {
+                    const slot& s = m_slots[i];
+
+                    if(s.wd == wd)
+                        return s.ptr;
+
+                    if(s.wd == EMPTY)
+                        return 0;
+                }
+            }
+
+            /**
+               \brief Returns the owning pointer for wd, if any.
+            */
+            boost::shared_ptr<watch> get(int wd) const;
+
+            /**
+               \brief Removes the watch stored for wd.
+            */
+            void erase(int wd);
+
+            size_t size() const;
+
+            /**
+               \brief Appends all stored descriptors and watches to out.
+            */
+            void entries(std::vector<std::pair<int, watch*> >& out) const;
+
+        private:
+            static const int EMPTY = -1;
+
+            struct slot
+            {
+                int wd;
+                watch* ptr;
+            };
+
+            static size_t hash(int wd)
+            {
+                // Descriptors are handed out sequentially. Multiplying
+                // by an odd constant keeps consecutive descriptors in
+                // distinct slots and spreads them over the table.
+                return static_cast<size_t>(static_cast<unsigned int>(wd)) * 2654435769u;
+            }
+
+            // Returns the slot of wd or the empty slot it belongs into.
+            size_t probe(int wd) const;
+
+            void grow();
+
+            std::vector<slot> m_slots;
+            std::vector<boost::shared_ptr<watch> > m_owners;
+            size_t m_mask;
+            size_t m_size;
+        };
+    }
+}
+
+#endif  // DMCC_INOTIFY_WD_TABLE_HPP
@@ -0,0 +1,103 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "command_index.hpp"
+
+#include <algorithm>
+
+
+namespace dmcc {
+    namespace readline {
+
+        namespace {
+
+            // Orders a name against a prefix by the first characters
+            // of the name only, so all names starting with the prefix
+            // compare equal to it.
+            struct prefix_less
+            {
+                prefix_less(const char* prefix, size_t length)
+                    : m_prefix(prefix), m_length(length)
+                    {
+                    }
+
+                bool operator()(const std::string& name, const char*) const
+                    {
+                        return name.compare(0, m_length, m_prefix, m_length) < 0;
+                    }
+
+                bool operator()(const char*, const std::string& name) const
+                    {
+                        return name.compare(0, m_length, m_prefix, m_length) > 0;
+                    }
+
+                const char* m_prefix;
+                size_t m_length;
+            };
+        }
+
+
+        command_index::command_index()
+            : m_sorted(true)
+        {
+        }
+
+        void command_index::insert(const std::string& name)
+        {
+            m_names.push_back(name);
+            m_sorted = false;
+        }
+
+        command_index::range_t command_index::prefix(const char* prefix,
+                                                     size_t length) const
+        {
+            sort();
+
+            const std::vector<std::string>& names = m_names;
+
+            if(length == 0)
+                return range_t(names.begin(), names.end());
+
+            prefix_less less(prefix, length);
+
+            const_iterator first = std::lower_bound(
+                names.begin(), names.end(), prefix, less);
+
+            return range_t(first, std::upper_bound(
+                               first, names.end(), prefix, less));
+        }
+
+        size_t command_index::size() const
+        {
+            sort();
+
+            return m_names.size();
+        }
+
+        void command_index::sort() const
+        {
+            if(m_sorted)
+                return;
+
+            std::sort(m_names.begin(), m_names.end());
+            m_names.erase(std::unique(m_names.begin(), m_names.end()),
+                          m_names.end());
+            m_sorted = true;
+        }
+    }
+}
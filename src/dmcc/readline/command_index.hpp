@@ -0,0 +1,70 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DMCC_READLINE_COMMAND_INDEX_HPP
+#define DMCC_READLINE_COMMAND_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace dmcc {
+    namespace readline {
+        /**
+           @brief Sorted table of command names that answers prefix
+           queries for the completion. Is used for directory entries,
+           too (see dir_cache).
+
+           Names are appended and the table is sorted on the next
+           query, so registering thousands of commands or reading a
+           large directory doesn't move the table around for each
+           name. A query is two binary
+           searches that only compare the first characters of each
+           name, the matches are the range between them.
+        */
+        class command_index
+        {
+        public:
+            typedef std::vector<std::string>::const_iterator const_iterator;
+            typedef std::pair<const_iterator, const_iterator> range_t;
+
+            command_index();
+
+            /**
+               @brief Adds a name; adding it again has no effect.
+             */
+            void insert(const std::string& name);
+
+            /**
+               @brief Returns the names starting with the first
+               length characters of prefix, in sorted order.
+             */
+            range_t prefix(const char* prefix, size_t length) const;
+
+            size_t size() const;
+
+        private:
+            void sort() const;
+
+            mutable std::vector<std::string> m_names;
+            mutable bool m_sorted;
+        };
+    }
+}
+
+#endif  // DMCC_READLINE_COMMAND_INDEX_HPP
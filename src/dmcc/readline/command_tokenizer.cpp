@@ -0,0 +1,115 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "command_tokenizer.hpp"
+
+#include <cstring>
+
+#include <boost/token_functions.hpp>
+
+
+namespace dmcc {
+    namespace readline {
+
+        namespace {
+
+            inline bool is_quote(char c)
+            {
+                return c == '"' || c == '\'';
+            }
+
+            // Characters that end the plain part of a word.
+            inline bool is_special(char c)
+            {
+                return c == ' ' || c == '\\' || is_quote(c);
+            }
+        }
+
+
+        const command_tokenizer::tokens_t& command_tokenizer::operator()(
+            const char* begin, const char* end)
+        {
+            m_tokens.clear();
+
+            // Unescaped words are never longer than the line, so the
+            // buffer doesn't move while views into it are handed out.
+            size_t length = end - begin;
+
+            if(m_buffer.size() < length)
+                m_buffer.resize(length);
+
+            char* out = length ? &m_buffer[0] : 0;
+            const char* p = begin;
+
+            while(p != end) {
+                if(*p == ' ') {
+                    ++p;
+                    continue;
+                }
+
+                const char* word = p;
+
+                while(p != end && !is_special(*p))
+                    ++p;
+
+                if(p == end || *p == ' ') {
+                    // Plain word, hand out a view into the line.
+                    m_tokens.push_back(token_t(word, p - word));
+                    continue;
+                }
+
+                // The word has quotes or escapes: unescape it into
+                // the buffer, starting with the plain part.
+                char* copy = out;
+                bool in_quote = false;
+
+                memcpy(out, word, p - word);
+                out += p - word;
+
+                for(; p != end && (in_quote || *p != ' '); ++p) {
+                    if(*p == '\\') {
+                        if(++p == end)
+                            throw boost::escaped_list_error("cannot end with escape");
+
+                        if(*p == 'n')
+                            *out++ = '\n';
+                        else if(is_special(*p))
+                            *out++ = *p;
+                        else
+                            throw boost::escaped_list_error("unknown escape sequence");
+                    }
+                    else if(is_quote(*p))
+                        in_quote = !in_quote;
+                    else
+                        *out++ = *p;
+                }
+
+                // "" and '' are empty words, which are dropped.
+                if(out != copy)
+                    m_tokens.push_back(token_t(copy, out - copy));
+            }
+
+            return m_tokens;
+        }
+
+        const command_tokenizer::tokens_t& command_tokenizer::tokens() const
+        {
+            return m_tokens;
+        }
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DMCC_READLINE_COMMAND_TOKENIZER_HPP
+#define DMCC_READLINE_COMMAND_TOKENIZER_HPP
+
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace dmcc {
+    namespace readline {
+        /**
+           @brief Splits command lines into words the way
+           boost::escaped_list_separator<char>("\\", " ", "\"'") does,
+           without copying them.
+
+           Words are separated by spaces, quotes group words and are
+           removed, and a backslash escapes a space, a quote or
+           itself, "\n" becomes a newline. Empty words are dropped.
+
+           A word without quotes and escapes is handed out as a view
+           into the line. The others are unescaped into a buffer that
+           is kept between the lines, so once it has grown to the
+           longest line, splitting doesn't allocate at all. The views
+           are valid until the next line is split.
+        */
+        class command_tokenizer
+        {
+        public:
+            typedef boost::string_ref token_t;
+            typedef std::vector<token_t> tokens_t;
+
+            /**
+               @brief Splits the line [begin, end).
+
+               Throws boost::escaped_list_error if the line ends with
+               a backslash or a backslash is followed by any other
+               character than listed above.
+            */
+            const tokens_t& operator()(const char* begin, const char* end);
+
+            const tokens_t& tokens() const;
+
+        private:
+            std::vector<char> m_buffer;
+            tokens_t m_tokens;
+        };
+    }
+}
+
+#endif  // DMCC_READLINE_COMMAND_TOKENIZER_HPP
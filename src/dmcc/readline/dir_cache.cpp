@@ -0,0 +1,141 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dir_cache.hpp"
+
+#include <ctime>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+namespace dmcc {
+    namespace readline {
+
+        namespace {
+
+            // Size of the buffer for getdents64(2).
+            const size_t DENTS_BUFFER_SIZE = 1 << 20;
+
+            // The record of getdents64(2).
+            struct dirent64_t
+            {
+                uint64_t d_ino;
+                int64_t d_off;
+                unsigned short d_reclen;
+                unsigned char d_type;
+                char d_name[1];
+            };
+        }
+
+
+        dir_cache::dir_cache(size_t dirs)
+            : m_capacity(dirs ? dirs : 1)
+        {
+        }
+
+        command_index::range_t dir_cache::lookup(const std::string& dir,
+                                                 const char* prefix, size_t length)
+        {
+            std::list<listing>::iterator it = m_dirs.begin();
+
+            while(it != m_dirs.end() && it->dir != dir)
+                ++it;
+
+            struct stat st;
+
+            if(stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+                if(it != m_dirs.end())
+                    m_dirs.erase(it);
+
+                return m_none.prefix(prefix, length);
+            }
+
+            if(it != m_dirs.end()) {
+                // Most recently used first.
+                m_dirs.splice(m_dirs.begin(), m_dirs, it);
+
+                if(!it->racy && it->dev == st.st_dev && it->ino == st.st_ino &&
+                   it->mtime.tv_sec == st.st_mtim.tv_sec &&
+                   it->mtime.tv_nsec == st.st_mtim.tv_nsec)
+                    return it->names.prefix(prefix, length);
+            }
+            else {
+                if(m_dirs.size() >= m_capacity)
+                    m_dirs.pop_back();
+
+                m_dirs.push_front(listing());
+                m_dirs.front().dir = dir;
+            }
+
+            listing& l = m_dirs.front();
+            time_t started = time(0);
+
+            int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            l.names = command_index();
+
+            if(fd == -1 || fstat(fd, &st) == -1 || !read(fd, l.names)) {
+                if(fd != -1)
+                    close(fd);
+
+                m_dirs.pop_front();
+                return m_none.prefix(prefix, length);
+            }
+
+            close(fd);
+
+            l.dev = st.st_dev;
+            l.ino = st.st_ino;
+            l.mtime = st.st_mtim;
+            l.racy = st.st_mtim.tv_sec >= started;
+
+            return l.names.prefix(prefix, length);
+        }
+
+        void dir_cache::clear()
+        {
+            m_dirs.clear();
+        }
+
+        bool dir_cache::read(int fd, command_index& names)
+        {
+            std::vector<char> buffer(DENTS_BUFFER_SIZE);
+
+            for(;;) {
+                long n = syscall(SYS_getdents64, fd, &buffer[0], buffer.size());
+
+                if(n == -1)
+                    return false;
+
+                if(n == 0)
+                    return true;
+
+                for(long pos = 0; pos < n;) {
+                    const dirent64_t* d = reinterpret_cast<const dirent64_t*>(&buffer[pos]);
+
+                    names.insert(d->d_name);
+                    pos += d->d_reclen;
+                }
+            }
+        }
+    }
+}
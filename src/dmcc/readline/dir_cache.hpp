@@ -0,0 +1,89 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DMCC_READLINE_DIR_CACHE_HPP
+#define DMCC_READLINE_DIR_CACHE_HPP
+
+#include <list>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "command_index.hpp"
+
+namespace dmcc {
+    namespace readline {
+        /**
+           @brief Sorted listings of the directories that file names
+           were completed in.
+
+           A directory is read with large getdents64(2) batches when
+           it is first looked up, after that it only costs a stat(2)
+           per lookup until its mtime changes. A listing taken in the
+           same second as the last change of the directory is read
+           again on the next lookup, because a change right after the
+           listing may not have moved the mtime.
+
+           The least recently used listings are dropped to keep at
+           most the given number of directories.
+        */
+        class dir_cache
+        {
+        public:
+            explicit dir_cache(size_t dirs = 8);
+
+            /**
+               @brief Returns the entries of dir starting with the
+               first length characters of prefix, including "." and
+               "..".
+
+               The range is valid until the next lookup. It is empty
+               if dir can't be read.
+            */
+            command_index::range_t lookup(const std::string& dir,
+                                          const char* prefix, size_t length);
+
+            void clear();
+
+        private:
+            struct listing
+            {
+                std::string dir;
+                dev_t dev;
+                ino_t ino;
+                struct timespec mtime;
+
+                // Must be read again, see above.
+                bool racy;
+
+                command_index names;
+            };
+
+            // Reads the entries of an open directory.
+            static bool read(int fd, command_index& names);
+
+            std::list<listing> m_dirs;
+            size_t m_capacity;
+
+            // Is looked up for directories that can't be read.
+            command_index m_none;
+        };
+    }
+}
+
+#endif  // DMCC_READLINE_DIR_CACHE_HPP
@@ -0,0 +1,368 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job_pool.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "exception/raise.hpp"
+
+namespace pt = boost::posix_time;
+
+
+namespace dmcc {
+    namespace readline {
+
+        namespace {
+
+            // Collects the output of a job and hands over whole lines,
+            // so lines of concurrent jobs don't get mixed.
+            class output_buf : public std::stringbuf
+            {
+            public:
+                typedef boost::function<void (const std::string&)> sink_t;
+
+                explicit output_buf(const sink_t& sink)
+                    : std::stringbuf(std::ios_base::out | std::ios_base::ate),
+                      m_sink(sink)
+                    {
+                    }
+
+                // Hands over everything, ending the last line.
+                void close()
+                    {
+                        sync();
+
+                        if(!str().empty()) {
+                            m_sink(str() + '\n');
+                            str(std::string());
+                        }
+                    }
+
+            protected:
+                int sync()
+                    {
+                        std::string text = str();
+                        size_t end = text.rfind('\n');
+
+                        if(end != std::string::npos) {
+                            m_sink(text.substr(0, end + 1));
+                            str(text.substr(end + 1));
+                        }
+
+                        return 0;
+                    }
+
+            private:
+                sink_t m_sink;
+            };
+
+
+            void no_cleanup(std::ostream*)
+            {
+            }
+
+            // The output stream of the job running in this thread.
+            boost::thread_specific_ptr<std::ostream> current_out(no_cleanup);
+
+
+            bool by_id(const job_pool::job_info& a, const job_pool::job_info& b)
+            {
+                return a.id < b.id;
+            }
+        }
+
+
+        struct job_pool::job
+        {
+            job(unsigned id, const std::string& line, const void* key,
+                const job_func_t& func, const output_buf::sink_t& sink)
+                : id(id), line(line), key(key), func(func),
+                  cancelled(false), since(pt::microsec_clock::universal_time()),
+                  buf(sink), out(&buf)
+                {
+                }
+
+            unsigned id;
+            std::string line;
+            const void* key;
+            job_func_t func;
+
+            bool cancelled;
+            pt::ptime since;
+
+            output_buf buf;
+            std::ostream out;
+        };
+
+
+        job_pool::job_pool(unsigned threads)
+            : m_next_id(1),
+              m_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+              m_running(threads),
+              m_exit(false),
+              m_shutdown(false)
+        {
+            if(m_fd == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to create eventfd");
+
+            // The workers wait for the lock until m_workers is complete.
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for(unsigned i = 0; i < threads; ++i)
+                m_workers.push_back(
+                    m_threads.create_thread(boost::bind(&job_pool::work, this, i)));
+        }
+
+        job_pool::~job_pool()
+        {
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                m_shutdown = true;
+                m_queue.clear();
+
+                for(size_t i = 0; i < m_running.size(); ++i)
+                    if(m_running[i])
+                        m_workers[i]->interrupt();
+
+                m_cond.notify_all();
+            }
+
+            m_threads.join_all();
+            close(m_fd);
+        }
+
+        unsigned job_pool::submit(const std::string& line, const void* key,
+                                  const job_func_t& func)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            unsigned id = m_next_id++;
+            m_queue.push_back(boost::shared_ptr<job>(
+                                  new job(id, line, key, func,
+                                          boost::bind(&job_pool::post, this, _1))));
+            m_cond.notify_all();
+
+            return id;
+        }
+
+        bool job_pool::cancel(unsigned id)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for(std::deque<boost::shared_ptr<job> >::iterator it = m_queue.begin();
+                it != m_queue.end(); ++it) {
+                if((*it)->id == id) {
+                    std::ostringstream msg;
+                    msg << "[" << id << "] cancelled  " << (*it)->line << "\n";
+
+                    m_queue.erase(it);
+                    post_locked(msg.str());
+
+                    return true;
+                }
+            }
+
+            for(size_t i = 0; i < m_running.size(); ++i) {
+                if(m_running[i] && m_running[i]->id == id) {
+                    m_running[i]->cancelled = true;
+                    m_workers[i]->interrupt();
+
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        std::vector<job_pool::job_info> job_pool::jobs() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            pt::ptime now = pt::microsec_clock::universal_time();
+            std::vector<job_info> ret;
+
+            for(size_t i = 0; i < m_running.size() + m_queue.size(); ++i) {
+                const job* j = i < m_running.size() ? m_running[i].get()
+                    : m_queue[i - m_running.size()].get();
+
+                if(!j)
+                    continue;
+
+                job_info info;
+                info.id = j->id;
+                info.line = j->line;
+                info.running = i < m_running.size();
+                info.cancelled = j->cancelled;
+                info.age = now - j->since;
+
+                ret.push_back(info);
+            }
+
+            std::sort(ret.begin(), ret.end(), by_id);
+
+            return ret;
+        }
+
+        int job_pool::fd() const
+        {
+            return m_fd;
+        }
+
+        std::string job_pool::collect(bool& exit)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            uint64_t count;
+
+            if(::read(m_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to read eventfd");
+
+            std::string ret;
+            ret.swap(m_output);
+
+            exit = m_exit;
+            m_exit = false;
+
+            return ret;
+        }
+
+        std::ostream& job_pool::out()
+        {
+            std::ostream* os = current_out.get();
+
+            return os ? *os : std::cout;
+        }
+
+        void job_pool::work(unsigned worker)
+        {
+            for(;;) {
+                boost::shared_ptr<job> j;
+
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    std::deque<boost::shared_ptr<job> >::iterator it;
+
+                    while(!m_shutdown && (it = runnable()) == m_queue.end())
+                        m_cond.wait(lock);
+
+                    if(m_shutdown)
+                        return;
+
+                    j = *it;
+                    m_queue.erase(it);
+
+                    j->since = pt::microsec_clock::universal_time();
+                    m_busy.insert(j->key);
+                    m_running[worker] = j;
+                }
+
+                const char* state = "done";
+                std::string error;
+                bool exit = false;
+
+                current_out.reset(&j->out);
+
+                try {
+                    exit = j->func();
+                }
+                catch(const boost::thread_interrupted&) {
+                    state = "cancelled";
+                }
+                catch(const std::exception& e) {
+                    state = "failed";
+                    error = e.what();
+                }
+                catch(...) {
+                    state = "failed";
+                    error = "unknown error";
+                }
+
+                current_out.release();
+                j->buf.close();
+
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    std::ostringstream msg;
+                    msg << "[" << j->id << "] " << state << "  " << j->line;
+
+                    if(!error.empty())
+                        msg << ": " << error;
+
+                    msg << "\n";
+
+                    m_running[worker].reset();
+                    m_busy.erase(j->key);
+                    m_exit = m_exit || exit;
+
+                    post_locked(msg.str());
+                    m_cond.notify_all();
+                }
+
+                // cancel() only interrupts while the job is in
+                // m_running, so a request that came in just before it
+                // ended is still pending. Drop it.
+                try {
+                    boost::this_thread::interruption_point();
+                }
+                catch(const boost::thread_interrupted&) {
+                }
+            }
+        }
+
+        void job_pool::post(const std::string& text)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            post_locked(text);
+        }
+
+        void job_pool::post_locked(const std::string& text)
+        {
+            m_output += text;
+
+            uint64_t one = 1;
+
+            if(::write(m_fd, &one, sizeof(one)) == -1)
+                // Can't happen before 2^64 - 1 posts.
+                DMCC_RAISE_LINUX_SYS_ERR("unable to signal eventfd");
+        }
+
+        std::deque<boost::shared_ptr<job_pool::job> >::iterator job_pool::runnable()
+        {
+            std::deque<boost::shared_ptr<job> >::iterator it = m_queue.begin();
+
+            while(it != m_queue.end() && m_busy.count((*it)->key))
+                ++it;
+
+            return it;
+        }
+    }
+}
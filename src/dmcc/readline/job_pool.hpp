@@ -0,0 +1,156 @@
+/*
+ * This file is part of obexftpc.
+ *
+ * Obexftpc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Obexftpc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obexftpc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DMCC_READLINE_JOB_POOL_HPP
+#define DMCC_READLINE_JOB_POOL_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <ostream>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace dmcc {
+    namespace readline {
+        /**
+           @brief Runs commands on a pool of worker threads and
+           collects what they print.
+
+           Jobs with the same key, i.e. of the same command, run one
+           after another, because Boost.Signals may not be emitted
+           concurrently. Output written to out() by a job and the
+           outcome of finished jobs are gathered for the interactive
+           thread, which is woken through fd().
+
+           Cancelling a running job interrupts its thread, so the job
+           ends at its next interruption point (see
+           boost::this_thread::interruption_point()); queued jobs are
+           dropped right away.
+        */
+        class job_pool
+        {
+        public:
+            // Returns true to end the interactive loop.
+            typedef boost::function<bool ()> job_func_t;
+
+            /**
+               @brief A job as listed by jobs().
+            */
+            struct job_info
+            {
+                unsigned id;
+                std::string line;
+                bool running;
+                bool cancelled;
+
+                // Since the job was started, or queued if it isn't
+                // running yet.
+                boost::posix_time::time_duration age;
+            };
+
+            explicit job_pool(unsigned threads);
+
+            /**
+               @brief Drops the queued jobs, cancels the running ones
+               and waits for them.
+            */
+            ~job_pool();
+
+            /**
+               @brief Queues a job and returns its id.
+               @param line The command line, for listings and messages.
+               @param key Jobs with the same key don't run concurrently.
+            */
+            unsigned submit(const std::string& line, const void* key,
+                            const job_func_t& func);
+
+            /**
+               @brief Cancels a queued or running job.
+               @return false if there is no such job.
+            */
+            bool cancel(unsigned id);
+
+            std::vector<job_info> jobs() const;
+
+            /**
+               @brief Is readable while collect() has something to
+               return.
+            */
+            int fd() const;
+
+            /**
+               @brief Takes the output of the jobs and the messages
+               about finished jobs, in the order they were written.
+               @param exit Set to true if a finished job asked to end
+               the interactive loop.
+            */
+            std::string collect(bool& exit);
+
+            /**
+               @brief Returns the output stream of the job running in
+               the calling thread, or std::cout outside of jobs.
+
+               A job's output is handed over whenever the stream is
+               flushed and when the job ends.
+            */
+            static std::ostream& out();
+
+        private:
+            struct job;
+
+            void work(unsigned worker);
+
+            // Appends text for collect().
+            void post(const std::string& text);
+
+            // Same, but needs m_mutex.
+            void post_locked(const std::string& text);
+
+            // Needs m_mutex.
+            std::deque<boost::shared_ptr<job> >::iterator runnable();
+
+            unsigned m_next_id;
+            int m_fd;
+
+            mutable boost::mutex m_mutex;
+            boost::condition_variable m_cond;
+
+            std::deque<boost::shared_ptr<job> > m_queue;
+
+            // The job of each worker, or a null pointer.
+            std::vector<boost::shared_ptr<job> > m_running;
+            std::vector<boost::thread*> m_workers;
+            std::set<const void*> m_busy;
+
+            std::string m_output;
+            bool m_exit;
+            bool m_shutdown;
+
+            boost::thread_group m_threads;
+        };
+    }
+}
+
+#endif  // DMCC_READLINE_JOB_POOL_HPP
@@ -18,15 +18,31 @@
 
 
 #include "reader.hpp"
+#include "command_index.hpp"
+#include "command_tokenizer.hpp"
+#include "job_pool.hpp"
+#include "dir_cache.hpp"
 
 #include <boost/tokenizer.hpp>
 #include <boost/foreach.hpp>
-#include <boost/regex.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <set>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "exception/raise.hpp"
 
 #define RAISE_USER_ERR DMCC_RAISE_USER_ERR
@@ -49,33 +65,333 @@ namespace dmcc {
             // Command storage.
             cmd_pairs_t cmd_pairs;
 
+            // Names of the registered commands for the completion.
+            command_index cmd_index;
+
+            // Commands that are run on the worker threads.
+            std::set<std::string> async_cmds;
+
+
+            // Registers a command under its name.
+            void add_command(const std::string& name, const cmd_pair_ptr_t& cmd,
+                             reader::execution_t execution = reader::SYNC)
+            {
+                cmd_pairs[name] = cmd;
+                cmd_index.insert(name);
+
+                if(execution == reader::ASYNC)
+                    async_cmds.insert(name);
+                else
+                    async_cmds.erase(name);
+            }
+
+
+            // Emits the signal of an asynchronous command.
+            bool emit(const reader::signal_ptr_t& sig, const std::string& cmd,
+                      const reader::arglist_t& args)
+            {
+                return (*sig)(cmd, args);
+            }
+
+
+            // Trims a line read from the user and adds it to the history.
+            void remember(std::string& input)
+            {
+                boost::algorithm::trim(input);
+
+                if ( !input.empty() ) {
+                    if ((history_length == 0) ||
+                        (input != history_list()[ history_length - 1 ]->line))
+                    {
+                        add_history( input.c_str() );
+                        // if ( history_length >= static_cast< int >( HistoryLimit ) )
+                        // {
+                        //     stifle_history( HistoryLimit );
+                        // }
+                    }
+                }
+            }
+
+
+            // Line read by the callback interface of readline.
+            bool line_ready;
+            bool line_eof;
+            std::string line_input;
+
+            void line_handler(char* l)
+            {
+                line_ready = true;
+                line_eof = !l;
+
+                if(l) {
+                    line_input = l;
+                    free(l);
+                }
+
+                // Keeps readline from showing the prompt again before
+                // the command has run. It is installed again for the
+                // next line.
+                rl_callback_handler_remove();
+            }
+
+
+            // Prints text above the prompt and the line being edited.
+            void print_above_prompt(const std::string& text)
+            {
+                int point = rl_point;
+                char* line = rl_copy_text(0, rl_end);
+
+                rl_save_prompt();
+                rl_replace_line("", 0);
+                rl_redisplay();
+
+                std::cout << text << std::flush;
+
+                rl_restore_prompt();
+                rl_replace_line(line, 0);
+                rl_point = point;
+                rl_redisplay();
+
+                free(line);
+            }
+
+
+            // Tells whether the line starts with a complete command
+            // name, i.e. the name is followed by a blank, and stores
+            // the name. Is the same as matching
+            // "^[ \t]*([a-z0-9A-Z_]+)[ \t]+.*$" without a regex.
+            bool split_command_name(const char* line, std::string& name_out)
+            {
+                while(*line == ' ' || *line == '\t')
+                    ++line;
+
+                const char* begin = line;
+
+                while((*line >= 'a' && *line <= 'z') ||
+                      (*line >= 'A' && *line <= 'Z') ||
+                      (*line >= '0' && *line <= '9') || *line == '_')
+                    ++line;
+
+                if(line == begin || (*line != ' ' && *line != '\t'))
+                    return false;
+
+                name_out.assign(begin, line);
+                return true;
+            }
+
 
             // Cuts a command into cmd-name and arguments. Quoted arguments
-            // are supported (see boost tokenizer doc).
+            // are supported (see command_tokenizer).
             // Empty arguments are abandoned.
-            void parse_command(const std::string& raw,
+            // The output strings are assigned, not replaced, so they
+            // keep their storage when they are passed in again.
+            void parse_command(command_tokenizer& tok,
+                               const char* begin, const char* end,
                                std::string& name_out /* cmd-name output */,
                                reader::arglist_t& arglist_out      /* cmd-argument output */)
             {
-                boost::escaped_list_separator<char> sep_func("\\", " ", "\"'");
-                reader::tokenizer_t tok(raw, sep_func);
+                const command_tokenizer::tokens_t& tokens = tok(begin, end);
 
-                // Set to true after the command (first token) was encountered.
-                bool found_cmd = false;
+                if(tokens.empty()) {
+                    name_out.clear();
+                    arglist_out.clear();
+                    return;
+                }
+
+                name_out.assign(tokens[0].data(), tokens[0].size());
+                arglist_out.resize(tokens.size() - 1);
+
+                for(size_t i = 1; i < tokens.size(); ++i)
+                    arglist_out[i - 1].assign(tokens[i].data(), tokens[i].size());
+            }
+
+
+            // Returns the signal of a registered command or a null pointer.
+            reader::signal_ptr_t find_signal(const std::string& name)
+            {
+                cmd_pairs_t::const_iterator it = cmd_pairs.find(name);
+
+                if(it == cmd_pairs.end() || !it->second)
+                    return reader::signal_ptr_t();
+
+                return it->second->first;
+            }
+
+
+            // Size of the reads from pipes and terminals in batch mode.
+            const size_t BATCH_BUFFER_SIZE = 1 << 20;
+
+            // Default batch error callback.
+            void print_batch_error(size_t line_no, const std::string&,
+                                   const std::exception& error)
+            {
+                std::cerr << "line " << line_no << ": " << error.what() << std::endl;
+            }
 
-                reader::tokenizer_t::iterator iter = tok.begin();
-                for(; iter != tok.end(); ++iter) {
-                    if(iter->empty())
-                        continue;
 
-                    if(!found_cmd) {
-                        // Command-name encountered -> set output reference.
-                        name_out = *iter;
-                        found_cmd = true;
+            // Splits blocks of input into lines and dispatches them.
+            // The tokenizer and the strings are kept between the
+            // lines, so they don't allocate once they have grown.
+            class batch_runner
+            {
+            public:
+                batch_runner(const reader::batch_error_func_t& error_cb)
+                    : m_error_cb(error_cb), m_begin(0), m_end(0)
+                    {
+                        if(m_error_cb.empty())
+                            m_error_cb = print_batch_error;
                     }
-                    else
-                        arglist_out.push_back(*iter);
+
+                // Runs the complete lines in [begin, end) and returns
+                // the start of the incomplete last line. At the end of
+                // the input that line is run as well.
+                const char* feed(const char* begin, const char* end, bool eof)
+                    {
+                        while(!result.exited) {
+                            const char* nl = static_cast<const char*>(
+                                memchr(begin, '\n', end - begin));
+
+                            if(!nl)
+                                break;
+
+                            run_line(begin, nl);
+                            begin = nl + 1;
+                        }
+
+                        if(eof && begin != end && !result.exited) {
+                            run_line(begin, end);
+                            begin = end;
+                        }
+
+                        return begin;
+                    }
+
+                reader::batch_result result;
+
+            private:
+                void run_line(const char* begin, const char* end)
+                    {
+                        ++result.lines;
+
+                        while(begin != end && isspace(static_cast<unsigned char>(*begin)))
+                            ++begin;
+                        while(end != begin && isspace(static_cast<unsigned char>(end[-1])))
+                            --end;
+
+                        if(begin == end || *begin == '#')
+                            return;
+
+                        m_begin = begin;
+                        m_end = end;
+
+                        try {
+                            parse_command(m_tok, begin, end, m_cmd, m_args);
+
+                            if(m_cmd.empty())
+                                return;
+
+                            if(m_cmd == "exit" || m_cmd == "quit") {
+                                result.exited = true;
+                                return;
+                            }
+
+                            reader::signal_ptr_t sig = find_signal(m_cmd);
+
+                            if(!sig) {
+                                report(dmcc::exception::user_error(
+                                           "command not found: " + m_cmd,
+                                           dmcc::exception::user_error::ERROR)
+                                       .set_file(__FILE__).set_line(__LINE__));
+                                return;
+                            }
+
+                            ++result.commands;
+                            result.exited = (*sig)(m_cmd, m_args);
+                        }
+                        catch(const std::exception& e) {
+                            report(e);
+                        }
+                    }
+
+                void report(const std::exception& error)
+                    {
+                        ++result.errors;
+                        m_error_cb(result.lines, std::string(m_begin, m_end), error);
+                    }
+
+                reader::batch_error_func_t m_error_cb;
+
+                // The line being run.
+                const char* m_begin;
+                const char* m_end;
+
+                command_tokenizer m_tok;
+                std::string m_cmd;
+                reader::arglist_t m_args;
+            };
+
+
+            // Returns a malloced copy of a string, which will be
+            // freed by readline.
+            char* rl_string(const std::string& str)
+            {
+                char* alloc = static_cast<char*>(malloc(str.size() + 1));
+                strcpy(alloc, str.c_str());
+
+                return alloc;
+            }
+
+
+            // Listings of the directories that file names were completed in.
+            dir_cache dir_listings;
+
+            // Completes file names like rl_filename_completion_function(),
+            // but from cached listings, so repeated and narrowing
+            // completions in large directories don't read them again.
+            char* filename_compl(const char* text, int state)
+            {
+                // Directory part as typed and the rest of the text.
+                static std::string dir_part;
+                static std::string prefix;
+                static command_index::range_t matches;
+                static bool match_hidden;
+
+                if(state == 0) {
+                    const char* value = rl_variable_value("match-hidden-files");
+                    match_hidden = !value || strcmp(value, "off") != 0;
+
+                    const char* slash = strrchr(text, '/');
+
+                    dir_part.assign(text, slash ? slash + 1 - text : 0);
+                    prefix.assign(slash ? slash + 1 : text);
+
+                    std::string dir = dir_part.empty() ? std::string(".") : dir_part;
+
+                    if(dir[0] == '~') {
+                        char* expanded = tilde_expand(dir.c_str());
+                        dir = expanded;
+                        free(expanded);
+                    }
+
+                    matches = dir_listings.lookup(dir, prefix.data(), prefix.size());
+
+                    // Lets readline append slashes to directories and quote.
+                    rl_filename_completion_desired = 1;
+                }
+
+                while(matches.first != matches.second) {
+                    const std::string& name = *matches.first++;
+
+                    // Like readline, offer "." and ".." and hidden files
+                    // only if the text asks for them.
+                    if(prefix.empty() && (name == "." || name == ".." ||
+                                          (!match_hidden && name[0] == '.')))
+                        continue;
+
+                    return rl_string(dir_part + name);
                 }
+
+                return 0;
             }
 
 
@@ -87,27 +403,16 @@ namespace dmcc {
             {
                 static bool do_cmd_compl;
                 static std::string cmd_name;
-                static cmd_pairs_t::const_iterator iterator;
-
-                std::string ret;
+                static command_index::range_t matches;
 
                 if(state == 0) {
                     // Initialize the stuff and detect
                     // the completion situation.
 
-                    boost::cmatch res;
-                    boost::regex reg("^[ \t]*([a-z0-9A-Z_]+)[ \t]+.*$");
-
-                    if(boost::regex_match(rl_line_buffer, res, reg)) {
-                        do_cmd_compl = false;
+                    do_cmd_compl = !split_command_name(rl_line_buffer, cmd_name);
 
-                        if(res.size() >= 1)
-                            cmd_name = res[1];
-                    }
-                    else
-                        do_cmd_compl = true;
-
-                    iterator = cmd_pairs.begin();
+                    if(do_cmd_compl)
+                        matches = cmd_index.prefix(text, strlen(text));
                 }
 
 
@@ -129,79 +434,189 @@ namespace dmcc {
                         else
                             // If there is no callback function, do simple
                             // filename completion.
-                            return rl_filename_completion_function(text, state);
+                            return filename_compl(text, state);
                     }
                 }
-                else {
-                    // Do command completion.
-
-                    size_t match_len = strlen(text);
+                else if(matches.first != matches.second) {
+                    // Do command completion: hand out the next name
+                    // of the range that was looked up for the prefix.
 
-                    // Loop through all available commands and try to find a match.
-                    for(; iterator != cmd_pairs.end(); ++iterator) {
-                        if(strncmp(text, iterator->first.c_str(), match_len) == 0) {
-                            // Matching command found.
-
-                            ret = iterator->first;
-
-                            ++iterator;
-                            break;
-                        }
-                    }
+                    return rl_string(*matches.first++);
                 }
 
-                if(ret.empty())
-                    return 0;
-                else {
-                    // Do the dirty malloc stuff for readline.
-
-                    // Malloced string that will be freed by readline.
-                    char* alloc = static_cast<char*>(malloc(ret.size() + 1));
-                    strcpy(alloc, ret.c_str());
-
-                    return alloc;
-                }
+                return 0;
             }
         }
 
 
         reader::reader(const std::string& history_file, int history_size,
                        const std::string& prompt)
-            : m_prompt(prompt), m_exit(false)
+            : m_prompt(prompt), m_exit(false), m_workers(0)
         {
             rl_completion_entry_function = compl_proxy;
+
+            cmd_index.insert("jobs");
+            cmd_index.insert("cancel");
+        }
+
+        reader::~reader()
+        {
         }
 
 
         void reader::run_mainloop()
         {
-            typedef boost::shared_ptr<str_arglist_sig_t> signal_ptr_t;
+            command_tokenizer tok;
+            arglist_t args;
+            std::string cmd;
+
+            int input = fileno(rl_instream ? rl_instream : stdin);
 
             while(!m_exit) {
-                arglist_t args;
-                std::string cmd;
-        
-                std::string input_str = this->readline();
+                // Read a line through the callback interface, so the
+                // output of asynchronous commands can be printed while
+                // the user is typing.
+                line_ready = false;
+                rl_callback_handler_install(m_prompt.c_str(), line_handler);
+
+                while(!line_ready && !m_exit) {
+                    pollfd fds[2];
+                    fds[0].fd = input;
+                    fds[0].events = POLLIN;
+                    fds[1].fd = m_jobs ? m_jobs->fd() : -1;
+                    fds[1].events = POLLIN;
+
+                    if(poll(fds, 2, -1) == -1) {
+                        if(errno == EINTR)
+                            continue;
+
+                        rl_callback_handler_remove();
+                        DMCC_RAISE_LINUX_SYS_ERR("unable to poll the input");
+                    }
+
+                    if(fds[1].revents & POLLIN)
+                        print_jobs();
 
-                parse_command(input_str, cmd, args);
+                    if(fds[0].revents)
+                        rl_callback_read_char();
+                }
+
+                if(!line_ready) {
+                    // An asynchronous command asked to exit.
+                    rl_callback_handler_remove();
+                    break;
+                }
+
+                if(line_eof) {
+                    m_exit = true;
+                    break;
+                }
+
+                remember(line_input);
+
+                parse_command(tok, line_input.data(),
+                              line_input.data() + line_input.size(), cmd, args);
 
                 if(cmd == "exit" || cmd == "quit")
                     // Eat exit or quit requests directly and break the loop.
                     break;
-                else if(!cmd.empty()) {
-                    // Emit signal to connectors.
-                    cmd_pair_ptr_t cmd_pair_ptr = cmd_pairs[cmd];
+                else if(!cmd.empty())
+                    run_command(cmd, args, line_input);
+            }
+        }
 
-                    if(cmd_pair_ptr) {
-                        signal_ptr_t sig = cmd_pair_ptr->first;
+        void reader::run_command(const std::string& cmd, const arglist_t& args,
+                                 const std::string& line)
+        {
+            // Emit signal to connectors.
+            cmd_pairs_t::const_iterator it = cmd_pairs.find(cmd);
 
-                        if(sig)
-                            m_exit = (*sig)(cmd, args);
-                        else
-                            RAISE_USER_ERR("command not found: " + cmd);
-                    }
+            if(it != cmd_pairs.end() && it->second) {
+                signal_ptr_t sig = it->second->first;
+
+                if(!sig)
+                    RAISE_USER_ERR("command not found: " + cmd);
+
+                if(async_cmds.count(cmd)) {
+                    // Jobs of one signal run one after another, see job_pool.
+                    unsigned id = jobs().submit(line, sig.get(),
+                                                boost::bind(emit, sig, cmd, args));
+
+                    std::cout << "[" << id << "] " << line << std::endl;
                 }
+                else
+                    m_exit = (*sig)(cmd, args);
+            }
+            else if(cmd == "jobs")
+                list_jobs();
+            else if(cmd == "cancel")
+                cancel_jobs(args);
+        }
+
+        void reader::list_jobs()
+        {
+            std::vector<job_pool::job_info> infos;
+
+            if(m_jobs)
+                infos = m_jobs->jobs();
+
+            if(infos.empty())
+                std::cout << "no jobs" << std::endl;
+
+            for(size_t i = 0; i < infos.size(); ++i) {
+                const job_pool::job_info& info = infos[i];
+
+                const char* state = !info.running ? "queued"
+                    : info.cancelled ? "cancelling" : "running";
+
+                std::cout << "[" << info.id << "] " << std::left << std::setw(11) << state
+                          << std::right << std::setw(8) << info.age.total_seconds() << "s  "
+                          << info.line << std::endl;
+            }
+        }
+
+        void reader::cancel_jobs(const arglist_t& args)
+        {
+            // A mistyped builtin is no reason to end the session, so
+            // the errors are only reported.
+            if(args.empty()) {
+                std::cerr << "usage: cancel <job>..." << std::endl;
+                return;
             }
+
+            std::string unknown;
+
+            for(size_t i = 0; i < args.size(); ++i) {
+                char* end;
+                unsigned long id = strtoul(args[i].c_str(), &end, 10);
+
+                if(*end || !m_jobs || !m_jobs->cancel(id))
+                    unknown += " " + args[i];
+            }
+
+            if(!unknown.empty())
+                std::cerr << "no such job:" << unknown << std::endl;
+        }
+
+        void reader::print_jobs()
+        {
+            bool exit = false;
+            std::string text = m_jobs->collect(exit);
+
+            if(!text.empty())
+                print_above_prompt(text);
+
+            if(exit)
+                m_exit = true;
+        }
+
+        job_pool& reader::jobs()
+        {
+            if(!m_jobs)
+                m_jobs.reset(new job_pool(m_workers ? m_workers
+                                          : std::max(1u, boost::thread::hardware_concurrency())));
+
+            return *m_jobs;
         }
 
         std::string reader::readline()
@@ -218,21 +633,106 @@ namespace dmcc {
             std::string input(l);
             free(l);
 
-            boost::algorithm::trim(input);
-    
-            if ( !input.empty() ) {
-                if ((history_length == 0) ||
-                    (input != history_list()[ history_length - 1 ]->line))
-                {
-                    add_history( input.c_str() );
-                    // if ( history_length >= static_cast< int >( HistoryLimit ) )
-                    // {
-                    //     stifle_history( HistoryLimit );
-                    // }
+            remember(input);
+
+            return input;
+        }
+
+        reader::batch_result::batch_result()
+            : lines(0), commands(0), errors(0), exited(false)
+        {
+        }
+
+        reader::batch_result reader::run_batch(int fd,
+                                               const batch_error_func_t& error_cb)
+        {
+            batch_runner runner(error_cb);
+
+            struct stat st;
+            off_t offset = lseek(fd, 0, SEEK_CUR);
+
+            if(offset != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+               st.st_size > offset) {
+                // Run a regular file right from the page cache.
+                void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if(map != MAP_FAILED) {
+                    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+                    const char* base = static_cast<const char*>(map);
+                    const char* pos = runner.feed(base + offset, base + st.st_size, true);
+
+                    munmap(map, st.st_size);
+                    lseek(fd, pos - base, SEEK_SET);
+
+                    return runner.result;
                 }
             }
 
-            return input;
+            std::vector<char> buffer(BATCH_BUFFER_SIZE);
+            size_t fill = 0;
+
+            for(;;) {
+                // A line that doesn't fit makes the buffer grow.
+                if(fill == buffer.size())
+                    buffer.resize(buffer.size() * 2);
+
+                ssize_t n = ::read(fd, &buffer[fill], buffer.size() - fill);
+
+                if(n == -1) {
+                    if(errno == EINTR)
+                        continue;
+
+                    DMCC_RAISE_LINUX_SYS_ERR("unable to read commands");
+                }
+
+                fill += n;
+
+                const char* begin = &buffer[0];
+                const char* rest = runner.feed(begin, begin + fill, n == 0);
+
+                if(runner.result.exited) {
+                    // Give back what was read past the exit. Fails
+                    // on pipes, their rest is lost.
+                    off_t ahead = begin + fill - rest;
+
+                    if(ahead)
+                        lseek(fd, -ahead, SEEK_CUR);
+
+                    break;
+                }
+
+                if(n == 0)
+                    break;
+
+                fill -= rest - begin;
+                memmove(&buffer[0], rest, fill);
+            }
+
+            return runner.result;
+        }
+
+        reader::batch_result reader::run_batch(const std::string& file,
+                                               const batch_error_func_t& error_cb)
+        {
+            int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+            if(fd == -1)
+                DMCC_RAISE_LINUX_SYS_ERR("unable to open `" + file + "'");
+
+            batch_result result;
+
+            try {
+                result = run_batch(fd, error_cb);
+            }
+            catch(...) {
+                close(fd);
+                throw;
+            }
+
+            close(fd);
+
+            return result;
         }
 
         reader& reader::operator<<(const simple_command_t& cmd)
@@ -240,8 +740,8 @@ namespace dmcc {
             signal_ptr_t sig = signal_ptr_t(new str_arglist_sig_t());
             sig->connect(cmd.get<1>());
 
-            cmd_pairs[cmd.get<0>()] = cmd_pair_ptr_t(
-                new cmd_pair_t(sig, reader::compl_func_t()));
+            add_command(cmd.get<0>(), cmd_pair_ptr_t(
+                            new cmd_pair_t(sig, reader::compl_func_t())));
 
             return *this;
         }
@@ -251,21 +751,46 @@ namespace dmcc {
             signal_ptr_t sig = signal_ptr_t(new str_arglist_sig_t);
             sig->connect(cmd.get<1>());
     
-            cmd_pairs[cmd.get<0>()] = cmd_pair_ptr_t(new cmd_pair_t(sig, cmd.get<2>()));
+            add_command(cmd.get<0>(), cmd_pair_ptr_t(new cmd_pair_t(sig, cmd.get<2>())));
 
             return *this;
         }
 
         reader::signal_ptr_t reader::add(const std::string& cmd,
-                                         const compl_func_t& completion_cb)
+                                         const compl_func_t& completion_cb,
+                                         execution_t execution)
         {
             signal_ptr_t sig = signal_ptr_t(new str_arglist_sig_t);
     
-            cmd_pairs[cmd] = cmd_pair_ptr_t(new cmd_pair_t(sig, completion_cb));
+            add_command(cmd, cmd_pair_ptr_t(new cmd_pair_t(sig, completion_cb)),
+                        execution);
 
             return sig;
         }
 
+        reader& reader::set_execution(const std::string& cmd, execution_t execution)
+        {
+            if(!cmd_pairs.count(cmd))
+                RAISE_USER_ERR("command not found: " + cmd);
+
+            if(execution == ASYNC)
+                async_cmds.insert(cmd);
+            else
+                async_cmds.erase(cmd);
+
+            return *this;
+        }
+
+        void reader::set_workers(unsigned threads)
+        {
+            m_workers = threads;
+        }
+
+        std::ostream& reader::out()
+        {
+            return job_pool::out();
+        }
+
 
         boost::escaped_list_separator<char> reader::separator =
                                   boost::escaped_list_separator<char>("", "", "");
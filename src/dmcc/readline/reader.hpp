@@ -26,12 +26,16 @@
 #include <stdexcept>
 
 #include <boost/signal.hpp>
+#include <boost/function.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/tokenizer.hpp>
 
 namespace dmcc {
     namespace readline {
+        class job_pool;
+
         /**
            @brief Is used as proxy to design an interface between
            the dynamically allocated strings of readline and modern c++ strings.
@@ -76,6 +80,11 @@ namespace dmcc {
         /**
          * @brief Reads commands from the command-line and
          * throws appropriate signals. (using boost::signal).
+         *
+         * Asynchronous commands are run on a pool of worker threads
+         * while the prompt stays usable. The builtin commands "jobs"
+         * and "cancel <job>..." list and cancel them, unless
+         * commands of these names are registered.
          */
         class reader
         {
@@ -101,6 +110,49 @@ namespace dmcc {
                                  const str_arglist_sig_t::slot_type&,
                                  const  compl_func_t&> command_t;
 
+            /**
+             * @brief Tells where the slots of a command are called.
+             *
+             * SYNC commands run in the thread of run_mainloop(), ASYNC
+             * commands are queued for a worker thread. Their slots
+             * should print through out(), which makes the output
+             * appear above the prompt. Returning true from an ASYNC
+             * slot ends run_mainloop() once the job is finished.
+             * run_batch() runs every command synchronously.
+             */
+            enum execution_t {
+                SYNC,
+                ASYNC
+            };
+
+            /**
+             * @brief Is called by run_batch() for each line that
+             * failed, with its number (starting at 1), the line and
+             * the error.
+             */
+            typedef boost::function<void (size_t, const std::string&,
+                                          const std::exception&)> batch_error_func_t;
+
+            /**
+             * @brief Counts the lines run by run_batch().
+             */
+            struct batch_result
+            {
+                batch_result();
+
+                // Lines read, including empty ones and comments.
+                size_t lines;
+
+                // Lines that were dispatched to a command.
+                size_t commands;
+
+                // Lines that were reported to the error callback.
+                size_t errors;
+
+                // Set if "exit", "quit" or a slot ended the batch.
+                bool exited;
+            };
+
 
             /**
              * @brief Constructs new reader.
@@ -110,11 +162,17 @@ namespace dmcc {
             reader(const std::string& history_file, int history_size,
                    const std::string& prompt = "%> ");
 
+            /**
+             * @brief Cancels the asynchronous commands and waits for them.
+             */
+            ~reader();
+
             /**
              * @brief Runs the main loop.
              *
              * The user is constantly asked for commands and
-             * signals are emitted.
+             * signals are emitted. Output of asynchronous commands
+             * is printed above the line being edited.
              */
             void run_mainloop();
 
@@ -127,20 +185,82 @@ namespace dmcc {
              */
             std::string readline();
 
+            /**
+             * @brief Runs the commands read from a descriptor, without
+             * prompting, line editing or history.
+             *
+             * Regular files are mapped, everything else is read in
+             * large blocks. Empty lines and lines starting with '#'
+             * are skipped. Unknown commands, bad quoting and
+             * exceptions thrown by the slots are passed to error_cb,
+             * which prints them to std::cerr by default, and the
+             * batch goes on with the next line.
+             *
+             * A seekable descriptor is left behind the last line that
+             * was run. Pipes and terminals are read ahead in blocks,
+             * so what follows an exit or quit may be consumed.
+             */
+            batch_result run_batch(int fd,
+                                   const batch_error_func_t& error_cb = batch_error_func_t());
+
+            /**
+             * @brief Runs the commands read from a file.
+             */
+            batch_result run_batch(const std::string& file,
+                                   const batch_error_func_t& error_cb = batch_error_func_t());
+
             reader& operator<<(const simple_command_t& cmd);
 
             reader& operator<<(const command_t& cmd);
 
             signal_ptr_t add(const std::string& cmd,
-                             const compl_func_t& completion_cb = compl_func_t());
+                             const compl_func_t& completion_cb = compl_func_t(),
+                             execution_t execution = SYNC);
+
+            /**
+             * @brief Changes how a registered command is run, e.g.
+             * one that was added by operator<<.
+             */
+            reader& set_execution(const std::string& cmd, execution_t execution);
+
+            /**
+             * @brief Sets the number of worker threads for asynchronous
+             * commands, 0 meaning one per core. Takes effect when the
+             * first asynchronous command is run.
+             */
+            void set_workers(unsigned threads);
+
+            /**
+             * @brief Returns the stream that slots should print to.
+             *
+             * Is std::cout for synchronous commands. For asynchronous
+             * ones it is handed to the prompt line by line, on flush
+             * and when the command ends.
+             */
+            static std::ostream& out();
 
             // Fields.
             static boost::escaped_list_separator<char> separator;
 
         private:
+            // Runs a command that was read by run_mainloop().
+            void run_command(const std::string& cmd, const arglist_t& args,
+                             const std::string& line);
+
+            // The builtins.
+            void list_jobs();
+            void cancel_jobs(const arglist_t& args);
+
+            // Prints the output of the asynchronous commands.
+            void print_jobs();
+
+            job_pool& jobs();
 
             std::string m_prompt;
             bool m_exit;
+
+            unsigned m_workers;
+            boost::scoped_ptr<job_pool> m_jobs;
         };
     }
 }